@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "extract_ext.h"
+#include "compress_ext.h"
+#include "chunk_ext.h"
+#include "encode_ext.h"
+#include "png_ext.h"
+#include "apng_ext.h"
+
+#include "debug_util.h"
+
+// ref: https://wiki.mozilla.org/APNG_Specification
+#define APNG_DISPOSE_OP_NONE 0
+#define APNG_DISPOSE_OP_PREVIOUS 2
+#define APNG_BLEND_OP_SOURCE 0
+
+// frames being filtered/compressed at once; at the peak we hold the canvas,
+// the previous and current frames, and this many cropped regions with their
+// filtered lines and compressed output
+#define MAX_FRAMES_IN_FLIGHT 2
+
+typedef struct {
+	void *region;
+	int x;
+	int y;
+	int width;
+	int height;
+	Format format;
+	uint8_t dispose;	// what happens to the region once the frame has been shown
+	void *compressed;
+	int length;
+	pthread_t thread;
+} FrameJob;
+
+// compare one pixel of two frames, BW frames are packed rows
+static bool same_at(void *a, void *b, int row, int col, int width, Format format) {
+	if (format == BW) {
+		size_t byte = (size_t) row * PACKED_ROW_BYTES(width) + col / 8;
+		uint8_t diff = ((uint8_t *) a)[byte] ^ ((uint8_t *) b)[byte];
+		return (diff & (0x80 >> (col % 8))) == 0;
+	}
+	size_t index = (size_t) row * width + col;
+	return same_pixel(((Pixel *) a)[index], ((Pixel *) b)[index], format);
+}
+
+static bool same_row(void *a, void *b, int row, int width, Format format) {
+	if (format == BW) {
+		// padding bits are always 0, so whole bytes can be compared
+		size_t row_bytes = PACKED_ROW_BYTES(width);
+		return memcmp((uint8_t *) a + row * row_bytes, (uint8_t *) b + row * row_bytes, row_bytes) == 0;
+	}
+	for (int col = 0; col < width; col++) {
+		if (!same_at(a, b, row, col, width, format)) return false;
+	}
+	return true;
+}
+
+// bounding box of the pixels that differ between two frames
+// an unchanged frame still needs a region, so it becomes a single pixel
+static void changed_region(void *prev, void *cur, int width, int height, Format format, FrameJob *job) {
+	int top = 0;
+	while (top < height && same_row(prev, cur, top, width, format)) {
+		top++;
+	}
+	if (top == height) {
+		job->x = job->y = 0;
+		job->width = job->height = 1;
+		return;
+	}
+
+	int bottom = height - 1;
+	while (same_row(prev, cur, bottom, width, format)) {
+		bottom--;
+	}
+
+	int left = width;
+	int right = -1;
+	for (int row = top; row <= bottom; row++) {
+		// only the columns outside the current box can still grow it
+		int col = 0;
+		while (col < left && same_at(prev, cur, row, col, width, format)) col++;
+		if (col < left) left = col;
+		col = width - 1;
+		while (col > right && same_at(prev, cur, row, col, width, format)) col--;
+		if (col > right) right = col;
+	}
+
+	job->x = left;
+	job->y = top;
+	job->width = right - left + 1;
+	job->height = bottom - top + 1;
+}
+
+// copy a packed BW region, shifting it so it starts on a byte boundary
+static uint8_t *crop_packed(uint8_t *packed, int width, FrameJob *job) {
+	size_t in_bytes = PACKED_ROW_BYTES(width);
+	size_t out_bytes = PACKED_ROW_BYTES(job->width);
+	uint8_t *region = malloc(out_bytes * job->height);
+	assert(region != NULL);
+
+	int shift = job->x % 8;
+	uint8_t mask = (job->width % 8 == 0) ? 0xFF : (uint8_t) (0xFF << (8 - job->width % 8));
+	for (int row = 0; row < job->height; row++) {
+		uint8_t *in = packed + (job->y + row) * in_bytes + job->x / 8;
+		uint8_t *out = region + row * out_bytes;
+		size_t available = in_bytes - job->x / 8;
+		for (size_t b = 0; b < out_bytes; b++) {
+			uint8_t next = (b + 1 < available) ? in[b + 1] : 0;
+			out[b] = shift == 0 ? in[b] : (uint8_t) ((in[b] << shift) | (next >> (8 - shift)));
+		}
+		out[out_bytes - 1] &= mask;
+	}
+	return region;
+}
+
+static void *crop(void *pixels, int width, FrameJob *job) {
+	if (job->format == BW) {
+		return crop_packed(pixels, width, job);
+	}
+
+	Pixel *region = malloc(sizeof(Pixel) * job->width * job->height);
+	assert(region != NULL);
+	for (int row = 0; row < job->height; row++) {
+		memcpy(region + row * job->width,
+				(Pixel *) pixels + (job->y + row) * width + job->x,
+				sizeof(Pixel) * job->width);
+	}
+	return region;
+}
+
+static void *compress_frame(void *arg) {
+	FrameJob *job = arg;
+	job->compressed = deflate_pixels(NULL, job->region, job->width, job->height, job->format, &job->length);
+	free(job->region);
+	job->region = NULL;
+	return NULL;
+}
+
+static void write_frame(FrameJob *job, bool is_default, uint32_t *sequence,
+		uint16_t delay_num, uint16_t delay_den, FILE *out) {
+	panic_if(pthread_join(job->thread, NULL) != 0, "Failed to join frame worker");
+
+	// samples are always opaque, so SOURCE gives the same result as OVER without the
+	// compositing (and OVER could never skip a pixel, there is no alpha to clear it)
+	Chunk *fctl = chunk_fctl(sequence, job->width, job->height, job->x, job->y,
+			delay_num, delay_den, job->dispose, APNG_BLEND_OP_SOURCE);
+	encode_chunk(fctl, out);
+	free_chunk(fctl);
+
+	// the first frame doubles as the static image, so it is stored as IDAT
+	ChunkList *data = is_default
+		? chunk_idat(job->compressed, job->length)
+		: chunk_fdat(job->compressed, job->length, sequence);
+	encode_chunk_list(data, out);
+	free_chunk_list(data);
+	free(job->compressed);
+	job->compressed = NULL;
+}
+
+void write_apng(char **frames, int count, uint16_t delay_num, uint16_t delay_den,
+		uint32_t plays, FILE *out) {
+	panic_if(count < 1, "At least one frame is required");
+
+	Format format = BW;
+	int height = 0;
+	int width = 0;
+	// the frame before cur, and the canvas it was drawn over
+	void *prev = NULL;
+	void *canvas = NULL;
+	FrameJob *prev_job = NULL;
+
+	FrameJob jobs[MAX_FRAMES_IN_FLIGHT];
+	int written = 0;
+	uint32_t sequence = 0;
+
+	for (int i = 0; i < count; i++) {
+		Format frame_format;
+		int frame_height;
+		int frame_width;
+		void *cur = extract(frames[i], &frame_format, &frame_height, &frame_width);
+
+		if (i == 0) {
+			format = frame_format;
+			height = frame_height;
+			width = frame_width;
+
+			encode_signature(out);
+			Chunk *ihdr = chunk_ihdr(width, height, format);
+			Chunk *actl = chunk_actl(count, plays);
+			encode_chunk(ihdr, out);
+			encode_chunk(actl, out);
+			free_chunk(ihdr);
+			free_chunk(actl);
+		} else {
+			panic_if(frame_format != format || frame_height != height || frame_width != width,
+					"All frames must share the same format and dimensions");
+		}
+
+		// wait for the oldest frame before reusing its slot
+		FrameJob *job = &jobs[i % MAX_FRAMES_IN_FLIGHT];
+		if (i - written == MAX_FRAMES_IN_FLIGHT) {
+			write_frame(job, written == 0, &sequence, delay_num, delay_den, out);
+			written++;
+		}
+
+		if (i == 0) {
+			job->x = job->y = 0;
+			job->width = width;
+			job->height = height;
+		} else {
+			changed_region(prev, cur, width, height, format, job);
+			// a change that is undone by this frame (a blink, a cursor) is cheaper
+			// to revert with DISPOSE_OP_PREVIOUS than to draw back; the first
+			// frame has no previous canvas, PREVIOUS would clear it
+			FrameJob reverted;
+			if (canvas != NULL) {
+				changed_region(canvas, cur, width, height, format, &reverted);
+			}
+			if (canvas != NULL && (long) reverted.width * reverted.height < (long) job->width * job->height) {
+				prev_job->dispose = APNG_DISPOSE_OP_PREVIOUS;
+				job->x = reverted.x;
+				job->y = reverted.y;
+				job->width = reverted.width;
+				job->height = reverted.height;
+				free(prev);
+			} else {
+				free(canvas);
+				canvas = prev;
+			}
+		}
+		job->format = format;
+		job->dispose = APNG_DISPOSE_OP_NONE;
+		job->region = crop(cur, width, job);
+		panic_if(pthread_create(&job->thread, NULL, compress_frame, job) != 0,
+				"Failed to start frame worker");
+
+		prev = cur;
+		prev_job = job;
+	}
+	free(prev);
+	free(canvas);
+
+	for (; written < count; written++) {
+		write_frame(&jobs[written % MAX_FRAMES_IN_FLIGHT], written == 0, &sequence,
+				delay_num, delay_den, out);
+	}
+
+	Chunk *iend = chunk_iend();
+	encode_chunk(iend, out);
+	free_chunk(iend);
+}
@@ -0,0 +1,9 @@
+#ifndef APNG_H
+#define APNG_H
+
+// write an animated png from a sequence of PNM frames of the same size and format
+// delay is per frame, delay_num/delay_den seconds; plays = 0 loops forever
+extern void write_apng(char **frames, int count, uint16_t delay_num, uint16_t delay_den,
+		uint32_t plays, FILE *out);
+
+#endif
@@ -0,0 +1,301 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "extract_ext.h"
+#include "serialise_ext.h"
+#include "filter_ext.h"
+#include "compress_ext.h"
+#include "chunk_ext.h"
+#include "encode_ext.h"
+#include "decode_ext.h"
+#include "png_ext.h"
+#include "qoi_ext.h"
+#include "bench_ext.h"
+#include "zopfli_ext.h"
+#include "perf_ext.h"
+
+#include "debug_util.h"
+
+typedef enum {
+	STAGE_EXTRACT,
+	STAGE_SERIALISE,
+	STAGE_FILTER,
+	STAGE_FUSED,
+	STAGE_COMPRESS,
+	STAGE_ENCODE,
+	STAGE_DECODE,
+	STAGE_QOI_ENCODE,
+	STAGE_QOI_DECODE,
+	NUM_STAGES
+} Stage;
+
+static const char *stage_names[NUM_STAGES] = {
+	"extract",
+	"serialise",
+	"filter",
+	"fused",
+	"compress",
+	"encode",
+	"decode",
+	"qoi encode",
+	"qoi decode",
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// wall clock and event counts per stage, summed over iterations
+typedef struct {
+	Counters *counters;	// NULL when no counter could be opened
+	double seconds[NUM_STAGES];
+	double events[NUM_STAGES][NUM_COUNTERS];
+	double started;
+} Meter;
+
+// the counters are read outside the timed span, so they never cost wall clock
+static void stage_start(Meter *meter) {
+	if (meter->counters != NULL) counters_start(meter->counters);
+	meter->started = now();
+}
+
+static void stage_stop(Meter *meter, Stage stage) {
+	meter->seconds[stage] += now() - meter->started;
+	if (meter->counters != NULL) counters_stop(meter->counters, meter->events[stage]);
+}
+
+// events per MB of raw scanlines, and instructions per cycle, for every stage
+static void print_counters(Meter *meter, double mb, int iterations) {
+	Counters *counters = meter->counters;
+	printf("  %-10s %12s %12s %6s %10s %10s %10s %10s\n", "stage", "cycles/MB", "instr/MB", "IPC",
+			"L1d miss", "LLC miss", "br miss", "faults");
+	for (int s = 0; s < NUM_STAGES; s++) {
+		printf("  %-10s", stage_names[s]);
+		for (int c = 0; c < NUM_COUNTERS; c++) {
+			int width = c < COUNTER_L1D_MISSES ? 12 : 10;
+			if (c == COUNTER_L1D_MISSES) {
+				// IPC sits between the totals and the misses
+				if (counter_available(counters, COUNTER_CYCLES) && counter_available(counters, COUNTER_INSTRUCTIONS)
+						&& meter->events[s][COUNTER_CYCLES] > 0) {
+					printf(" %6.2f", meter->events[s][COUNTER_INSTRUCTIONS] / meter->events[s][COUNTER_CYCLES]);
+				} else {
+					printf(" %6s", "-");
+				}
+			}
+			if (counter_available(counters, c) && mb > 0) {
+				printf(" %*.0f", width, meter->events[s][c] / iterations / mb);
+			} else {
+				printf(" %*s", width, "-");
+			}
+		}
+		printf("\n");
+	}
+}
+
+// compare the high ratio encoder with zlib level 9; slow, so only once
+// the encoder is run on its own, since --max-ratio also runs level 9 and keeps
+// the smaller stream, which would hide losses and add the level 9 time
+// the figures go into report, printed after the stage table
+static void bench_max_ratio(uint8_t **mlines, int height, int line_len, int iterations,
+		char *report, size_t report_len) {
+	CompressSettings level9;
+	default_compress_settings(&level9);
+	level9.level = Z_BEST_COMPRESSION;
+
+	int zlib_len;
+	double t = now();
+	void *zlib = compress_lines_with(NULL, &level9, mlines, height, line_len, &zlib_len);
+	double zlib_seconds = now() - t;
+
+	size_t raw_len = (size_t) height * line_len;
+	uint8_t *data = malloc(raw_len);
+	assert(data != NULL);
+	for (int r = 0; r < height; r++) {
+		memcpy(data + (size_t) r * line_len, mlines[r], line_len);
+	}
+	int len;
+	t = now();
+	void *compressed = zopfli_compress(data, raw_len, iterations, &len);
+	double seconds = now() - t;
+	free(data);
+
+	// it has to inflate back to exactly the scanlines
+	uint8_t *raw = malloc(raw_len + 1);
+	assert(raw != NULL);
+	uLongf inflated = raw_len + 1;
+	panic_if(uncompress(raw, &inflated, compressed, len) != Z_OK || inflated != raw_len,
+			"High ratio stream does not inflate");
+	for (int r = 0; r < height; r++) {
+		panic_if(memcmp(raw + (size_t) r * line_len, mlines[r], line_len) != 0,
+				"High ratio stream inflates to different scanlines");
+	}
+	free(raw);
+
+	long saved = (long) zlib_len - len;
+	snprintf(report, report_len, "  max ratio (%d iterations): %d bytes in %.1f ms, "
+			"level 9: %d bytes in %.1f ms; %ld bytes (%.2f%%) saved, --max-ratio writes the %s stream\n",
+			iterations, len, seconds * 1e3, zlib_len, zlib_seconds * 1e3,
+			saved, zlib_len ? 100.0 * saved / zlib_len : 0.0, zlib_len < len ? "level 9" : "high ratio");
+	free(compressed);
+	free(zlib);
+}
+
+static void bench_one(char *source, int iterations, int max_ratio_iterations, Counters *counters) {
+	Meter meter = { .counters = counters };
+	size_t raw_bytes = 0;
+	size_t png_bytes = 0;
+	size_t qoi_bytes = 0;
+	char max_ratio_report[256] = "";
+
+	for (int it = 0; it < iterations; it++) {
+		Format format;
+		int height;
+		int width;
+		int scanline_width;
+		int len;
+
+		stage_start(&meter);
+		void *pixels = extract(source, &format, &height, &width);
+		stage_stop(&meter, STAGE_EXTRACT);
+
+		stage_start(&meter);
+		uint8_t **scanlines = serialise(pixels, width, height, format, &scanline_width);
+		stage_stop(&meter, STAGE_SERIALISE);
+
+		stage_start(&meter);
+		uint8_t **mlines = filter(scanlines, scanline_width, height, format);
+		stage_stop(&meter, STAGE_FILTER);
+
+		// the single pass kernel write_png uses, must match the two stages above
+		stage_start(&meter);
+		int fused_width;
+		uint8_t **fused = serialise_filter(pixels, width, height, format, &fused_width);
+		stage_stop(&meter, STAGE_FUSED);
+		for (int r = 0; r < height; r++) {
+			panic_if(memcmp(fused[r], mlines[r], scanline_width + 1) != 0,
+					"Fused serialise+filter differs from the separate stages");
+		}
+		free_lines(fused, height);
+
+		stage_start(&meter);
+		void *compressed = compress_lines(mlines, height, scanline_width + 1, &len);
+		stage_stop(&meter, STAGE_COMPRESS);
+
+		// encode into memory so the disk is not part of the figure
+		char *png = NULL;
+		size_t png_len = 0;
+		FILE *out = open_memstream(&png, &png_len);
+		panic_if(out == NULL, "Failed to open memory stream");
+
+		stage_start(&meter);
+		Chunk *ihdr = chunk_ihdr(width, height, format);
+		ChunkList *idats = chunk_idat(compressed, len);
+		Chunk *iend = chunk_iend();
+		encode(ihdr, idats, iend, out);
+		fclose(out);
+		stage_stop(&meter, STAGE_ENCODE);
+
+		FILE *in = fmemopen(png, png_len, "rb");
+		panic_if(in == NULL, "Failed to open memory stream");
+
+		stage_start(&meter);
+		Format decoded_format;
+		int decoded_height;
+		int decoded_width;
+		void *decoded = decode_png(in, &decoded_format, &decoded_height, &decoded_width);
+		stage_stop(&meter, STAGE_DECODE);
+		fclose(in);
+
+		panic_if(decoded_format != format || decoded_height != height || decoded_width != width
+				|| !same_pixels(pixels, decoded, width, height, format),
+				"Decoded image does not match the source");
+
+		// the other backend on the same pixels
+		stage_start(&meter);
+		int qoi_len;
+		void *qoi = qoi_encode(pixels, width, height, format, &qoi_len);
+		stage_stop(&meter, STAGE_QOI_ENCODE);
+
+		in = fmemopen(qoi, qoi_len, "rb");
+		panic_if(in == NULL, "Failed to open memory stream");
+
+		stage_start(&meter);
+		void *qoi_decoded = qoi_decode(in, &decoded_format, &decoded_height, &decoded_width);
+		stage_stop(&meter, STAGE_QOI_DECODE);
+		fclose(in);
+
+		panic_if(decoded_height != height || decoded_width != width
+				|| !qoi_same_pixels(pixels, format, qoi_decoded, width, height),
+				"Decoded qoi does not match the source");
+
+		if (it == 0 && max_ratio_iterations > 0) {
+			bench_max_ratio(mlines, height, scanline_width + 1, max_ratio_iterations,
+					max_ratio_report, sizeof(max_ratio_report));
+		}
+
+		raw_bytes = (size_t) scanline_width * height;
+		png_bytes = png_len;
+		qoi_bytes = qoi_len;
+
+		free(qoi_decoded);
+		free(qoi);
+
+		free(decoded);
+		free(png);
+		free_chunk(ihdr);
+		free_chunk_list(idats);
+		free_chunk(iend);
+		free(compressed);
+		free_lines(mlines, height);
+		free_lines(scanlines, height);
+		free(pixels);
+	}
+
+	double mb = raw_bytes / 1e6;
+	printf("%s: %zu raw bytes -> %zu png bytes (%.1f%%), %zu qoi bytes (%.1f%%), %d iterations\n",
+			source, raw_bytes, png_bytes, raw_bytes ? 100.0 * png_bytes / raw_bytes : 0.0,
+			qoi_bytes, raw_bytes ? 100.0 * qoi_bytes / raw_bytes : 0.0, iterations);
+	printf("  %-10s %12s %12s\n", "stage", "ms/iter", "MB/s");
+	double total = 0;
+	for (int s = 0; s < NUM_STAGES; s++) {
+		double per_iter = meter.seconds[s] / iterations;
+		// what write_png runs: the fused kernel replaces serialise and filter
+		if (s == STAGE_EXTRACT || s == STAGE_FUSED || s == STAGE_COMPRESS || s == STAGE_ENCODE) {
+			total += per_iter;
+		}
+		printf("  %-10s %12.3f %12.1f\n", stage_names[s], per_iter * 1e3,
+				per_iter > 0 ? mb / per_iter : 0.0);
+	}
+	printf("  %-10s %12.3f %12.1f\n", "encode all", total * 1e3, total > 0 ? mb / total : 0.0);
+	double qoi_total = (meter.seconds[STAGE_EXTRACT] + meter.seconds[STAGE_QOI_ENCODE]) / iterations;
+	printf("  %-10s %12.3f %12.1f\n", "qoi all", qoi_total * 1e3, qoi_total > 0 ? mb / qoi_total : 0.0);
+	if (counters != NULL) {
+		printf("  events per MB, counted in user space:\n");
+		print_counters(&meter, mb, iterations);
+	}
+	fputs(max_ratio_report, stdout);
+}
+
+void run_bench(char **sources, int count, int iterations, int max_ratio_iterations) {
+	panic_if(iterations < 1, "At least one benchmark iteration is required");
+	char reason[128];
+	Counters *counters = counters_open(reason, sizeof(reason));
+	if (counters == NULL) {
+		// the timings alone are still worth having
+		printf("event counters unavailable (%s), timing only\n", reason);
+	}
+	for (int i = 0; i < count; i++) {
+		bench_one(sources[i], iterations, max_ratio_iterations, counters);
+	}
+	counters_close(counters);
+}
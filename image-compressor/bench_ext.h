@@ -0,0 +1,12 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// time every pipeline stage (and decoding the result) over each source
+// throughput is reported against the raw scanline bytes of the image
+// with max_ratio_iterations > 0 the high ratio encoder is also run once per
+// source and compared with zlib level 9 on the same scanlines
+// where perf_event_open allows, cycles, instructions, cache and branch misses
+// and page faults are counted per stage too, per MB of raw scanlines
+extern void run_bench(char **sources, int count, int iterations, int max_ratio_iterations);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -9,6 +10,7 @@
 
 #define GREY_COLOR_TYPE 0
 #define FULL_COLOR_TYPE 2
+#define INDEXED_COLOR_TYPE 3
 
 #define BINARY_BIT_WIDTH 1
 #define DEFAULT_BIT_WIDTH 8
@@ -52,8 +54,6 @@ unsigned long crc(unsigned char *buf, int len)
 }
 
 
-// Max size for one IDAT chunk’s data field 2³¹−1 bytes
-#define MAX_IDAT_DATA 8192 
 
 Chunk* create_chunk(const char type[5], const uint8_t* data, uint32_t length) {
     // allocate and initialize chunk structure
@@ -140,6 +140,16 @@ Chunk* chunk_iend(void) {
     return create_chunk("IEND", NULL, 0);
 }
 
+// indexed header, palette entries are always stored one byte per pixel
+Chunk* chunk_ihdr_indexed(uint32_t width, uint32_t height) {
+    return create_ihdr(width, height, DEFAULT_BIT_WIDTH, INDEXED_COLOR_TYPE, 0, 0, 0);
+}
+
+Chunk* chunk_plte(const uint8_t *rgb, int count) {
+    assert(count >= 1 && count <= 256);
+    return create_chunk("PLTE", rgb, 3 * count);
+}
+
 //first chunk in png strema 
 Chunk* create_ihdr(uint32_t width, uint32_t height,
                    uint8_t bit_depth, uint8_t color_type,
@@ -195,3 +205,67 @@ Chunk* chunk_ihdr(uint32_t width, uint32_t height, Format format)
     return create_ihdr(width, height, bit_depth, color_type, compression, filter, interlace);
 
 }
+
+// write 32 bit value in network byte order
+static void put_u32(uint8_t* buf, uint32_t val) {
+    buf[0] = val >> 24;
+    buf[1] = val >> 16;
+    buf[2] = val >> 8;
+    buf[3] = val;
+}
+
+Chunk* chunk_actl(uint32_t num_frames, uint32_t num_plays) {
+    uint8_t buf[8];
+    put_u32(buf, num_frames);
+    put_u32(buf + 4, num_plays);
+    return create_chunk("acTL", buf, 8);
+}
+
+Chunk* chunk_fctl(uint32_t *sequence, uint32_t width, uint32_t height,
+                   uint32_t x_offset, uint32_t y_offset,
+                   uint16_t delay_num, uint16_t delay_den,
+                   uint8_t dispose_op, uint8_t blend_op) {
+    uint8_t buf[26];
+    put_u32(buf, (*sequence)++);
+    put_u32(buf + 4, width);
+    put_u32(buf + 8, height);
+    put_u32(buf + 12, x_offset);
+    put_u32(buf + 16, y_offset);
+    buf[20] = delay_num >> 8;
+    buf[21] = delay_num;
+    buf[22] = delay_den >> 8;
+    buf[23] = delay_den;
+    buf[24] = dispose_op;
+    buf[25] = blend_op;
+    return create_chunk("fcTL", buf, 26);
+}
+
+// same split as chunk_idat, but every chunk starts with its sequence number
+ChunkList* chunk_fdat(void* compressed, int length, uint32_t *sequence) {
+    uint8_t* data = (uint8_t*)compressed;
+
+    int max_chunks = (length + MAX_IDAT_DATA - 1) / MAX_IDAT_DATA;
+    Chunk** chunks = malloc(max_chunks * sizeof(Chunk*));
+    assert(chunks != NULL);
+
+    uint8_t* buf = malloc(4 + MAX_IDAT_DATA);
+    assert(buf != NULL);
+
+    int offset = 0;
+    int count = 0;
+    while (offset < length) {
+        int sz = length - offset;
+        if (sz > MAX_IDAT_DATA) sz = MAX_IDAT_DATA;
+        put_u32(buf, (*sequence)++);
+        memcpy(buf + 4, data + offset, sz);
+        chunks[count++] = create_chunk("fdAT", buf, 4 + sz);
+        offset += sz;
+    }
+    free(buf);
+
+    ChunkList* list = malloc(sizeof(ChunkList));
+    assert(list != NULL);
+    list->chunks = chunks;
+    list->count = count;
+    return list;
+}
@@ -2,6 +2,9 @@
 #define CHUNK_H
 #include <stdint.h>
 
+// Max size for one IDAT chunk’s data field 2³¹−1 bytes
+#define MAX_IDAT_DATA 8192 
+
 typedef struct {
     uint32_t length;   // data length
     char type[5];      // 4-letter type + null-terminator
@@ -14,6 +17,12 @@ typedef struct {
     int count;
 } ChunkList;
 
+// CRC-32 as used by PNG chunks (type + data)
+// the table is built on first use, long-running callers can build it up front
+extern void make_crc_table(void);
+extern unsigned long update_crc(unsigned long crc, unsigned char *buf, int len);
+extern unsigned long crc(unsigned char *buf, int len);
+
 // Create generic chunk
 extern Chunk* create_chunk(const char type[5], const uint8_t* data, uint32_t length);
 
@@ -28,6 +37,12 @@ extern Chunk* create_ihdr(uint32_t width, uint32_t height,
 // return the final ihdr
 extern Chunk* chunk_ihdr(uint32_t width, uint32_t height, Format format);
 
+// IHDR for an 8 bit palette image
+extern Chunk* chunk_ihdr_indexed(uint32_t width, uint32_t height);
+
+// PLTE chunk from count rgb triples (1 to 256)
+extern Chunk* chunk_plte(const uint8_t *rgb, int count);
+
 // Create IEND chunk
 // for footer of image
 extern Chunk* chunk_iend(void);
@@ -35,6 +50,18 @@ extern Chunk* chunk_iend(void);
 // Split compressed data into IDAT chunks
 extern ChunkList* chunk_idat(void* compressed, int length);
 
+// APNG animation control: number of frames and plays (0 = loop forever)
+extern Chunk* chunk_actl(uint32_t num_frames, uint32_t num_plays);
+
+// APNG frame control for one frame region, uses one sequence number
+extern Chunk* chunk_fctl(uint32_t *sequence, uint32_t width, uint32_t height,
+                   uint32_t x_offset, uint32_t y_offset,
+                   uint16_t delay_num, uint16_t delay_den,
+                   uint8_t dispose_op, uint8_t blend_op);
+
+// Split compressed frame data into fdAT chunks, one sequence number each
+extern ChunkList* chunk_fdat(void* compressed, int length, uint32_t *sequence);
+
 // Free chunk and its data
 extern void free_chunk(Chunk* ck);
 
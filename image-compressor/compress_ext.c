@@ -1,5 +1,6 @@
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -8,6 +9,7 @@
 #include <zlib.h>
 
 #include "compress_ext.h"
+#include "zopfli_ext.h"
 
 #include "debug_util.h"
 
@@ -42,72 +44,236 @@ static void decode_zcodes(int code) {
 	}
 }
 
-void *compress_lines(uint8_t **mlines, int mlines_len, int mline_len, int *length) {
-	// referenced from https://zlib.net/zpipe.c
-	int cap = mlines_len;
-	int len = 0;
-	uint8_t *res = malloc(sizeof(uint8_t) * cap);
-	assert(res != NULL);
+struct Deflater {
+	// one stream per window size, since deflateReset keeps the window
+	z_stream streams[MAX_WINDOW_BITS - MIN_WINDOW_BITS + 1];
+	bool ready[MAX_WINDOW_BITS - MIN_WINDOW_BITS + 1];
+	// what each stream was set up with, a job asking for others starts it afresh
+	int levels[MAX_WINDOW_BITS - MIN_WINDOW_BITS + 1];
+	int strategies[MAX_WINDOW_BITS - MIN_WINDOW_BITS + 1];
+};
 
-	// status code for zlib
-	int code = Z_ERRNO;
-	z_stream stream;
-	uint8_t out[CHUNK];
+Deflater *deflater_create(void) {
+	Deflater *deflater = calloc(1, sizeof(Deflater));
+	assert(deflater != NULL);
+	return deflater;
+}
 
-	// init stream
-	stream.zalloc = Z_NULL;
-	stream.zfree = Z_NULL;
-	stream.opaque = Z_NULL;
+void deflater_free(Deflater *deflater) {
+	if (deflater == NULL) return;
+	for (int i = 0; i <= MAX_WINDOW_BITS - MIN_WINDOW_BITS; i++) {
+		if (deflater->ready[i]) (void) deflateEnd(&deflater->streams[i]);
+	}
+	free(deflater);
+}
 
-	int min_window_bits = MAX(MIN_WINDOW_BITS, ceil(log2(mlines_len * mline_len)));
+void default_compress_settings(CompressSettings *settings) {
+	settings->level = DEFAULT_COMPRESSION_LEVEL;
+	settings->strategy = Z_DEFAULT_STRATEGY;
+	settings->mem_level = DEFAULT_MEM_LEVEL;
+	settings->window_bits = 0;
+	settings->iterations = 0;
+	settings->give_up = NULL;
+	settings->ctx = NULL;
+}
 
-	int window_bits = MIN(MAX_WINDOW_BITS, min_window_bits);
+static void init_stream(z_stream *stream, const CompressSettings *settings, int window_bits) {
+	// init stream
+	stream->zalloc = Z_NULL;
+	stream->zfree = Z_NULL;
+	stream->opaque = Z_NULL;
 
-	code = deflateInit2(
-			&stream,
-			DEFAULT_COMPRESSION_LEVEL,
+	int code = deflateInit2(
+			stream,
+			settings->level,
 			DEFLATE_COMPRESSION_CODE,
 			window_bits,
-			DEFAULT_MEM_LEVEL,
-			Z_DEFAULT_STRATEGY
+			settings->mem_level,
+			settings->strategy
 		);
 
 	if (code != Z_OK) {
 		decode_zcodes(code);
 		panic("Error while intiating deflation stream");
 	}
+}
+
+// smallest window that covers the whole image, unless one is asked for
+static int pick_window_bits(const CompressSettings *settings, long total_bytes) {
+	if (settings->window_bits != 0) {
+		return settings->window_bits;
+	}
+	int min_window_bits = MAX(MIN_WINDOW_BITS, ceil(log2(total_bytes)));
+
+	return MIN(MAX_WINDOW_BITS, min_window_bits);
+}
+
+// feed one line to deflate, handing every produced byte to sink
+static void deflate_line(z_stream *stream, uint8_t *line, int line_len, int flush,
+		DeflateSink sink, void *ctx) {
+	uint8_t out[CHUNK];
+
+	// copy in mline
+	stream->avail_in = line_len;
+	stream->next_in = line;
+
+	// deflate till buffer isn't filled when deflating
+	do {
+		stream->avail_out = CHUNK;
+		stream->next_out = out;
+		(void) deflate(stream, flush);
+		int comped_bytes = CHUNK - stream->avail_out;
+		if (comped_bytes > 0) {
+			sink(ctx, out, comped_bytes);
+		}
+	} while (stream->avail_out == 0);
+	panic_if (stream->avail_in != 0, "All input should be consumed before continuing");
+}
+
+typedef struct {
+	uint8_t *res;
+	int len;
+	int cap;
+	int mline_len;
+} Output;
+
+static void append(void *ctx, const uint8_t *data, int comped_bytes) {
+	Output *o = ctx;
+	if (o->len + comped_bytes >= o->cap) {
+		// resize buffer
+		o->res = realloc(o->res, sizeof(uint8_t) * (o->cap += o->mline_len + comped_bytes));
+		assert(o->res != NULL);
+	}
+	memcpy(o->res + o->len, data, comped_bytes);
+	o->len += comped_bytes;
+}
+
+// the high ratio encoder parses the whole image at once
+// its block splitting and cost model can lose to zlib's best level on noisy
+// data, so that runs too (cheap next to the parse) and the smaller stream wins
+static void *compress_lines_zopfli(const CompressSettings *settings,
+		uint8_t **mlines, int mlines_len, int mline_len, int *length) {
+	size_t total = (size_t) mlines_len * mline_len;
+	uint8_t *data = malloc(total);
+	assert(data != NULL);
+	for (int i = 0; i < mlines_len; i++) {
+		memcpy(data + (size_t) i * mline_len, mlines[i], mline_len);
+	}
+	void *compressed = zopfli_compress(data, total, settings->iterations, length);
+	free(data);
+
+	CompressSettings best;
+	default_compress_settings(&best);
+	best.level = Z_BEST_COMPRESSION;
+	int zlib_length;
+	void *zlib = compress_lines_with(NULL, &best, mlines, mlines_len, mline_len, &zlib_length);
+	if (zlib_length < *length) {
+		free(compressed);
+		*length = zlib_length;
+		return zlib;
+	}
+	free(zlib);
+	return compressed;
+}
+
+void *compress_lines(uint8_t **mlines, int mlines_len, int mline_len, int *length) {
+	return compress_lines_with(NULL, NULL, mlines, mlines_len, mline_len, length);
+}
+
+void *compress_lines_with(Deflater *deflater, const CompressSettings *settings,
+		uint8_t **mlines, int mlines_len, int mline_len, int *length) {
+	// referenced from https://zlib.net/zpipe.c
+	Output o = { NULL, 0, mlines_len, mline_len };
+	o.res = malloc(sizeof(uint8_t) * o.cap);
+	assert(o.res != NULL);
+
+	// status code for zlib
+	int code = Z_ERRNO;
+	z_stream local;
+	z_stream *stream = &local;
+
+	CompressSettings defaults;
+	if (settings == NULL) {
+		default_compress_settings(&defaults);
+		settings = &defaults;
+	} else if (settings->mem_level != DEFAULT_MEM_LEVEL) {
+		// pooled streams all use the default memLevel
+		deflater = NULL;
+	}
+	if (settings->iterations > 0) {
+		free(o.res);
+		return compress_lines_zopfli(settings, mlines, mlines_len, mline_len, length);
+	}
+
+	int window_bits = pick_window_bits(settings, (long) mlines_len * mline_len);
+
+	if (deflater == NULL) {
+		init_stream(stream, settings, window_bits);
+	} else {
+		int slot = window_bits - MIN_WINDOW_BITS;
+		stream = &deflater->streams[slot];
+		bool same = deflater->levels[slot] == settings->level && deflater->strategies[slot] == settings->strategy;
+		if (deflater->ready[slot] && same) {
+			code = deflateReset(stream);
+			panic_if(code != Z_OK, "Error while resetting deflation stream");
+		} else {
+			if (deflater->ready[slot]) (void) deflateEnd(stream);
+			init_stream(stream, settings, window_bits);
+			deflater->ready[slot] = true;
+			deflater->levels[slot] = settings->level;
+			deflater->strategies[slot] = settings->strategy;
+		}
+	}
 
-	uint8_t *line = *mlines;
 	for (int i = 0; i < mlines_len; i++) {
-		line = mlines[i];
-		// copy in mline
-		stream.avail_in = mline_len;
-		stream.next_in = line;
-
-		// deflate till buffer isn't filled when deflating
-		do {
-			stream.avail_out = CHUNK;
-			stream.next_out = out;
-			code = deflate(&stream, i == (mlines_len - 1));
-			int comped_bytes = CHUNK - stream.avail_out;
-			if (len + comped_bytes >= cap) {
-				// resize buffer
-				res = realloc(res, sizeof(uint8_t) * (cap += mline_len + comped_bytes));
-				assert(res != NULL);
-			}
-			for (int j = 0; j < comped_bytes; j++) {
-				res[len++] = out[j];
-			}
-		} while (stream.avail_out == 0);
-		panic_if (stream.avail_in != 0, "All input should be consumed before continuing");
+		deflate_line(stream, mlines[i], mline_len,
+				i == (mlines_len - 1) ? Z_FINISH : Z_NO_FLUSH, append, &o);
 
+		if (settings->give_up != NULL && settings->give_up(settings->ctx, o.len)) {
+			if (deflater == NULL) (void) deflateEnd(stream);
+			free(o.res);
+			return NULL;
+		}
 	}
 
 	// cleanup
-	// close deflate process
-	(void) deflateEnd(&stream);
+	// close deflate process, pooled streams stay open for the next image
+	if (deflater == NULL) {
+		(void) deflateEnd(stream);
+	}
 	// store length of compressed bytes
-	*length = len;
-	return res;
+	*length = o.len;
+	return o.res;
+}
+
+struct DeflateStream {
+	z_stream stream;
+	DeflateSink sink;
+	void *ctx;
+};
+
+DeflateStream *deflate_stream_create(const CompressSettings *settings, long total_bytes,
+		DeflateSink sink, void *ctx) {
+	CompressSettings defaults;
+	if (settings == NULL) {
+		default_compress_settings(&defaults);
+		settings = &defaults;
+	}
+	panic_if(settings->iterations > 0, "The high ratio encoder needs the whole image at once");
+
+	DeflateStream *ds = malloc(sizeof(DeflateStream));
+	assert(ds != NULL);
+	ds->sink = sink;
+	ds->ctx = ctx;
+	init_stream(&ds->stream, settings, pick_window_bits(settings, total_bytes));
+	return ds;
 }
 
+void deflate_stream_line(DeflateStream *ds, uint8_t *line, int line_len, bool last) {
+	deflate_line(&ds->stream, line, line_len, last ? Z_FINISH : Z_NO_FLUSH, ds->sink, ds->ctx);
+}
+
+void deflate_stream_free(DeflateStream *ds) {
+	(void) deflateEnd(&ds->stream);
+	free(ds);
+}
@@ -1,2 +1,45 @@
 extern void *compress_lines(uint8_t **mlines, int mlines_len, int mline_len, int *length);
 
+// reusable deflate state, so long-running callers skip zlib setup per image
+typedef struct Deflater Deflater;
+extern Deflater *deflater_create(void);
+extern void deflater_free(Deflater *deflater);
+
+// zlib parameters for one compression run
+typedef struct {
+	int level;
+	int strategy;	// zlib strategy, e.g. Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE
+	int mem_level;
+	int window_bits;	// 0 picks the smallest window that covers the image
+	// non zero selects the high ratio encoder (zopfli_ext) with this many parsing
+	// passes per block; level, strategy, mem_level and window_bits are then unused
+	// and the result is never larger than zlib level 9
+	int iterations;
+	// if set, polled after every line with the compressed size so far;
+	// returning true abandons the stream and compress_lines_with returns NULL
+	// (the high ratio encoder only produces its stream at the end, it never polls)
+	bool (*give_up)(void *ctx, int partial_length);
+	void *ctx;
+} CompressSettings;
+
+// the settings compress_lines uses
+extern void default_compress_settings(CompressSettings *settings);
+
+// compress_lines, but reusing (after a reset) the streams held by deflater
+// a NULL deflater behaves exactly like compress_lines; settings may be NULL for
+// the defaults; a pooled stream is reused while jobs keep the same level and
+// strategy, and settings with a non default mem_level always use a fresh stream
+extern void *compress_lines_with(Deflater *deflater, const CompressSettings *settings,
+		uint8_t **mlines, int mlines_len, int mline_len, int *length);
+
+// incremental compression for callers that produce lines a few at a time
+// the stream is identical to compress_lines over the same lines
+typedef void (*DeflateSink)(void *ctx, const uint8_t *data, int length);
+typedef struct DeflateStream DeflateStream;
+
+// total_bytes is the size of all lines together, it picks the window
+extern DeflateStream *deflate_stream_create(const CompressSettings *settings, long total_bytes,
+		DeflateSink sink, void *ctx);
+// compress one line; the last line finishes the stream
+extern void deflate_stream_line(DeflateStream *stream, uint8_t *line, int line_len, bool last);
+extern void deflate_stream_free(DeflateStream *stream);
@@ -0,0 +1,564 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <zlib.h>
+
+#include "extract_ext.h"
+#include "filter_ext.h"
+#include "compress_ext.h"
+#include "chunk_ext.h"
+#include "png_ext.h"
+#include "pool_ext.h"
+#include "daemon_ext.h"
+
+#include "debug_util.h"
+
+#define MAX_REQUEST 4096
+#define LISTEN_BACKLOG 64
+#define LATENCY_SAMPLES 1024
+// a client that has connected gets this long to send its request line
+#define REQUEST_TIMEOUT_SECONDS 5
+// connections the accept thread holds at once, still sending their request or
+// waiting for a queue slot; past this the listener is left alone
+#define MAX_CONNECTIONS 256
+
+// a connection whose request line is still arriving
+typedef struct {
+	int conn;
+	double deadline;
+	int len;
+	char buf[MAX_REQUEST];
+	int fds[2];
+	int nfds;
+} Client;
+
+typedef struct {
+	int conn;
+	bool by_fd;
+	int in_fd;
+	int out_fd;
+	char name[MAX_REQUEST];
+	char dest[MAX_REQUEST];
+	CompressSettings settings;
+	FilterStrategy filter;
+	double enqueued;
+} ConvertJob;
+
+typedef struct {
+	pthread_mutex_t lock;
+	double started;
+	unsigned long completed;
+	unsigned long failed;
+	// most recent latencies, in seconds
+	double latencies[LATENCY_SAMPLES];
+	int samples;
+	int next;
+} Stats;
+
+static Stats stats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// names in the settings field, indexed by zlib strategy and FilterStrategy
+static const char *strategy_names[] = { "default", "filtered", "huffman", "rle", "fixed" };
+static const char *filter_names[] = { "none", "sub", "up", "average", "paeth", "adaptive" };
+
+static volatile sig_atomic_t stopping = 0;
+// workers poke this as they finish, so held jobs are handed over as slots free up
+static int wake_fd = -1;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_signal(int sig) {
+	(void) sig;
+	stopping = 1;
+}
+
+static void reply(int conn, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void reply(int conn, const char *fmt, ...) {
+	char buf[MAX_REQUEST];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len > (int) sizeof(buf) - 1) len = sizeof(buf) - 1;
+	(void) send(conn, buf, len, MSG_NOSIGNAL);
+}
+
+static void record(double latency, bool ok) {
+	pthread_mutex_lock(&stats.lock);
+	if (ok) {
+		stats.completed++;
+		stats.latencies[stats.next] = latency;
+		stats.next = (stats.next + 1) % LATENCY_SAMPLES;
+		if (stats.samples < LATENCY_SAMPLES) stats.samples++;
+	} else {
+		stats.failed++;
+	}
+	pthread_mutex_unlock(&stats.lock);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+// held counts jobs read by the accept thread but not yet in the queue
+static void reply_stats(int conn, Pool *pool, int held) {
+	double sorted[LATENCY_SAMPLES];
+
+	pthread_mutex_lock(&stats.lock);
+	int samples = stats.samples;
+	memcpy(sorted, stats.latencies, sizeof(double) * samples);
+	unsigned long completed = stats.completed;
+	unsigned long failed = stats.failed;
+	double uptime = now() - stats.started;
+	pthread_mutex_unlock(&stats.lock);
+
+	qsort(sorted, samples, sizeof(double), compare_doubles);
+	double p50 = samples ? sorted[samples * 50 / 100] : 0;
+	double p90 = samples ? sorted[samples * 90 / 100] : 0;
+	double p99 = samples ? sorted[samples * 99 / 100] : 0;
+	double max = samples ? sorted[samples - 1] : 0;
+
+	reply(conn, "OK depth=%d completed=%lu failed=%lu throughput=%.2f/s "
+			"p50=%.3fms p90=%.3fms p99=%.3fms max=%.3fms\n",
+			pool_depth(pool) + held, completed, failed, uptime > 0 ? completed / uptime : 0.0,
+			p50 * 1e3, p90 * 1e3, p99 * 1e3, max * 1e3);
+}
+
+static void *worker_init(void) {
+	return deflater_create();
+}
+
+static void worker_fini(void *state) {
+	deflater_free(state);
+}
+
+// the connection and the job are the caller's to close and free
+static void convert(ConvertJob *job, Deflater *deflater) {
+	FILE *src = job->by_fd ? fdopen(job->in_fd, "rb") : fopen(job->name, "rb");
+	FILE *out = job->by_fd ? fdopen(job->out_fd, "wb") : fopen(job->dest, "wb");
+	if (src == NULL || out == NULL) {
+		reply(job->conn, "ERR cannot open %s: %s\n", src == NULL ? "input" : "output", strerror(errno));
+		if (src != NULL) fclose(src);
+		else if (job->by_fd) close(job->in_fd);
+		if (out != NULL) fclose(out);
+		else if (job->by_fd) close(job->out_fd);
+		record(0, false);
+		return;
+	}
+
+	Format format;
+	int height;
+	int width;
+	const char *error;
+	// closes src, also when the input turns out to be malformed
+	void *pixels = try_extract_file(src, job->name, &format, &height, &width, &error);
+	if (pixels == NULL) {
+		fclose(out);
+		if (!job->by_fd) unlink(job->dest);
+		record(0, false);
+		reply(job->conn, "ERR %s: %s\n", job->name, error);
+		return;
+	}
+	// the worker's pooled stream, restarted only when the level or strategy changes
+	int scanline_width;
+	uint8_t **lines = serialise_filter_with(pixels, width, height, format, job->filter, &scanline_width);
+	free(pixels);
+	int len;
+	void *compressed = compress_lines_with(deflater, &job->settings, lines, height, scanline_width + 1, &len);
+	free_lines(lines, height);
+	write_png_data(compressed, len, width, height, format, out);
+	free(compressed);
+	bool ok = fclose(out) == 0;
+
+	double latency = now() - job->enqueued;
+	record(latency, ok);
+	if (ok) {
+		reply(job->conn, "OK %dx%d %.3fms\n", width, height, latency * 1e3);
+	} else {
+		reply(job->conn, "ERR failed to write output: %s\n", strerror(errno));
+	}
+}
+
+// one non-blocking read of a client's request line, collecting any descriptors
+// passed alongside it
+// 1 once the line is complete, 0 if more is to come, -1 for a malformed request
+static int receive(Client *client) {
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { client->buf + client->len, MAX_REQUEST - 1 - client->len };
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t got = recvmsg(client->conn, &msg, MSG_CMSG_CLOEXEC);
+	if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+	if (got <= 0) return -1;
+
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+			int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			int *passed = (int *) CMSG_DATA(c);
+			for (int i = 0; i < n; i++) {
+				if (client->nfds < 2) client->fds[client->nfds++] = passed[i];
+				else close(passed[i]);
+			}
+		}
+	}
+
+	client->len += got;
+	client->buf[client->len] = '\0';
+	char *newline = strchr(client->buf, '\n');
+	if (newline == NULL) return client->len == MAX_REQUEST - 1 ? -1 : 0;
+	*newline = '\0';
+	return 1;
+}
+
+static void close_client(Client *client) {
+	for (int i = 0; i < client->nfds; i++) close(client->fds[i]);
+	if (client->conn >= 0) close(client->conn);
+	free(client);
+}
+
+static void convert_task(void *arg, void *state) {
+	ConvertJob *job = arg;
+	convert(job, state);
+	close(job->conn);
+	free(job);
+	uint64_t one = 1;
+	(void) write(wake_fd, &one, sizeof(one));
+}
+
+static int lookup(const char *name, const char **names, int count) {
+	for (int i = 0; i < count; i++) {
+		if (strcmp(name, names[i]) == 0) return i;
+	}
+	return -1;
+}
+
+// the optional settings field: comma separated level=0-9, strategy=<name>, filter=<name>
+static bool parse_settings(char *spec, CompressSettings *settings, FilterStrategy *filter) {
+	char *item;
+	while ((item = strsep(&spec, ",")) != NULL) {
+		char *value = item;
+		char *key = strsep(&value, "=");
+		if (value == NULL) return false;
+		if (strcmp(key, "level") == 0) {
+			char *end;
+			long level = strtol(value, &end, 10);
+			if (end == value || *end != '\0' || level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION) return false;
+			settings->level = level;
+		} else if (strcmp(key, "strategy") == 0) {
+			int strategy = lookup(value, strategy_names, sizeof(strategy_names) / sizeof(*strategy_names));
+			if (strategy < 0) return false;
+			settings->strategy = strategy;
+		} else if (strcmp(key, "filter") == 0) {
+			int f = lookup(value, filter_names, sizeof(filter_names) / sizeof(*filter_names));
+			if (f < 0) return false;
+			*filter = f;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+// the job for a CONVERT or CONVERT_FD request, taking the client's connection
+// and descriptors; NULL with the error sent if the request is incomplete
+static ConvertJob *parse_convert(Client *client, char *command, char *rest) {
+	ConvertJob *job = calloc(1, sizeof(ConvertJob));
+	assert(job != NULL);
+	default_compress_settings(&job->settings);
+	job->filter = FILTER_ADAPTIVE;
+	if (strcmp(command, "CONVERT") == 0) {
+		char *src = strsep(&rest, "\t");
+		char *dest = strsep(&rest, "\t");
+		if (src == NULL || dest == NULL || *src != '/' || *dest != '/') {
+			reply(client->conn, "ERR CONVERT needs absolute source and destination paths\n");
+			free(job);
+			return NULL;
+		}
+		strcpy(job->name, src);
+		strcpy(job->dest, dest);
+	} else {
+		char *name = strsep(&rest, "\t");
+		if (name == NULL || client->nfds != 2) {
+			reply(client->conn, "ERR CONVERT_FD needs a name and two descriptors\n");
+			free(job);
+			return NULL;
+		}
+		job->by_fd = true;
+		job->in_fd = client->fds[0];
+		job->out_fd = client->fds[1];
+		client->nfds = 0;
+		strcpy(job->name, name);
+	}
+	char *spec = strsep(&rest, "\t");
+	if (spec != NULL && *spec != '\0' && !parse_settings(spec, &job->settings, &job->filter)) {
+		reply(client->conn, "ERR settings are level=0-9,strategy=default|filtered|huffman|rle|fixed,"
+				"filter=none|sub|up|average|paeth|adaptive\n");
+		// descriptors already taken from the client
+		if (job->by_fd) {
+			close(job->in_fd);
+			close(job->out_fd);
+		}
+		free(job);
+		return NULL;
+	}
+	job->conn = client->conn;
+	client->conn = -1;
+	job->enqueued = now();
+	return job;
+}
+
+// answer a complete request on the accept thread: STATS and SHUTDOWN at once,
+// conversions queued, or held while the queue is full so the thread never blocks
+static void dispatch(Client *client, Pool *pool, ConvertJob **held, int *num_held) {
+	char *rest = client->buf;
+	char *command = strsep(&rest, "\t");
+
+	if (strcmp(command, "STATS") == 0) {
+		reply_stats(client->conn, pool, *num_held);
+	} else if (strcmp(command, "SHUTDOWN") == 0) {
+		reply(client->conn, "OK shutting down\n");
+		// queued and held jobs still finish
+		stopping = 1;
+	} else if (strcmp(command, "CONVERT") == 0 || strcmp(command, "CONVERT_FD") == 0) {
+		ConvertJob *job = parse_convert(client, command, rest);
+		if (job == NULL) return;
+		if (*num_held > 0 || !pool_try_submit(pool, convert_task, job)) held[(*num_held)++] = job;
+	} else {
+		reply(client->conn, "ERR unknown command\n");
+	}
+}
+
+static int open_socket(char *socket_path, struct sockaddr_un *addr) {
+	panic_if(strlen(socket_path) >= sizeof(addr->sun_path), "Socket path too long");
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, socket_path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	panic_if(fd < 0, "Failed to create socket");
+	return fd;
+}
+
+int run_daemon(char *socket_path, int workers, int queue_len) {
+	struct sockaddr_un addr;
+	int listener = open_socket(socket_path, &addr);
+
+	unlink(socket_path);
+	if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listener, LISTEN_BACKLOG) != 0) {
+		perror("Failed to listen on socket");
+		close(listener);
+		return 1;
+	}
+
+	// no SA_RESTART, so poll returns when we are asked to stop
+	struct sigaction sa = {0};
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	panic_if(wake_fd < 0, "Failed to create eventfd");
+
+	// warm everything a first request would otherwise pay for
+	make_crc_table();
+	stats.started = now();
+	Pool *pool = pool_create(workers, queue_len, worker_init, worker_fini);
+
+	// one thread reads every request line, so a slow client costs no worker and
+	// STATS is answered even when every worker is busy
+	Client *clients[MAX_CONNECTIONS];
+	int num_clients = 0;
+	// conversions waiting for a queue slot, oldest first
+	ConvertJob *held[MAX_CONNECTIONS];
+	int num_held = 0;
+	struct pollfd pfds[2 + MAX_CONNECTIONS];
+
+	fprintf(stderr, "listening on %s with %d workers\n", socket_path, workers);
+	while (!stopping) {
+		int handed = 0;
+		while (handed < num_held && pool_try_submit(pool, convert_task, held[handed])) handed++;
+		num_held -= handed;
+		memmove(held, held + handed, sizeof(*held) * num_held);
+
+		double t = now();
+		int timeout = -1;
+		pfds[0] = (struct pollfd) { wake_fd, POLLIN, 0 };
+		// a negative fd is skipped, so full means not accepting
+		pfds[1] = (struct pollfd) { num_clients + num_held < MAX_CONNECTIONS ? listener : -1, POLLIN, 0 };
+		for (int i = 0; i < num_clients; i++) {
+			pfds[2 + i] = (struct pollfd) { clients[i]->conn, POLLIN, 0 };
+			int left = (int) ((clients[i]->deadline - t) * 1e3) + 1;
+			if (left < 0) left = 0;
+			if (timeout < 0 || left < timeout) timeout = left;
+		}
+		if (poll(pfds, 2 + num_clients, timeout) < 0) {
+			if (errno == EINTR) continue;
+			perror("poll");
+			break;
+		}
+		if (pfds[0].revents & POLLIN) {
+			uint64_t finished;
+			(void) read(wake_fd, &finished, sizeof(finished));
+		}
+
+		// from the back, so moving the last client into a freed slot skips nothing
+		t = now();
+		for (int i = num_clients - 1; i >= 0 && !stopping; i--) {
+			Client *client = clients[i];
+			int code = pfds[2 + i].revents != 0 ? receive(client) : 0;
+			if (code == 0 && t < client->deadline) continue;
+			if (code == 1) {
+				dispatch(client, pool, held, &num_held);
+			} else {
+				reply(client->conn, code < 0 ? "ERR malformed request\n" : "ERR timed out waiting for the request\n");
+			}
+			close_client(client);
+			clients[i] = clients[--num_clients];
+		}
+
+		if (!stopping && (pfds[1].revents & POLLIN)) {
+			int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+			if (conn >= 0) {
+				Client *client = calloc(1, sizeof(Client));
+				assert(client != NULL);
+				client->conn = conn;
+				client->deadline = now() + REQUEST_TIMEOUT_SECONDS;
+				clients[num_clients++] = client;
+			} else if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+				perror("accept");
+				break;
+			}
+		}
+	}
+
+	close(listener);
+	unlink(socket_path);
+	for (int i = 0; i < num_clients; i++) {
+		reply(clients[i]->conn, "ERR shutting down\n");
+		close_client(clients[i]);
+	}
+	// everything accepted still gets converted
+	for (int i = 0; i < num_held; i++) pool_submit(pool, convert_task, held[i]);
+	pool_destroy(pool);
+	close(wake_fd);
+	return 0;
+}
+
+static int send_request(int fd, char *line, int *fds, int nfds) {
+	struct iovec iov = { line, strlen(line) };
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	if (nfds > 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+	}
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+// relative paths mean nothing to the daemon, so make them absolute here
+static char *absolute(char *path, char *buf) {
+	if (*path == '/') return path;
+	panic_if(getcwd(buf, PATH_MAX) == NULL, "Failed to read working directory");
+	strncat(buf, "/", PATH_MAX - strlen(buf) - 1);
+	strncat(buf, path, PATH_MAX - strlen(buf) - 1);
+	return buf;
+}
+
+int run_client(char *socket_path, char **args, int nargs, bool pass_fds) {
+	struct sockaddr_un addr;
+	int fd = open_socket(socket_path, &addr);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		perror("Failed to connect to daemon");
+		close(fd);
+		return 1;
+	}
+
+	char line[MAX_REQUEST];
+	int fds[2];
+	int nfds = 0;
+	if (nargs == 1 && strcmp(args[0], "stats") == 0) {
+		snprintf(line, sizeof(line), "STATS\n");
+	} else if (nargs == 1 && strcmp(args[0], "shutdown") == 0) {
+		snprintf(line, sizeof(line), "SHUTDOWN\n");
+	} else if ((nargs == 2 || nargs == 3) && pass_fds) {
+		fds[0] = open(args[0], O_RDONLY);
+		fds[1] = open(args[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fds[0] < 0 || fds[1] < 0) {
+			perror("Failed to open files");
+			close(fd);
+			return 1;
+		}
+		nfds = 2;
+		snprintf(line, sizeof(line), "CONVERT_FD\t%s\t%s\n", args[0], nargs == 3 ? args[2] : "");
+	} else if (nargs == 2 || nargs == 3) {
+		char src[PATH_MAX];
+		char dest[PATH_MAX];
+		snprintf(line, sizeof(line), "CONVERT\t%s\t%s\t%s\n", absolute(args[0], src), absolute(args[1], dest),
+				nargs == 3 ? args[2] : "");
+	} else {
+		fprintf(stderr, "client expects src dst [settings], stats or shutdown\n");
+		close(fd);
+		return 1;
+	}
+
+	int sent = send_request(fd, line, fds, nfds);
+	for (int i = 0; i < nfds; i++) close(fds[i]);
+	if (sent != 0) {
+		perror("Failed to send request");
+		close(fd);
+		return 1;
+	}
+
+	char buf[MAX_REQUEST];
+	int len = 0;
+	ssize_t got;
+	while (len < MAX_REQUEST - 1 && (got = recv(fd, buf + len, MAX_REQUEST - 1 - len, 0)) > 0) {
+		len += got;
+	}
+	buf[len] = '\0';
+	close(fd);
+
+	fputs(buf, stdout);
+	return strncmp(buf, "OK", 2) == 0 ? 0 : 1;
+}
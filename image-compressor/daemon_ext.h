@@ -0,0 +1,24 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+// serve conversion jobs on a unix domain socket until SIGINT/SIGTERM or SHUTDOWN
+// requests are single lines, fields separated by tabs:
+//   CONVERT <src> <dst> [<settings>]   convert between absolute paths
+//   CONVERT_FD <name> [<settings>]     convert the two passed descriptors (input,
+//                                      output), name only supplies the input extension
+//   STATS                              queue depth, latency percentiles and throughput
+//   SHUTDOWN                           finish queued jobs and exit
+// settings is an optional comma separated list of level=0-9,
+// strategy=default|filtered|huffman|rle|fixed and
+// filter=none|sub|up|average|paeth|adaptive, the rest stays at the defaults
+// every request gets one reply line starting with OK or ERR
+// request lines are read by the accept thread, which answers STATS and SHUTDOWN
+// itself and queues conversions for the workers; a client that hasn't sent its
+// line within a few seconds gets an ERR
+extern int run_daemon(char *socket_path, int workers, int queue_len);
+
+// send one request to a daemon and print the reply
+// args are either "src dst [settings]", "stats" or "shutdown"
+extern int run_client(char *socket_path, char **args, int nargs, bool pass_fds);
+
+#endif
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <ctype.h>
+#include <zlib.h>
+
+#include "extract_ext.h"
+#include "chunk_ext.h"
+#include "filter_ext.h"
+#include "decode_ext.h"
+
+#include "debug_util.h"
+
+#define GREY_COLOR_TYPE 0
+#define FULL_COLOR_TYPE 2
+
+#define BINARY_BIT_WIDTH 1
+#define DEFAULT_BIT_WIDTH 8
+
+#define IHDR_LENGTH 13
+
+static const uint8_t signature[8] = {
+	0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A
+};
+
+static uint32_t get_u32(const uint8_t *buf) {
+	return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) | ((uint32_t) buf[2] << 8) | buf[3];
+}
+
+// read one chunk, checking its crc; data is reallocated to fit
+static void read_chunk(FILE *src, char type[5], uint8_t **data, uint32_t *length) {
+	uint8_t head[8];
+	panic_if(fread(head, 1, 8, src) != 8, "Unexpected end of file, missing chunk");
+
+	*length = get_u32(head);
+	panic_if(*length > INT32_MAX, "Chunk length out of range");
+	memcpy(type, head + 4, 4);
+	type[4] = '\0';
+
+	*data = realloc(*data, *length + 1);
+	assert(*data != NULL);
+	panic_if(fread(*data, 1, *length, src) != *length, "Unexpected end of file inside chunk");
+
+	uint8_t tail[4];
+	panic_if(fread(tail, 1, 4, src) != 4, "Unexpected end of file, missing chunk crc");
+
+	unsigned long c = update_crc(0xffffffffL, head + 4, 4);
+	c = update_crc(c, *data, *length) ^ 0xffffffffL;
+	panic_if(c != get_u32(tail), "Chunk crc mismatch");
+}
+
+static void inflate_all(uint8_t *compressed, size_t length, uint8_t *out, size_t out_len) {
+	z_stream stream;
+	stream.zalloc = Z_NULL;
+	stream.zfree = Z_NULL;
+	stream.opaque = Z_NULL;
+	stream.next_in = compressed;
+	stream.avail_in = length;
+	panic_if(inflateInit(&stream) != Z_OK, "Error while initiating inflation stream");
+
+	// the decoded size is known from IHDR, so inflate in a single call
+	stream.next_out = out;
+	stream.avail_out = out_len;
+	int code = inflate(&stream, Z_FINISH);
+	(void) inflateEnd(&stream);
+
+	panic_if(stream.avail_out != 0, "Image data is shorter than its dimensions");
+	panic_if(code != Z_STREAM_END, "Invalid or incomplete image data");
+}
+
+void *decode_png(FILE *src, Format *format, int *height, int *width) {
+	uint8_t sig[8];
+	panic_if(fread(sig, 1, 8, src) != 8 || memcmp(sig, signature, 8) != 0, "Not a PNG file");
+
+	char type[5];
+	uint8_t *data = NULL;
+	uint32_t length;
+
+	read_chunk(src, type, &data, &length);
+	panic_if(strcmp(type, "IHDR") != 0 || length != IHDR_LENGTH, "Expected IHDR as first chunk");
+
+	uint32_t w = get_u32(data);
+	uint32_t h = get_u32(data + 4);
+	uint8_t bit_depth = data[8];
+	uint8_t color_type = data[9];
+	panic_if(w == 0 || h == 0 || w > INT32_MAX / 3 || h > INT32_MAX, "Invalid image dimensions");
+	panic_if(data[10] != 0 || data[11] != 0, "Unknown compression or filter method");
+	panic_if(data[12] != 0, "Interlaced images are not supported");
+
+	int row_len;
+	if (color_type == GREY_COLOR_TYPE && bit_depth == BINARY_BIT_WIDTH) {
+		*format = BW;
+		row_len = (w + 7) / 8;
+	} else if (color_type == GREY_COLOR_TYPE && bit_depth == DEFAULT_BIT_WIDTH) {
+		*format = GREYSCALE;
+		row_len = w;
+	} else if (color_type == FULL_COLOR_TYPE && bit_depth == DEFAULT_BIT_WIDTH) {
+		*format = FULL_COLOR;
+		row_len = w * 3;
+	} else {
+		panic("Unsupported colour type or bit depth");
+	}
+	*width = w;
+	*height = h;
+
+	// gather IDAT data
+	size_t cap = 0;
+	size_t len = 0;
+	uint8_t *compressed = NULL;
+	bool in_idat = false;
+	bool idat_done = false;
+	for (;;) {
+		read_chunk(src, type, &data, &length);
+		if (strcmp(type, "IEND") == 0) break;
+
+		if (strcmp(type, "IDAT") == 0) {
+			panic_if(idat_done, "IDAT chunks must be consecutive");
+			in_idat = true;
+			if (len + length > cap) {
+				cap = (len + length) * 2;
+				compressed = realloc(compressed, cap);
+				assert(compressed != NULL);
+			}
+			memcpy(compressed + len, data, length);
+			len += length;
+		} else {
+			idat_done = in_idat;
+			// ancillary chunks (lowercase first letter) can be skipped
+			panic_if(!islower((unsigned char) type[0]), "Unknown critical chunk");
+		}
+	}
+	free(data);
+	panic_if(!in_idat, "Missing IDAT chunk");
+
+	size_t line_len = row_len + 1;
+	uint8_t *raw = malloc(line_len * h);
+	assert(raw != NULL);
+	inflate_all(compressed, len, raw, line_len * h);
+	free(compressed);
+
+	for (size_t r = 0; r < h; r++) {
+		unfilter(raw + r * line_len, r == 0 ? NULL : raw + (r - 1) * line_len, row_len, *format);
+	}
+
+	if (*format == BW) {
+		// keep the scanlines packed, only the filter bytes and padding bits go
+		uint8_t *packed = malloc((size_t) row_len * h);
+		assert(packed != NULL);
+		uint8_t mask = (w % 8 == 0) ? 0xFF : (uint8_t) (0xFF << (8 - w % 8));
+		for (size_t r = 0; r < h; r++) {
+			memcpy(packed + r * row_len, raw + r * line_len + 1, row_len);
+			packed[r * row_len + row_len - 1] &= mask;
+		}
+		free(raw);
+		return packed;
+	}
+
+	Pixel *pixels = malloc(sizeof(Pixel) * w * h);
+	assert(pixels != NULL);
+	for (size_t r = 0; r < h; r++) {
+		uint8_t *row = raw + r * line_len + 1;
+		Pixel *out = pixels + r * w;
+		if (*format == GREYSCALE) {
+			for (size_t col = 0; col < w; col++) {
+				out[col].gp = row[col];
+			}
+		} else {
+			for (size_t col = 0; col < w; col++) {
+				out[col].cp.red = row[3 * col];
+				out[col].cp.green = row[3 * col + 1];
+				out[col].cp.blue = row[3 * col + 2];
+			}
+		}
+	}
+	free(raw);
+	return pixels;
+}
+
+bool same_pixels(void *a, void *b, int width, int height, Format format) {
+	if (format == BW) {
+		return memcmp(a, b, (size_t) PACKED_ROW_BYTES(width) * height) == 0;
+	}
+
+	Pixel *pa = a;
+	Pixel *pb = b;
+	for (size_t i = 0; i < (size_t) width * height; i++) {
+		if (!same_pixel(pa[i], pb[i], format)) return false;
+	}
+	return true;
+}
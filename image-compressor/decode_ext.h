@@ -0,0 +1,11 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+// decode a png produced by this encoder (grey 1/8 bit or rgb 8 bit, no interlace)
+// returns pixels in the same layout as extract (packed rows for BW)
+extern void *decode_png(FILE *src, Format *format, int *height, int *width);
+
+// true when two pixel buffers hold the same image
+extern bool same_pixels(void *a, void *b, int width, int height, Format format);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h> 
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <assert.h>
@@ -7,6 +8,7 @@
 
 #include "extract_ext.h"
 #include "chunk_ext.h"
+#include "encode_ext.h"
 
 void encode_chunk(Chunk *chunk, FILE *out){
   assert(chunk != NULL);
@@ -32,6 +34,20 @@ void encode_chunk(Chunk *chunk, FILE *out){
   fwrite(&crc, sizeof(uint32_t), 1, out);
 }
 
+void encode_chunk_list(ChunkList *list, FILE *out){
+  assert(list != NULL);
+  for (int i = 0; i < list->count; i++){
+    encode_chunk(list->chunks[i], out);
+  }
+}
+
+void encode_signature(FILE *out){
+  // PNG signature at first 8 bytes
+  uint8_t signature[8] = {
+    0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A
+  };
+  fwrite(signature, 1, 8, out);
+}
 
 void encode(Chunk *ihdr, ChunkList *idats, Chunk *iend, FILE *out){
   assert(ihdr != NULL);
@@ -39,20 +55,58 @@ void encode(Chunk *ihdr, ChunkList *idats, Chunk *iend, FILE *out){
   assert(iend != NULL);
   assert(out != NULL);
 
-  // PNG signature at first 8 bytes
-  uint8_t signature[8] = {
-    0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A
-  };
-  fwrite(signature, 1, 8, out);
+  encode_signature(out);
 
   // encode IHDR chunk
   encode_chunk(ihdr, out);
 
   // encode IDAT chunks
-  for (int i = 0; i < idats->count; i++){
-    encode_chunk(idats->chunks[i], out);
-  }
+  encode_chunk_list(idats, out);
 
   //encode IEND chunk
   encode_chunk(iend, out);
 }
+
+struct IdatStream {
+  FILE *out;
+  int length;
+  uint8_t data[MAX_IDAT_DATA];
+};
+
+IdatStream *idat_stream_open(FILE *out){
+  IdatStream *stream = malloc(sizeof(IdatStream));
+  assert(stream != NULL);
+  stream->out = out;
+  stream->length = 0;
+  return stream;
+}
+
+static void flush_idat(IdatStream *stream){
+  Chunk *idat = create_chunk("IDAT", stream->data, stream->length);
+  encode_chunk(idat, stream->out);
+  free_chunk(idat);
+  stream->length = 0;
+}
+
+void idat_stream_write(IdatStream *stream, const uint8_t *data, int length){
+  while (length > 0){
+    int sz = MAX_IDAT_DATA - stream->length;
+    if (sz > length) sz = length;
+    memcpy(stream->data + stream->length, data, sz);
+    stream->length += sz;
+    data += sz;
+    length -= sz;
+
+    // only flush full chunks here, more data may still follow
+    if (stream->length == MAX_IDAT_DATA){
+      flush_idat(stream);
+    }
+  }
+}
+
+void idat_stream_close(IdatStream *stream){
+  if (stream->length > 0){
+    flush_idat(stream);
+  }
+  free(stream);
+}
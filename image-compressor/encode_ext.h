@@ -1,3 +1,15 @@
 // encode single chunk
 extern void encode_chunk(Chunk *chunk, FILE *out);
+// encode every chunk of a list in order
+extern void encode_chunk_list(ChunkList *list, FILE *out);
+// write the 8 byte PNG signature
+extern void encode_signature(FILE *out);
 extern void encode(Chunk *ihdr, ChunkList *idats, Chunk *iend, FILE *out);
+
+// write compressed data as IDAT chunks while it is still being produced
+// chunks are split exactly like chunk_idat
+typedef struct IdatStream IdatStream;
+extern IdatStream *idat_stream_open(FILE *out);
+extern void idat_stream_write(IdatStream *stream, const uint8_t *data, int length);
+// write the last partial chunk and free the stream
+extern void idat_stream_close(IdatStream *stream);
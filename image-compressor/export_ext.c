@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "extract_ext.h"
+#include "export_ext.h"
+
+#include "debug_util.h"
+
+#define DEFAULT_DEPTH 255
+
+void export_pnm(void *pixels, int width, int height, Format format, FILE *out) {
+	Pixel *px = pixels;
+
+	int row_len;
+	switch (format) {
+		case BW:
+			fprintf(out, "P4\n%d %d\n", width, height);
+			row_len = PACKED_ROW_BYTES(width);
+			break;
+		case GREYSCALE:
+			fprintf(out, "P5\n%d %d\n%d\n", width, height, DEFAULT_DEPTH);
+			row_len = width;
+			break;
+		case FULL_COLOR:
+			fprintf(out, "P6\n%d %d\n%d\n", width, height, DEFAULT_DEPTH);
+			row_len = width * 3;
+			break;
+		default:
+			assert(false);
+	}
+
+	uint8_t *row = malloc(row_len);
+	assert(row != NULL);
+	for (int r = 0; r < height; r++) {
+		Pixel *in = (format == BW) ? NULL : px + (size_t) r * width;
+		switch (format) {
+			case BW:
+				// same packing as pbm, only black and white are swapped
+				for (int b = 0; b < row_len; b++) {
+					row[b] = ~((uint8_t *) pixels)[(size_t) r * row_len + b];
+				}
+				if (width % 8 != 0) row[row_len - 1] &= 0xFF << (8 - width % 8);
+				break;
+			case GREYSCALE:
+				for (int col = 0; col < width; col++) row[col] = in[col].gp;
+				break;
+			case FULL_COLOR:
+				for (int col = 0; col < width; col++) {
+					row[3 * col] = in[col].cp.red;
+					row[3 * col + 1] = in[col].cp.green;
+					row[3 * col + 2] = in[col].cp.blue;
+				}
+				break;
+		}
+		panic_if(fwrite(row, 1, row_len, out) != (size_t) row_len, "Failed to write PNM raster");
+	}
+	free(row);
+}
@@ -0,0 +1,7 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+// write pixels as binary PNM (P4, P5 or P6 depending on format)
+extern void export_pnm(void *pixels, int width, int height, Format format, FILE *out);
+
+#endif
@@ -8,6 +8,14 @@
 #include <math.h>
 #include <ctype.h>
 #include <assert.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "extract_ext.h"
 
@@ -15,16 +23,73 @@
 #include "debug_util.h"
 
 #define DEFAULT_DEPTH 255
+// ASCII rasters are split into ranges of at least this many bytes, one per core
+#define ASCII_RANGE_BYTES (1 << 20)
+// largest value a sample of at most 3 digits can have
+#define MAX_ASCII_SAMPLE 999
+
+#define IS_DIGIT(c) ((unsigned) ((c) - '0') < 10)
+
+struct PnmReader {
+	FILE *src;
+	char magic[3];
+	Format format;
+	int height;
+	int width;
+	int depth;
+	int next_row;
+	// offset of the first raster byte, for seeking in binary formats
+	long raster_offset;
+	// binary samples scaled to 8 bits
+	uint8_t scale[256];
+	// row buffer for binary reads
+	uint8_t *raw;
+};
+
+// where a failed try_extract_file returns to, and what it has to free
+typedef struct {
+	jmp_buf env;
+	const char *error;
+	PnmReader *reader;
+	void *pixels;
+} Recovery;
+
+// set only while this thread is inside try_extract_file
+static __thread Recovery *recovery = NULL;
+
+// malformed or truncated input: close the file, then unwind to try_extract_file,
+// or abort like any other panic when nothing is there to catch it
+static void fail(FILE *src, const char *reason) __attribute__((noreturn));
+
+static void fail(FILE *src, const char *reason) {
+	fclose(src);
+	if (recovery != NULL) {
+		recovery->error = reason;
+		longjmp(recovery->env, 1);
+	}
+	panic(reason);
+	abort();
+}
+
+// the next line that is neither blank nor a comment, NULL at the end of the file
+static char *header_line(FILE *source, char **buff, size_t *cap) {
+	ssize_t len;
+	while ((len = getline(buff, cap, source)) == 1 || (len > 0 && **buff == '#'));
+	return len > 0 ? *buff : NULL;
+}
 
 static void extract_header(FILE *source, char *buff) {
 	fgets(buff, 3, source);
 }
 
 static void extract_dimensions(FILE *source, int *height, int *width) {
-	char *buff = NULL;
+	char *line = NULL;
 	size_t cap = 0;
-	int len;
-	while ((len = getline(&buff, &cap, source)) == 1 || *buff == '#');
+	char *buff = header_line(source, &line, &cap);
+	if (buff == NULL) {
+		free(line);
+		fail(source, "Expected digit");
+	}
 
 	skip_ws(buff);
 
@@ -32,289 +97,658 @@ static void extract_dimensions(FILE *source, int *height, int *width) {
 	*width = strtol(buff, &end, 10);
 
 	if (buff == end) {
-		fclose(source);
-		panic("Expected digit");
+		free(line);
+		fail(source, "Expected digit");
 	}
 	buff = end;
 
 	skip_ws(buff);
 
 	*height = strtol(buff, &end, 10);
+	free(line);
 	if (buff == end) {
-		fclose(source);
-		panic("Expected digit");
+		fail(source, "Expected digit");
 	}
 }
 
-static Pixel *extract_P1(FILE *src, size_t size) {
-	Pixel *pixels = malloc(sizeof(Pixel) * size);
-	assert(pixels != NULL);
+// samples per pixel in the raw raster of a binary format, 0 for P4
+static int raw_pixel_size(PnmReader *reader) {
+	if (is(reader->magic, "P5")) return 1;
+	if (is(reader->magic, "P6")) return 3;
+	return 0;
+}
 
-	int character;
-	for (int i = 0; i < size; i++) {
-		// skip to a 0 or 1
-		while ((character = fgetc(src)) != EOF &&
-				(char) character != '0' && (char) character != '1');
-
-		if (character == EOF) {
-			fclose(src);
-			panic("Unexpected end of file");
+static uint16_t upscale(int cur_depth, uint16_t target) {
+	// int max_out_sample = pow(2, ceil(log2(cur_depth+1)))-1;
+	int max_out_sample = DEFAULT_DEPTH;
+	// from https://www.w3.org/TR/2003/REC-PNG-20031110/#12Sample-depth-scaling
+	return floor((target * max_out_sample / cur_depth) + 0.5);
+}
+
+// one slice of an ASCII raster, parsed on its own thread
+// slices start and end between samples, so each one can be tokenized alone
+typedef struct {
+	const uint8_t *start;
+	const uint8_t *end;
+	// P1 samples are single 0 or 1 characters, P2/P3 samples are digit runs
+	bool bits;
+	size_t count;
+	// index in the slice of the first sample with too many digits, SIZE_MAX if none
+	size_t long_sample;
+	// index in the raster of the slice's first sample, from the prefix sum of counts
+	size_t first;
+	// samples past this belong to no pixel and are ignored, as the sequential parse never reads them
+	size_t needed;
+	PnmReader *reader;
+	void *out;
+	const uint8_t *table;
+} AsciiRange;
+
+static void *count_range(void *arg) {
+	AsciiRange *range = arg;
+	const uint8_t *p = range->start;
+	size_t count = 0;
+	range->long_sample = SIZE_MAX;
+	if (range->bits) {
+		for (; p < range->end; p++) {
+			count += *p == '0' || *p == '1';
 		}
+	} else {
+		while (p < range->end) {
+			if (!IS_DIGIT(*p)) {
+				p++;
+				continue;
+			}
+			const uint8_t *token = p;
+			while (p < range->end && IS_DIGIT(*p)) p++;
+			if (p - token > 3 && range->long_sample == SIZE_MAX) range->long_sample = count;
+			count++;
+		}
+	}
+	range->count = count;
+	return NULL;
+}
 
-		pixels[i].bw = (char) character == '1';
+// or the bits of a packed byte in; bytes at either end of a slice may be shared with a neighbour
+static inline void flush_bits(uint8_t *byte, uint8_t bits, bool shared) {
+	if (bits == 0) return;
+	if (shared) {
+		__atomic_fetch_or(byte, bits, __ATOMIC_RELAXED);
+	} else {
+		*byte |= bits;
 	}
-	fclose(src);
-	return pixels;
 }
 
-static void decode_into_bool_array(Pixel *bools, size_t index, char target) {
-	for (int i = 7; i >= 0; i--) {
-		bools[index + i].bw = (target & 0x1) == 1;
-		target >>= 1;
+static void *fill_bits(AsciiRange *range) {
+	int width = range->reader->width;
+	size_t row_bytes = PACKED_ROW_BYTES(width);
+	uint8_t *packed = range->out;
+	size_t k = range->first;
+	size_t row = k / width;
+	int col = k % width;
+	size_t byte = row * row_bytes + col / 8;
+	uint8_t bits = 0;
+	bool first_byte = true;
+
+	for (const uint8_t *p = range->start; p < range->end && k < range->needed; p++) {
+		if (*p != '0' && *p != '1') continue;
+		size_t at = row * row_bytes + col / 8;
+		if (at != byte) {
+			flush_bits(packed + byte, bits, first_byte);
+			first_byte = false;
+			byte = at;
+			bits = 0;
+		}
+		// pbm 1 is black, png 1 is white
+		if (*p == '0') bits |= 0x80 >> (col % 8);
+		k++;
+		if (++col == width) {
+			col = 0;
+			row++;
+		}
 	}
+	flush_bits(packed + byte, bits, true);
+	return NULL;
 }
 
-static Pixel *extract_P4(FILE *src, size_t size) {
-	Pixel *pixels = calloc(sizeof(Pixel), (size+7)/8*8);
-	assert(pixels != NULL);
+static void *fill_range(void *arg) {
+	AsciiRange *range = arg;
+	if (range->first >= range->needed) return NULL;
+	if (range->bits) return fill_bits(range);
+
+	const uint8_t *table = range->table;
+	bool colour = range->reader->format == FULL_COLOR;
+	Pixel *pixels = range->out;
+	size_t k = range->first;
+	Pixel *pixel = pixels + (colour ? k / 3 : k);
+	int channel = colour ? k % 3 : 0;
+
+	const uint8_t *p = range->start;
+	while (k < range->needed) {
+		while (p < range->end && !IS_DIGIT(*p)) p++;
+		if (p == range->end) break;
+		// counting already rejected long samples before needed
+		unsigned num = 0;
+		while (p < range->end && IS_DIGIT(*p)) {
+			num = num * 10 + (*p++ - '0');
+		}
+		uint8_t value = table[num];
+		if (!colour) {
+			(pixel++)->gp = value;
+		} else if (channel == 0) {
+			pixel->cp.red = value;
+			channel = 1;
+		} else if (channel == 1) {
+			pixel->cp.green = value;
+			channel = 2;
+		} else {
+			(pixel++)->cp.blue = value;
+			channel = 0;
+		}
+		k++;
+	}
+	return NULL;
+}
 
-	int character;
-	size_t i = 0;
-	while (((character = fgetc(src)) != EOF)) {
-		decode_into_bool_array(pixels, (i++) * 8, character);
+// run fn over every range, the first on the calling thread
+static void run_ranges(AsciiRange *ranges, int count, void *(*fn)(void *)) {
+	pthread_t threads[count];
+	for (int i = 1; i < count; i++) {
+		panic_if(pthread_create(&threads[i], NULL, fn, &ranges[i]) != 0, "Failed to start parser thread");
 	}
-	assert(size/8 == i);
-	if (ferror(src)) {
-		panic("Unknown error while reading file");
+	fn(&ranges[0]);
+	for (int i = 1; i < count; i++) {
+		pthread_join(threads[i], NULL);
 	}
-	fclose(src);
-	return pixels;
 }
 
-static Pixel *extract_BW(FILE *src, char *magic, int height, int width) {
-	if (!(is(magic, "P1") || is(magic, "P4"))) {
-		fclose(src);
-		panic("Expected P1 or P4 magic number");
+// parse all remaining rows of an ASCII raster on every core: the mapped raster is
+// split into token aligned ranges, samples are counted per range, and a prefix sum
+// of the counts tells each range where its samples go in the output
+// the result and the errors reported match the sequential parse exactly
+// returns false when the raster can't be mapped (a pipe) or isn't read to the end
+static bool read_ascii_ranges(PnmReader *reader, void *out, int rows) {
+	if (reader->next_row + rows != reader->height) return false;
+	FILE *src = reader->src;
+	struct stat st;
+	off_t offset = ftello(src);
+	if (offset < 0 || fstat(fileno(src), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= offset) {
+		return false;
+	}
+	uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(src), 0);
+	if (map == MAP_FAILED) return false;
+	posix_madvise(map, st.st_size, POSIX_MADV_WILLNEED);
+
+	const uint8_t *text = map + offset;
+	size_t len = st.st_size - offset;
+	bool bits = is(reader->magic, "P1");
+	int per_pixel = reader->format == FULL_COLOR ? 3 : 1;
+	size_t needed = (size_t) rows * reader->width * per_pixel;
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t max_ranges = len / ASCII_RANGE_BYTES;
+	int count = cores < 1 || max_ranges < 1 ? 1 : (size_t) cores < max_ranges ? cores : (int) max_ranges;
+
+	AsciiRange ranges[count];
+	const uint8_t *start = text;
+	for (int i = 0; i < count; i++) {
+		const uint8_t *end = i == count - 1 ? text + len : text + len / count * (i + 1);
+		// never split a digit run between two ranges
+		while (!bits && end < text + len && IS_DIGIT(*end) && IS_DIGIT(end[-1])) end++;
+		if (end < start) end = start;
+		ranges[i] = (AsciiRange) { .start = start, .end = end, .bits = bits, .needed = needed, .reader = reader };
+		start = end;
+	}
+	run_ranges(ranges, count, count_range);
+
+	size_t total = 0;
+	size_t long_sample = SIZE_MAX;
+	for (int i = 0; i < count; i++) {
+		ranges[i].first = total;
+		if (long_sample == SIZE_MAX && ranges[i].long_sample != SIZE_MAX) {
+			long_sample = total + ranges[i].long_sample;
+		}
+		total += ranges[i].count;
+	}
+	// whichever error the sequential parse would have run into first
+	if (long_sample < needed) {
+		munmap(map, st.st_size);
+		fail(src, "Sample has too many digits");
+	}
+	if (total < needed) {
+		munmap(map, st.st_size);
+		fail(src, bits ? "Unexpected end of file" : "insufficent pixels in file");
 	}
 
-	if (is(magic, "P1")) {
-		return extract_P1(src, height * width);
+	uint8_t table[MAX_ASCII_SAMPLE + 1];
+	if (bits) {
+		memset(out, 0, row_size(BW, reader->width) * rows);
 	} else {
-		return extract_P4(src, height * width);
+		// the same truncation to 8 bits the sequential parse does
+		for (int v = 0; v <= MAX_ASCII_SAMPLE; v++) {
+			table[v] = upscale(reader->depth, v);
+		}
 	}
-}
+	for (int i = 0; i < count; i++) {
+		ranges[i].out = out;
+		ranges[i].table = table;
+	}
+	run_ranges(ranges, count, fill_range);
 
-static uint16_t upscale(int cur_depth, uint16_t target) {
-	// int max_out_sample = pow(2, ceil(log2(cur_depth+1)))-1;
-	int max_out_sample = DEFAULT_DEPTH;
-	// from https://www.w3.org/TR/2003/REC-PNG-20031110/#12Sample-depth-scaling
-	return floor((target * max_out_sample / cur_depth) + 0.5);
+	munmap(map, st.st_size);
+	return true;
 }
 
-static Pixel *extract_P2(FILE *src, size_t size, int depth) {
-	Pixel *pixels = malloc(sizeof(Pixel)*size);
-	assert(pixels != NULL);
-	size_t p = 0;
+static void read_P1(PnmReader *reader, uint8_t *packed, int rows) {
+	if (read_ascii_ranges(reader, packed, rows)) return;
 
-	uint16_t num;
-	char digits[4];
-	int i = 0;
+	FILE *src = reader->src;
+	int width = reader->width;
+	int row_bytes = PACKED_ROW_BYTES(width);
+	memset(packed, 0, (size_t) row_bytes * rows);
 
-	char character;
-	do {
-		character = fgetc(src);
-		if (!isdigit(character)) {
-			if (i == 0) continue;
-			digits[i] = '\0';
-			num = strtol(digits, NULL, 10);
-			pixels[p++].gp = upscale(depth, num);
-			i = 0;
-		} else {
-			digits[i++] = character;
-		}
+	int character;
+	for (int row = 0; row < rows; row++) {
+		uint8_t *out = packed + (size_t) row * row_bytes;
+		for (int col = 0; col < width; col++) {
+			// skip to a 0 or 1
+			while ((character = fgetc(src)) != EOF &&
+					(char) character != '0' && (char) character != '1');
+
+			if (character == EOF) {
+				fail(src, "Unexpected end of file");
+			}
 
-	} while (character != EOF);
+			// pbm 1 is black, png 1 is white
+			if ((char) character == '0') {
+				out[col / 8] |= 0x80 >> (col % 8);
+			}
+		}
+	}
+}
 
-	if (p < size) {
-		fclose(src);
-		panic("insufficent pixels in file");
+// flip every bit, pbm and png disagree on which value is black
+static void invert_bits(uint8_t *buf, size_t len) {
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i ones = _mm_set1_epi8((char) 0xFF);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		_mm_storeu_si128((__m128i *)(buf + i), _mm_xor_si128(v, ones));
+	}
+#endif
+	for (; i < len; i++) {
+		buf[i] = ~buf[i];
 	}
+}
 
-	fclose(src);
-	return pixels;
+static void read_binary(PnmReader *reader, uint8_t *buf, size_t size) {
+	size_t got = fread(buf, 1, size, reader->src);
+	if (ferror(reader->src)) {
+		fail(reader->src, "Unknown error while reading file");
+	}
+	if (got != size) {
+		fail(reader->src, "Unexpected end of file, insufficent pixels");
+	}
 }
 
-static Pixel *extract_P5(FILE *src, size_t size, int depth) {
-	Pixel *pixels = malloc(sizeof(Pixel) * size);
-	assert(pixels != NULL);
+static void read_P4(PnmReader *reader, uint8_t *packed, int rows) {
+	int width = reader->width;
+	int row_bytes = PACKED_ROW_BYTES(width);
+	size_t size = (size_t) row_bytes * rows;
+
+	// P4 rows are already padded to whole bytes, MSB first, like png scanlines
+	read_binary(reader, packed, size);
 
-	for (size_t i = 0; i < size; i++) {
-		int val = fgetc(src);
-		if (val == EOF) {
-			fclose(src);
-			panic("Unexpected end of file, insufficent pixels");
+	invert_bits(packed, size);
+
+	// padding bits were inverted too, clear them again
+	if (width % 8 != 0) {
+		uint8_t mask = 0xFF << (8 - width % 8);
+		for (int row = 0; row < rows; row++) {
+			packed[(size_t) row * row_bytes + row_bytes - 1] &= mask;
 		}
-		panic_if(val < 0 || val > 255, "Unexpected error when reading pixel for P5 format");
-		pixels[i].gp = upscale(depth, (uint8_t) val);
 	}
-	fclose(src);
-	return pixels;
 }
 
-static Pixel *extract_GREY(FILE *src, char *magic, int height, int width, int depth) {
-	if (!(is(magic, "P2") || is(magic, "P5"))) {
-		fclose(src);
-		panic("Expected P2 or P4 magic number");
+// next decimal sample of an ASCII raster, anything that is not a digit separates samples
+static uint16_t read_ascii_sample(PnmReader *reader) {
+	FILE *src = reader->src;
+	int character;
+	while ((character = fgetc(src)) != EOF && !isdigit(character));
+	if (character == EOF) {
+		fail(src, "insufficent pixels in file");
 	}
 
-	if (is(magic, "P2")) {
-		return extract_P2(src, height * width, depth);
-	} else {
-		return extract_P5(src, height * width, depth);
-	}
+	uint32_t num = 0;
+	int digits = 0;
+	do {
+		num = num * 10 + (character - '0');
+		if (++digits > 3) {
+			fail(src, "Sample has too many digits");
+		}
+	} while ((character = fgetc(src)) != EOF && isdigit(character));
+	return num;
 }
 
-static Pixel *extract_P3(FILE *src, size_t size, int depth) {
-	Pixel *pixels = malloc(sizeof(Pixel) * size);
-	assert(pixels != NULL);
-	size_t p = 0;
+static void read_P2(PnmReader *reader, Pixel *pixels, int rows) {
+	if (read_ascii_ranges(reader, pixels, rows)) return;
 
-	uint16_t num;
-	char digits[4];
-	int i = 0;
-	int sample = 0;
+	size_t size = (size_t) rows * reader->width;
+	for (size_t p = 0; p < size; p++) {
+		pixels[p].gp = upscale(reader->depth, read_ascii_sample(reader));
+	}
+}
 
-	char character;
-	do {
-		character = fgetc(src);
-		if (!isdigit(character)) {
-			if (i == 0) continue;
-			digits[i] = '\0';
-			num = strtol(digits, NULL, 10);
-			int sample_val = upscale(depth, num);
-			switch (sample++) {
-				case 0:
-					pixels[p].cp.red = sample_val;
-					break;
-				case 1:
-					pixels[p].cp.green = sample_val;
-					break;
-				case 2:
-					pixels[p].cp.blue = sample_val;
-					sample = 0;
-					p++;
-					break;
-			}
-			i = 0;
-		} else {
-			digits[i++] = character;
+static void read_P5(PnmReader *reader, Pixel *pixels, int rows) {
+	int width = reader->width;
+	for (int row = 0; row < rows; row++) {
+		read_binary(reader, reader->raw, width);
+		Pixel *out = pixels + (size_t) row * width;
+		for (int col = 0; col < width; col++) {
+			out[col].gp = reader->scale[reader->raw[col]];
 		}
+	}
+}
 
-	} while (character != EOF);
+static void read_P3(PnmReader *reader, Pixel *pixels, int rows) {
+	if (read_ascii_ranges(reader, pixels, rows)) return;
 
-	if (p < size) {
-		fclose(src);
-		panic("insufficent pixels in file");
+	size_t size = (size_t) rows * reader->width;
+	for (size_t p = 0; p < size; p++) {
+		pixels[p].cp.red = upscale(reader->depth, read_ascii_sample(reader));
+		pixels[p].cp.green = upscale(reader->depth, read_ascii_sample(reader));
+		pixels[p].cp.blue = upscale(reader->depth, read_ascii_sample(reader));
 	}
+}
 
-	fclose(src);
-	return pixels;
+static void read_P6(PnmReader *reader, Pixel *pixels, int rows) {
+	int width = reader->width;
+	for (int row = 0; row < rows; row++) {
+		read_binary(reader, reader->raw, (size_t) width * 3);
+		Pixel *out = pixels + (size_t) row * width;
+		for (int col = 0; col < width; col++) {
+			out[col].cp.red = reader->scale[reader->raw[3 * col]];
+			out[col].cp.green = reader->scale[reader->raw[3 * col + 1]];
+			out[col].cp.blue = reader->scale[reader->raw[3 * col + 2]];
+		}
+	}
 }
 
-static Pixel *extract_P6(FILE *src, size_t size, int depth) {
-	Pixel *pixels = malloc(sizeof(Pixel) * size);
-	assert(pixels != NULL);
+bool same_pixel(Pixel a, Pixel b, Format format) {
+	switch (format) {
+		case GREYSCALE:
+			return a.gp == b.gp;
+		case FULL_COLOR:
+			return a.cp.red == b.cp.red && a.cp.green == b.cp.green && a.cp.blue == b.cp.blue;
+		default:
+			assert(false);
+	}
+}
 
-	for (size_t i = 0; i < size; i++) {
-		// get red sample
-		int val = fgetc(src);
-		if (val == EOF) {
-			fclose(src);
-			panic("Unexpected end of file, insufficent pixels");
-		}
-		panic_if(val < 0 || val > 255, "Unexpected error when reading pixel for P6 format");
-		pixels[i].cp.red = upscale(depth, (uint8_t) val);
-
-		// get green sample
-		val = fgetc(src);
-		if (val == EOF) {
-			fclose(src);
-			panic("Unexpected end of file, insufficent pixels");
-		}
-		panic_if(val < 0 || val > 255, "Unexpected error when reading pixel for P6 format");
-		pixels[i].cp.green = upscale(depth, (uint8_t) val);
-
-		// get blue sample
-		val = fgetc(src);
-		if (val == EOF) {
-			fclose(src);
-			panic("Unexpected end of file, insufficent pixels");
-		}
-		panic_if(val < 0 || val > 255, "Unexpected error when reading pixel for P6 format");
-		pixels[i].cp.blue = upscale(depth, (uint8_t) val);
+void *extract(char *source, Format *format, int *height, int *width) {
+	FILE *src = fopen(source, "r");
+
+	panic_if(src == NULL, "No such file found");
+
+	return extract_file(src, source, format, height, width);
+}
+
+void *extract_file(FILE *src, char *name, Format *format, int *height, int *width) {
+	PnmReader *reader = reader_from_file(src, name, format, height, width);
+	void *pixels = malloc(row_size(*format, *width) * *height);
+	if (pixels == NULL) {
+		// a header can claim any size, that is not our bug
+		fail(src, "Image too large to hold in memory");
 	}
-	fclose(src);
+	if (recovery != NULL) recovery->pixels = pixels;
+	reader_rows(reader, pixels, *height);
+	reader_close(reader);
 	return pixels;
 }
 
-static Pixel *extract_color(FILE *src, char *magic, int height, int width, int depth) {
-	if (!(is(magic, "P3") || is(magic, "P6"))) {
-		fclose(src);
-		panic("Expected P3 or P6 magic number");
+void *try_extract_file(FILE *src, char *name, Format *format, int *height, int *width, const char **error) {
+	Recovery here = {0};
+	Recovery *outer = recovery;
+	recovery = &here;
+	if (setjmp(here.env) != 0) {
+		// fail already closed the file
+		recovery = outer;
+		if (here.reader != NULL) {
+			free(here.reader->raw);
+			free(here.reader);
+		}
+		free(here.pixels);
+		*error = here.error;
+		return NULL;
 	}
+	void *pixels = extract_file(src, name, format, height, width);
+	recovery = outer;
+	return pixels;
+}
 
-	if (is(magic, "P3")) {
-		return extract_P3(src, height * width, depth);
-	} else {
-		return extract_P6(src, height * width, depth);
-	}
+size_t row_size(Format format, int width) {
+	return format == BW ? (size_t) PACKED_ROW_BYTES(width) : sizeof(Pixel) * width;
 }
-Pixel *extract(char *source, Format *format, int *height, int *width) {
-	char *extension = strrchr(source, '.');
-	panic_if(extension == NULL, "there must be an extension given");
 
+PnmReader *reader_open(char *source, Format *format, int *height, int *width) {
 	FILE *src = fopen(source, "r");
 
 	panic_if(src == NULL, "No such file found");
 
-	char magic[3];
+	return reader_from_file(src, source, format, height, width);
+}
+
+PnmReader *reader_from_file(FILE *src, char *name, Format *format, int *height, int *width) {
+	char *extension = strrchr(name, '.');
+	if (extension == NULL) {
+		fail(src, "there must be an extension given");
+	}
+
+	PnmReader *reader = calloc(1, sizeof(PnmReader));
+	assert(reader != NULL);
+	reader->src = src;
+	if (recovery != NULL) recovery->reader = reader;
+
+	char *magic = reader->magic;
 	magic[2] = '\0';    // fixed: terminate 2-char magic correctly
 
 	extract_header(src, magic);
 
 	extract_dimensions(src, height, width);
+	if (*height < 1 || *width < 1) {
+		fail(src, "Image dimensions must be positive");
+	}
+	reader->height = *height;
+	reader->width = *width;
 
 	if (is(extension, ".pbm")) {
 		*format = BW;
-		return extract_BW(src, magic, *height, *width);
+		if (!(is(magic, "P1") || is(magic, "P4"))) {
+			fail(src, "Expected P1 or P4 magic number");
+		}
+	} else {
+		int depth;
+		// extract "bit depth"
+		char *line = NULL;
+		size_t cap = 0;
+		char *buff = header_line(src, &line, &cap);
+
+		char *end = NULL;
+		if (buff != NULL) {
+			skip_ws(buff);
+			depth = strtol(buff, &end, 10);
+		}
+		free(line);
+		if (buff == NULL || buff == end) {
+			fail(src, "Expected digit when parsing for sample depth");
+		}
+
+		if (depth > 255 || depth < 1) {
+			fail(src, "depth outside of range 0 < depth < 256");
+		}
+		reader->depth = depth;
+		for (int v = 0; v < 256; v++) {
+			reader->scale[v] = upscale(depth, v);
+		}
+
+		if (is(extension, ".pgm")) {
+			*format = GREYSCALE;
+			if (!(is(magic, "P2") || is(magic, "P5"))) {
+				fail(src, "Expected P2 or P5 magic number");
+			}
+		} else if (is(extension, ".ppm")) {
+			*format = FULL_COLOR;
+			if (!(is(magic, "P3") || is(magic, "P6"))) {
+				fail(src, "Expected P3 or P6 magic number");
+			}
+		} else {
+			fail(src, "Invalid extension encountered");
+		}
 	}
+	reader->format = *format;
+	reader->raster_offset = ftell(src);
 
-	int depth;
-	// extract "bit depth"
-	char *buff = NULL;
-	size_t cap = 0;
-	int len;
-	while ((len = getline(&buff, &cap, src)) == 1 || *buff == '#');
+	if (is(magic, "P5") || is(magic, "P6")) {
+		reader->raw = malloc((size_t) *width * 3);
+		assert(reader->raw != NULL);
+	}
+	return reader;
+}
 
-	skip_ws(buff);
+void reader_rows(PnmReader *reader, void *rows, int count) {
+	panic_if(count < 0 || reader->next_row + count > reader->height, "Read past the last row");
 
-	char *end = NULL;
-	depth = strtol(buff, &end, 10);
+	char *magic = reader->magic;
+	if (is(magic, "P1")) {
+		read_P1(reader, rows, count);
+	} else if (is(magic, "P4")) {
+		read_P4(reader, rows, count);
+	} else if (is(magic, "P2")) {
+		read_P2(reader, rows, count);
+	} else if (is(magic, "P5")) {
+		read_P5(reader, rows, count);
+	} else if (is(magic, "P3")) {
+		read_P3(reader, rows, count);
+	} else {
+		read_P6(reader, rows, count);
+	}
+	reader->next_row += count;
+}
 
-	if (buff == end) {
-		fclose(src);
-		panic("Expected digit when parsing for sample depth");
+// copy width bits starting at bit offset of src to the start of dst, padding bits 0
+static void copy_bits(uint8_t *dst, const uint8_t *src, int offset, int width) {
+	int bytes = PACKED_ROW_BYTES(width);
+	src += offset / 8;
+	int shift = offset % 8;
+	for (int i = 0; i < bytes; i++) {
+		// src always holds one byte past the span, so src[i + 1] is readable
+		dst[i] = shift == 0 ? src[i] : (src[i] << shift) | (src[i + 1] >> (8 - shift));
 	}
-	buff = end;
+	if (width % 8 != 0) {
+		dst[bytes - 1] &= 0xFF << (8 - width % 8);
+	}
+}
+
+// read exactly size bytes at offset without touching the stream position
+static void read_at(PnmReader *reader, uint8_t *buf, size_t size, off_t offset) {
+	int fd = fileno(reader->src);
+	while (size > 0) {
+		ssize_t got = pread(fd, buf, size, offset);
+		if (got < 0) {
+			fail(reader->src, "Unknown error while reading file");
+		}
+		if (got == 0) {
+			fail(reader->src, "Unexpected end of file, insufficent pixels");
+		}
+		buf += got;
+		size -= got;
+		offset += got;
+	}
+}
 
-	panic_if(depth > 255 || depth < 0, "depth outside of range 0 <= depth < 256");
+// binary rows sit at fixed offsets from raster_offset, read only the span needed
+static void read_binary_crop(PnmReader *reader, int x, int y, int w, int h, void *out) {
+	int pixel_size = raw_pixel_size(reader);
+	size_t stride = pixel_size == 0 ? (size_t) PACKED_ROW_BYTES(reader->width)
+			: (size_t) reader->width * pixel_size;
+	size_t first = pixel_size == 0 ? (size_t) x / 8 : (size_t) x * pixel_size;
+	size_t span = pixel_size == 0 ? (size_t) PACKED_ROW_BYTES(x % 8 + w) : (size_t) w * pixel_size;
+
+	// one spare byte for copy_bits
+	uint8_t *raw = calloc(span + 1, 1);
+	assert(raw != NULL);
+	size_t out_size = row_size(reader->format, w);
+
+	for (int row = 0; row < h; row++) {
+		read_at(reader, raw, span, reader->raster_offset + (off_t) (y + row) * stride + first);
+		uint8_t *dst = (uint8_t *) out + (size_t) row * out_size;
+		if (pixel_size == 0) {
+			copy_bits(dst, raw, x % 8, w);
+			invert_bits(dst, out_size);
+			if (w % 8 != 0) dst[out_size - 1] &= 0xFF << (8 - w % 8);
+		} else if (pixel_size == 1) {
+			Pixel *pixels = (Pixel *) dst;
+			for (int col = 0; col < w; col++) {
+				pixels[col].gp = reader->scale[raw[col]];
+			}
+		} else {
+			Pixel *pixels = (Pixel *) dst;
+			for (int col = 0; col < w; col++) {
+				pixels[col].cp.red = reader->scale[raw[3 * col]];
+				pixels[col].cp.green = reader->scale[raw[3 * col + 1]];
+				pixels[col].cp.blue = reader->scale[raw[3 * col + 2]];
+			}
+		}
+	}
+	free(raw);
+}
+
+// ASCII rows have no fixed offsets, parse through them and keep the span
+static void read_ascii_crop(PnmReader *reader, int x, int y, int w, int h, void *out) {
+	size_t full_size = row_size(reader->format, reader->width);
+	size_t out_size = row_size(reader->format, w);
+	// one spare byte for copy_bits
+	uint8_t *row = calloc(full_size + 1, 1);
+	assert(row != NULL);
 
-	if (is(extension, ".pgm")) {
-		*format = GREYSCALE;
-		return extract_GREY(src, magic, *height, *width, depth);
-	} else if (is(extension, ".ppm")) {
-		*format = FULL_COLOR;
-		return extract_color(src, magic, *height, *width, depth);
+	for (int r = 0; r < y; r++) {
+		reader_rows(reader, row, 1);
+	}
+	for (int r = 0; r < h; r++) {
+		reader_rows(reader, row, 1);
+		uint8_t *dst = (uint8_t *) out + (size_t) r * out_size;
+		if (reader->format == BW) {
+			copy_bits(dst, row, x, w);
+		} else {
+			memcpy(dst, (Pixel *) row + x, out_size);
+		}
 	}
-	panic("Invalid extension encountered");
+	free(row);
+}
+
+void *extract_crop(char *source, int x, int y, int w, int h, Format *format) {
+	int height;
+	int width;
+	PnmReader *reader = reader_open(source, format, &height, &width);
+	if (x < 0 || y < 0 || w < 1 || h < 1 || x > width - w || y > height - h) {
+		reader_close(reader);
+		panic("Crop rectangle must lie inside the image");
+	}
+
+	void *pixels = malloc(row_size(*format, w) * h);
+	assert(pixels != NULL);
+	if (raw_pixel_size(reader) != 0 || is(reader->magic, "P4")) {
+		read_binary_crop(reader, x, y, w, h, pixels);
+	} else {
+		read_ascii_crop(reader, x, y, w, h, pixels);
+	}
+	reader_close(reader);
+	return pixels;
+}
+
+void reader_close(PnmReader *reader) {
+	fclose(reader->src);
+	free(reader->raw);
+	free(reader);
 }
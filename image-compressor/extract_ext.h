@@ -11,11 +11,48 @@ typedef struct {
 	uint8_t blue;
 } CPixel;
 
+// GREYSCALE and FULL_COLOR images are arrays of Pixel
+// BW images are never unpacked: they are rows of PACKED_ROW_BYTES(width) bytes,
+// MSB first, laid out exactly like a PNG 1 bit scanline (1 = white, padding bits 0)
 typedef union {
-	bool bw;
 	uint8_t gp;
 	CPixel cp;
 } Pixel;	
 
-extern Pixel *extract(char *source, Format *format, int *height, int *width);
+#define PACKED_ROW_BYTES(width) (((width) + 7) / 8)
+
+// compare the samples a pixel actually uses for its format (not BW)
+extern bool same_pixel(Pixel a, Pixel b, Format format);
+
+extern void *extract(char *source, Format *format, int *height, int *width);
+
+// extract from an already open file; name only supplies the extension
+// src is closed once the raster has been read
+extern void *extract_file(FILE *src, char *name, Format *format, int *height, int *width);
+// extract_file for long running callers: malformed or truncated input returns
+// NULL with the reason in error instead of aborting the process; src is closed
+// either way
+extern void *try_extract_file(FILE *src, char *name, Format *format, int *height, int *width,
+		const char **error);
+
+// extract only the w x h rectangle at x,y, in the extract layout
+// binary rasters are read with one positioned read per row covering just the
+// needed columns; ASCII rasters can't be seeked, so rows up to the crop are parsed
+extern void *extract_crop(char *source, int x, int y, int w, int h, Format *format);
+
+// bytes one row of pixels takes in the extract layout
+extern size_t row_size(Format format, int width);
+
+// row by row access to a PNM raster, for callers that never hold the whole image
+typedef struct PnmReader PnmReader;
+
+// parse the header, leaving the file at the first raster row
+extern PnmReader *reader_open(char *source, Format *format, int *height, int *width);
+extern PnmReader *reader_from_file(FILE *src, char *name, Format *format, int *height, int *width);
+
+// read the next count rows, in the extract layout, into rows
+extern void reader_rows(PnmReader *reader, void *rows, int count);
+
+// close the file and free the reader
+extern void reader_close(PnmReader *reader);
 
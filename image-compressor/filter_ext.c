@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <math.h>
 #include <limits.h>
+#include <string.h>
 
 #include "extract_ext.h"
 #include "filter_ext.h"
@@ -42,10 +43,19 @@ static int paeth_predict(uint8_t a, uint8_t b, uint8_t c) {
     return res;
 }
 
+// same result as paeth_predict, written with selects so it compiles without branches
+static inline int paeth_select(int a, int b, int c) {
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - 2 * c);
+    int ab = (pb < pa) ? b : a;
+    int pab = (pb < pa) ? pb : pa;
+    return (pc < pab) ? c : ab;
+}
 
-static int min_diff(int filtered_line[5]) {
-    int ind;
-    int min_v = INT_MAX;
+static int min_diff(long filtered_line[5]) {
+    int ind = 0;
+    long min_v = LONG_MAX;
     for (int i = 0; i < 5;i++) {
         if (filtered_line[i] < min_v) {
             min_v = filtered_line[i];
@@ -55,108 +65,423 @@ static int min_diff(int filtered_line[5]) {
     return ind;
 }
 
-// row_length and num_row from image width and height
-uint8_t ** filter(uint8_t ** scanlines, int row_length, int num_row, Format format) {
-    int bpp; // bits per pixel
+// minimum sum heuristic: the filter whose output bytes add up to the least
+static inline __attribute__((always_inline))
+int choose_filter(const uint8_t * cur, const uint8_t * prev, int row_length, int bpp) {
+    // first pass only sums each candidate, the row stays hot for the second
+    long type0 = 0;
+    long type1 = 0;
+    long type2 = 0;
+    long type3 = 0;
+    long type4 = 0;
+    // the first pixel has no left neighbour, peel it so the main loop has no bounds checks
+    for (int l = 0; l < bpp && l < row_length; l++) {
+        uint8_t b = prev[l];
+        uint8_t x = cur[l];
+
+        type0 += x;
+        type1 += x;
+        type2 += (uint8_t)up_filter(x, b);
+        type3 += (uint8_t)average_filter(x, 0, b);
+        type4 += (uint8_t)(x - b);
+    }
+    for (int l = bpp; l < row_length; l++) {
+        uint8_t c = prev[l - bpp];
+        uint8_t b = prev[l];
+        uint8_t a = cur[l - bpp];
+        uint8_t x = cur[l];
+
+        type0 += x;
+        type1 += (uint8_t)sub_filter(x, a);
+        type2 += (uint8_t)up_filter(x, b);
+        type3 += (uint8_t)average_filter(x, a, b);
+        type4 += (uint8_t)(x - paeth_select(a, b, c));
+    }
+
+    return min_diff((long[5]){type0, type1, type2, type3, type4});
+}
+
+static inline __attribute__((always_inline))
+void write_filter(const uint8_t * cur, const uint8_t * prev, int row_length, int bpp, int min_ind, uint8_t * out) {
+    out[0] = min_ind;
+    uint8_t * line = out + 1;
+    // pick the loop once per row rather than per byte
+    switch (min_ind) {
+        case 0:
+            memcpy(line, cur, row_length);
+            break;
+        case 1:
+            for (int l = 0; l < row_length; l++) {
+                uint8_t a = (l - bpp < 0) ? 0 : cur[l - bpp];
+                line[l] = (uint8_t)sub_filter(cur[l], a);
+            }
+            break;
+        case 2:
+            for (int l = 0; l < row_length; l++) {
+                line[l] = (uint8_t)up_filter(cur[l], prev[l]);
+            }
+            break;
+        case 3:
+            for (int l = 0; l < row_length; l++) {
+                uint8_t a = (l - bpp < 0) ? 0 : cur[l - bpp];
+                line[l] = (uint8_t)average_filter(cur[l], a, prev[l]);
+            }
+            break;
+        default:
+            for (int l = 0; l < row_length; l++) {
+                uint8_t c = (l - bpp < 0) ? 0 : prev[l - bpp];
+                uint8_t a = (l - bpp < 0) ? 0 : cur[l - bpp];
+                line[l] = (uint8_t)(cur[l] - paeth_select(a, prev[l], c));
+            }
+            break;
+    }
+}
+
+// filter one scanline against the previous one (all zeros for the first row)
+// out receives the filter type byte followed by row_length filtered bytes
+// inlined with a constant bpp, so every caller gets its own specialised loop
+static inline __attribute__((always_inline))
+void filter_row(const uint8_t * cur, const uint8_t * prev, int row_length, int bpp,
+        FilterStrategy strategy, uint8_t * out) {
+    int min_ind = strategy;
+    if (strategy == FILTER_ADAPTIVE) {
+        min_ind = choose_filter(cur, prev, row_length, bpp);
+    }
+    write_filter(cur, prev, row_length, bpp, min_ind, out);
+}
 
+static int format_bpp(Format format) {
     switch (format) {
         case BW:
-            bpp = BINARY_PIXEL_SIZE;
-            break;
+            return BINARY_PIXEL_SIZE;
         case GREYSCALE:
-            bpp = GREY_PIXEL_SIZE;
-            break;
+            return GREY_PIXEL_SIZE;
         case FULL_COLOR:
-            bpp = COLOR_PIXEL_SIZE;
-            break;
+            return COLOR_PIXEL_SIZE;
         default:
             fprintf(stderr, "Unsupported format\n");
             exit(EXIT_FAILURE);
     }
+}
+
+// row_length and num_row from image width and height
+uint8_t ** filter(uint8_t ** scanlines, int row_length, int num_row, Format format) {
+    int bpp = format_bpp(format); // bytes per pixel
+
+    uint8_t * zeros = calloc(row_length, sizeof(uint8_t));
+    assert(zeros != NULL);
 
     // initialise return array 
     uint8_t ** lines = malloc(num_row * sizeof(uint8_t *));
+    assert(lines != NULL);
     // iterate over each scanline
     for (int r = 0; r < num_row; r++) {
-        uint8_t * line0 = malloc((row_length + 1) * sizeof(uint8_t));
-        uint8_t * line1 = malloc((row_length + 1) * sizeof(uint8_t));
-        uint8_t * line2 = malloc((row_length + 1) * sizeof(uint8_t));
-        uint8_t * line3 = malloc((row_length + 1) * sizeof(uint8_t));
-        uint8_t * line4 = malloc((row_length + 1) * sizeof(uint8_t));
-        line0[0] = 0;
-        line1[0] = 1;
-        line2[0] = 2;
-        line3[0] = 3;
-        line4[0] = 4;
-        int type0 = 0;
-        int type1 = 0;
-        int type2 = 0;
-        int type3 = 0;
-        int type4 = 0;
-        // iterate over each byte in each scanline
-        for (int l = 0; l < row_length; l++) {
-            uint8_t c = ((r - 1 < 0) || (l - bpp < 0)) ? 0 : scanlines[r - 1][l - bpp];
-            uint8_t b = (r - 1 < 0) ? 0 : scanlines[r - 1][l];
-            uint8_t a = (l - bpp < 0) ? 0 : scanlines[r][l - bpp];
-            uint8_t x = scanlines[r][l];
-
-            line0[l + 1] = (uint8_t)x;
-            line1[l + 1] = (uint8_t)sub_filter(x, a);
-            line2[l + 1] = (uint8_t)up_filter(x, b);
-            line3[l + 1] = (uint8_t)average_filter(x, a, b);
-            line4[l + 1] = (uint8_t)((x -paeth_predict(a, b , c)) & 0xFF);
-
-            type0 += x;
-            type1 += abs(sub_filter(x, a));
-            type2 += abs(up_filter(x, b));
-            type3 += abs(average_filter(x, a, b));
-            type4 += abs((x -paeth_predict(a, b , c)) & 0xFF);
+        lines[r] = malloc((row_length + 1) * sizeof(uint8_t));
+        assert(lines[r] != NULL);
+        const uint8_t * prev = (r == 0) ? zeros : scanlines[r - 1];
+        if (bpp == COLOR_PIXEL_SIZE) {
+            filter_row(scanlines[r], prev, row_length, COLOR_PIXEL_SIZE, FILTER_ADAPTIVE, lines[r]);
+        } else {
+            filter_row(scanlines[r], prev, row_length, GREY_PIXEL_SIZE, FILTER_ADAPTIVE, lines[r]);
         }
+    }
+    free(zeros);
+    return lines;
+}
 
-        int min_ind = min_diff((int[5]){type0, type1, type2, type3, type4});
-        switch (min_ind)
-        {
-        case 0:
-            lines[r] = line0;
-            free(line1);
-            free(line2);
-            free(line3);
-            free(line4);
+// turn one row of pixels into scanline bytes, format is a constant after inlining
+static inline __attribute__((always_inline))
+void serialise_row(const Pixel * pixels, int width, Format format, uint8_t * out) {
+    if (format == GREYSCALE) {
+        for (int col = 0; col < width; col++) {
+            out[col] = pixels[col].gp;
+        }
+    } else {
+        for (int col = 0; col < width; col++) {
+            out[3 * col] = pixels[col].cp.red;
+            out[3 * col + 1] = pixels[col].cp.green;
+            out[3 * col + 2] = pixels[col].cp.blue;
+        }
+    }
+}
+
+// one pass per row: serialise into a small buffer, then filter it against the
+// previous one while both are still in cache
+static inline __attribute__((always_inline))
+void fused_rows(void * buffer, int width, int num_row, int row_length, Format format, int bpp,
+        FilterStrategy strategy, uint8_t ** lines) {
+    uint8_t * rows = calloc(2 * (size_t)row_length, sizeof(uint8_t));
+    assert(rows != NULL);
+    uint8_t * prev = rows;
+    uint8_t * cur = rows + row_length;
+
+    for (int r = 0; r < num_row; r++) {
+        lines[r] = malloc((row_length + 1) * sizeof(uint8_t));
+        assert(lines[r] != NULL);
+
+        if (format == BW) {
+            // extract already left BW rows as scanlines
+            uint8_t * packed = buffer;
+            cur = packed + (size_t)r * row_length;
+            filter_row(cur, prev, row_length, bpp, strategy, lines[r]);
+            prev = cur;
+        } else {
+            serialise_row((Pixel *)buffer + (size_t)r * width, width, format, cur);
+            filter_row(cur, prev, row_length, bpp, strategy, lines[r]);
+            uint8_t * tmp = prev;
+            prev = cur;
+            cur = tmp;
+        }
+    }
+    free(rows);
+}
+
+uint8_t ** serialise_filter(void * buffer, int width, int num_row, Format format, int * length) {
+    return serialise_filter_with(buffer, width, num_row, format, FILTER_ADAPTIVE, length);
+}
+
+static int scanline_length(int width, Format format) {
+    switch (format) {
+        case BW:
+            return PACKED_ROW_BYTES(width);
+        case GREYSCALE:
+            return width;
+        case FULL_COLOR:
+            return width * COLOR_PIXEL_SIZE;
+        default:
+            fprintf(stderr, "Unsupported format\n");
+            exit(EXIT_FAILURE);
+    }
+}
+
+uint8_t ** serialise_filter_with(void * buffer, int width, int num_row, Format format,
+        FilterStrategy strategy, int * length) {
+    int row_length = scanline_length(width, format);
+
+    uint8_t ** lines = malloc(num_row * sizeof(uint8_t *));
+    assert(lines != NULL);
+
+    // each case is its own specialised copy of the loop
+    switch (format) {
+        case BW:
+            fused_rows(buffer, width, num_row, row_length, BW, BINARY_PIXEL_SIZE, strategy, lines);
             break;
-        case 1:
-            lines[r] = line1;
-            free(line0);
-            free(line2);
-            free(line3);
-            free(line4);
+        case GREYSCALE:
+            fused_rows(buffer, width, num_row, row_length, GREYSCALE, GREY_PIXEL_SIZE, strategy, lines);
             break;
-        case 2:
-            lines[r] = line2;
-            free(line0);
-            free(line1);
-            free(line3);
-            free(line4);
+        case FULL_COLOR:
+            fused_rows(buffer, width, num_row, row_length, FULL_COLOR, COLOR_PIXEL_SIZE, strategy, lines);
             break;
-        case 3:
-            lines[r] = line3;
-            free(line0);
-            free(line1);
-            free(line2);
-            free(line4);
+    }
+
+    *length = row_length;
+    return lines;
+}
+
+struct RowFilter {
+    int width;
+    int row_length;
+    Format format;
+    FilterStrategy strategy;
+    // scanline bytes of the last row handed in, zeros before the first
+    uint8_t * prev;
+    uint8_t * cur;
+};
+
+RowFilter * row_filter_create(int width, Format format, FilterStrategy strategy) {
+    RowFilter * rf = malloc(sizeof(RowFilter));
+    assert(rf != NULL);
+    rf->width = width;
+    rf->row_length = scanline_length(width, format);
+    rf->format = format;
+    rf->strategy = strategy;
+    rf->prev = calloc(rf->row_length, sizeof(uint8_t));
+    rf->cur = malloc(rf->row_length * sizeof(uint8_t));
+    assert(rf->prev != NULL && rf->cur != NULL);
+    return rf;
+}
+
+int row_filter_length(RowFilter * rf) {
+    return rf->row_length;
+}
+
+// same loop as fused_rows, but the previous row survives between calls
+static inline __attribute__((always_inline))
+void stream_rows(RowFilter * rf, const void * rows, int count, uint8_t * out, Format format, int bpp) {
+    int row_length = rf->row_length;
+    for (int r = 0; r < count; r++) {
+        if (format == BW) {
+            memcpy(rf->cur, (const uint8_t *)rows + (size_t)r * row_length, row_length);
+        } else {
+            serialise_row((const Pixel *)rows + (size_t)r * rf->width, rf->width, format, rf->cur);
+        }
+        filter_row(rf->cur, rf->prev, row_length, bpp, rf->strategy, out + (size_t)r * (row_length + 1));
+        uint8_t * tmp = rf->prev;
+        rf->prev = rf->cur;
+        rf->cur = tmp;
+    }
+}
+
+void row_filter_rows(RowFilter * rf, const void * rows, int count, uint8_t * out) {
+    switch (rf->format) {
+        case BW:
+            stream_rows(rf, rows, count, out, BW, BINARY_PIXEL_SIZE);
             break;
-        case 4:
-            lines[r] = line4;
-            free(line0);
-            free(line1);
-            free(line2);
-            free(line3);
+        case GREYSCALE:
+            stream_rows(rf, rows, count, out, GREYSCALE, GREY_PIXEL_SIZE);
             break;
-        default:
+        case FULL_COLOR:
+            stream_rows(rf, rows, count, out, FULL_COLOR, COLOR_PIXEL_SIZE);
             break;
-        }
     }
-    return lines;
 }
 
+void row_filter_free(RowFilter * rf) {
+    free(rf->prev);
+    free(rf->cur);
+    free(rf);
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
 
+// ref: libpng contrib/intel filter_sse2_intrinsics.c
+// 3 byte pixels are moved through the low lanes of a register
+static __m128i load3(const uint8_t * p) {
+    uint32_t v = 0;
+    memcpy(&v, p, 3);
+    return _mm_cvtsi32_si128(v);
+}
 
+static void store3(uint8_t * p, __m128i v) {
+    uint32_t x = _mm_cvtsi128_si32(v);
+    memcpy(p, &x, 3);
+}
+
+static void unfilter_up(uint8_t * row, const uint8_t * prev, int row_length) {
+    int l = 0;
+    for (; l + 16 <= row_length; l += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(row + l));
+        __m128i b = _mm_loadu_si128((const __m128i *)(prev + l));
+        _mm_storeu_si128((__m128i *)(row + l), _mm_add_epi8(x, b));
+    }
+    for (; l < row_length; l++) {
+        row[l] += prev[l];
+    }
+}
+
+static void unfilter_sub3(uint8_t * row, int row_length) {
+    __m128i a = _mm_setzero_si128();
+    for (int l = 0; l < row_length; l += 3) {
+        a = _mm_add_epi8(a, load3(row + l));
+        store3(row + l, a);
+    }
+}
+
+static void unfilter_average3(uint8_t * row, const uint8_t * prev, int row_length) {
+    __m128i a = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for (int l = 0; l < row_length; l += 3) {
+        __m128i b = load3(prev + l);
+        // avg_epu8 rounds up, the filter rounds down
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(load3(row + l), avg);
+        store3(row + l, a);
+    }
+}
+
+static __m128i abs_epi16(__m128i x) {
+    __m128i neg = _mm_srai_epi16(x, 15);
+    return _mm_sub_epi16(_mm_xor_si128(x, neg), neg);
+}
+
+static __m128i if_then_else(__m128i c, __m128i t, __m128i e) {
+    return _mm_or_si128(_mm_and_si128(c, t), _mm_andnot_si128(c, e));
+}
+
+static void unfilter_paeth3(uint8_t * row, const uint8_t * prev, int row_length) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+    for (int l = 0; l < row_length; l += 3) {
+        // widen to 16 bit lanes so a + b - c cannot overflow
+        __m128i b = _mm_unpacklo_epi8(load3(prev + l), zero);
+        __m128i x = _mm_unpacklo_epi8(load3(row + l), zero);
+
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = abs_epi16(_mm_add_epi16(pa, pb));
+        pa = abs_epi16(pa);
+        pb = abs_epi16(pb);
+
+        __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+        __m128i pred = if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
+                if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+        c = b;
+        a = _mm_and_si128(_mm_add_epi16(x, pred), _mm_set1_epi16(0xFF));
+        store3(row + l, _mm_packus_epi16(a, a));
+    }
+}
+#endif
+
+void unfilter(uint8_t * line, uint8_t * prev, int row_length, Format format) {
+    int bpp = (format == FULL_COLOR) ? COLOR_PIXEL_SIZE : GREY_PIXEL_SIZE;
+    uint8_t type = line[0];
+    uint8_t * row = line + 1;
+    uint8_t * up = (prev == NULL) ? NULL : prev + 1;
+
+    // the first row filters against an implicit row of zeros
+    if (up == NULL) {
+        if (type == 2) return;
+        if (type == 4) type = 1;
+    }
+
+#ifdef __SSE2__
+    if (type == 2) {
+        unfilter_up(row, up, row_length);
+        return;
+    }
+    if (bpp == COLOR_PIXEL_SIZE) {
+        switch (type) {
+            case 1:
+                unfilter_sub3(row, row_length);
+                return;
+            case 3:
+                if (up != NULL) {
+                    unfilter_average3(row, up, row_length);
+                    return;
+                }
+                break;
+            case 4:
+                unfilter_paeth3(row, up, row_length);
+                return;
+        }
+    }
+#endif
+
+    for (int l = 0; l < row_length; l++) {
+        uint8_t a = (l - bpp < 0) ? 0 : row[l - bpp];
+        uint8_t b = (up == NULL) ? 0 : up[l];
+        uint8_t c = (up == NULL || l - bpp < 0) ? 0 : up[l - bpp];
+        switch (type) {
+            case 0:
+                return;
+            case 1:
+                row[l] += a;
+                break;
+            case 2:
+                row[l] += b;
+                break;
+            case 3:
+                row[l] += (a + b) / 2;
+                break;
+            case 4:
+                row[l] += paeth_predict(a, b, c);
+                break;
+            default:
+                fprintf(stderr, "Invalid filter type %d\n", type);
+                exit(EXIT_FAILURE);
+        }
+    }
+}
@@ -5,4 +5,35 @@
 #include <assert.h>
 #include <math.h>
 
+// per-row filter choice; the fixed strategies match the PNG filter type numbers
+typedef enum {
+	FILTER_NONE,
+	FILTER_SUB,
+	FILTER_UP,
+	FILTER_AVERAGE,
+	FILTER_PAETH,
+	FILTER_ADAPTIVE	// minimum sum of absolute differences per row
+} FilterStrategy;
+
 uint8_t ** filter(uint8_t ** scanlines, int row_length, int num_row,Format format);
+
+// serialise and filter in a single pass, specialised per format
+// returns the same filtered lines as filter(serialise(...)), length is the scanline width
+uint8_t ** serialise_filter(void * buffer, int width, int num_row, Format format, int * length);
+
+// serialise_filter with a chosen strategy instead of the adaptive default
+uint8_t ** serialise_filter_with(void * buffer, int width, int num_row, Format format,
+        FilterStrategy strategy, int * length);
+
+// streaming serialise+filter for callers that see the image a few rows at a time
+typedef struct RowFilter RowFilter;
+RowFilter * row_filter_create(int width, Format format, FilterStrategy strategy);
+// scanline bytes per row, each filtered line is one byte longer
+int row_filter_length(RowFilter * rf);
+// filter the next count rows (extract layout) into out, back to back
+void row_filter_rows(RowFilter * rf, const void * rows, int count, uint8_t * out);
+void row_filter_free(RowFilter * rf);
+
+// reverse the filter of one scanline in place
+// line starts with the filter type byte, prev is the previous reconstructed line (or NULL)
+void unfilter(uint8_t * line, uint8_t * prev, int row_length, Format format);
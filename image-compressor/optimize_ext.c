@@ -0,0 +1,266 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "extract_ext.h"
+#include "filter_ext.h"
+#include "compress_ext.h"
+#include "png_ext.h"
+#include "optimize_ext.h"
+
+#include "debug_util.h"
+
+#define NUM_FILTERS (FILTER_ADAPTIVE + 1)
+
+typedef struct {
+	FilterStrategy filter;
+	int level;
+	int strategy;
+	int mem_level;
+	int window_bits;
+} Candidate;
+
+typedef struct {
+	void *pixels;
+	int width;
+	int height;
+	Format format;
+	double deadline;
+
+	Candidate *candidates;
+	int count;
+	int next;
+
+	// filtered images are shared by every candidate with the same strategy
+	pthread_mutex_t filter_locks[NUM_FILTERS];
+	uint8_t **filtered[NUM_FILTERS];
+	int scanline_width;	// set before the workers start, read only after
+
+	pthread_mutex_t lock;
+	void *best;
+	int best_len;
+	int best_index;
+	int default_len;
+	int tried;
+	int pruned;	// could no longer beat the best
+	int timed_out;	// cut off by the deadline
+} Search;
+
+typedef struct {
+	Search *search;
+	bool must_finish;
+	bool out_of_time;
+} Attempt;
+
+static const char *filter_names[NUM_FILTERS] = {
+	"none", "sub", "up", "average", "paeth", "adaptive"
+};
+
+static const char *strategy_name(int strategy) {
+	switch (strategy) {
+		case Z_FILTERED:
+			return "filtered";
+		case Z_RLE:
+			return "rle";
+		case Z_HUFFMAN_ONLY:
+			return "huffman";
+		default:
+			return "default";
+	}
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// stop a candidate once it can no longer win or the budget is spent
+// compressed output only grows, so a partial size past the best is final
+static bool give_up(void *ctx, int partial_length) {
+	Attempt *attempt = ctx;
+	if (attempt->must_finish) return false;
+	Search *search = attempt->search;
+	if (partial_length >= __atomic_load_n(&search->best_len, __ATOMIC_RELAXED)) return true;
+	attempt->out_of_time = now() > search->deadline;
+	return attempt->out_of_time;
+}
+
+static uint8_t **filtered_lines(Search *search, FilterStrategy filter) {
+	pthread_mutex_lock(&search->filter_locks[filter]);
+	if (search->filtered[filter] == NULL) {
+		int scanline_width;
+		search->filtered[filter] = serialise_filter_with(search->pixels, search->width,
+				search->height, search->format, filter, &scanline_width);
+		assert(scanline_width == search->scanline_width);
+	}
+	pthread_mutex_unlock(&search->filter_locks[filter]);
+	return search->filtered[filter];
+}
+
+static void run_candidate(Search *search, int index) {
+	Candidate *c = &search->candidates[index];
+	uint8_t **lines = filtered_lines(search, c->filter);
+
+	Attempt attempt = {search, index == 0, false};
+	CompressSettings settings = {
+		.level = c->level,
+		.strategy = c->strategy,
+		.mem_level = c->mem_level,
+		.window_bits = c->window_bits,
+		.give_up = give_up,
+		.ctx = &attempt,
+	};
+
+	int len;
+	void *compressed = compress_lines_with(NULL, &settings, lines, search->height,
+			search->scanline_width + 1, &len);
+
+	pthread_mutex_lock(&search->lock);
+	search->tried++;
+	if (compressed == NULL && attempt.out_of_time) {
+		search->timed_out++;
+	} else if (compressed == NULL) {
+		search->pruned++;
+	} else if (len < search->best_len) {
+		free(search->best);
+		search->best = compressed;
+		search->best_index = index;
+		__atomic_store_n(&search->best_len, len, __ATOMIC_RELAXED);
+		compressed = NULL;
+	}
+	if (index == 0) search->default_len = len;
+	pthread_mutex_unlock(&search->lock);
+	free(compressed);
+}
+
+static void *worker(void *arg) {
+	Search *search = arg;
+	for (;;) {
+		int index = __atomic_fetch_add(&search->next, 1, __ATOMIC_RELAXED);
+		if (index >= search->count || now() > search->deadline) break;
+		run_candidate(search, index);
+	}
+	return NULL;
+}
+
+// the default configuration first, then the most promising settings,
+// so good sizes are found early and prune the rest
+// lower levels match less hard and now and then still win on filtered data;
+// levels 4 to 9 all use lazy matching, below that zlib's fast path rarely helps
+// Z_RLE only looks at the previous byte, its output is the same at every level
+// a fixed 32K window only differs from the automatic one for small images
+static Candidate *make_candidates(long raw_bytes, int *count) {
+	static const int levels[] = { 9, 8, 7, 6, 5, 4 };
+	static const FilterStrategy filters[] = {
+		FILTER_ADAPTIVE, FILTER_PAETH, FILTER_UP, FILTER_SUB, FILTER_AVERAGE, FILTER_NONE
+	};
+	static const int strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE };
+	static const int mem_levels[] = { 9, 8 };
+	static const int windows[] = { 0, 15 };
+
+	int l = sizeof(levels) / sizeof(*levels);
+	int n = sizeof(filters) / sizeof(*filters);
+	int s = sizeof(strategies) / sizeof(*strategies);
+	int m = sizeof(mem_levels) / sizeof(*mem_levels);
+	int w = raw_bytes < (1L << 15) ? 2 : 1;
+
+	Candidate *candidates = malloc(sizeof(Candidate) * (1 + l * n * s * m * w));
+	assert(candidates != NULL);
+
+	CompressSettings defaults;
+	default_compress_settings(&defaults);
+	candidates[0] = (Candidate) {FILTER_ADAPTIVE, defaults.level, defaults.strategy,
+		defaults.mem_level, defaults.window_bits};
+
+	int i = 1;
+	for (int li = 0; li < l; li++) {
+		for (int wi = 0; wi < w; wi++) {
+			for (int mi = 0; mi < m; mi++) {
+				for (int si = 0; si < s; si++) {
+					if (strategies[si] == Z_RLE && levels[li] != Z_BEST_COMPRESSION) continue;
+					for (int fi = 0; fi < n; fi++) {
+						Candidate c = {filters[fi], levels[li], strategies[si], mem_levels[mi], windows[wi]};
+						if (memcmp(&c, &candidates[0], sizeof(Candidate)) == 0) continue;
+						candidates[i++] = c;
+					}
+				}
+			}
+		}
+	}
+	*count = i;
+	return candidates;
+}
+
+void *optimize_pixels(void *pixels, int width, int height, Format format,
+		int budget_ms, int *length) {
+	double started = now();
+
+	Search search;
+	memset(&search, 0, sizeof(search));
+	search.pixels = pixels;
+	search.width = width;
+	search.height = height;
+	search.format = format;
+	search.deadline = started + budget_ms / 1e3;
+	long row_bytes = format == BW ? PACKED_ROW_BYTES(width) : (format == GREYSCALE ? width : 3L * width);
+	search.candidates = make_candidates((row_bytes + 1) * height, &search.count);
+	search.scanline_width = row_bytes;
+	search.best_len = INT_MAX;
+	pthread_mutex_init(&search.lock, NULL);
+	for (int f = 0; f < NUM_FILTERS; f++) {
+		pthread_mutex_init(&search.filter_locks[f], NULL);
+	}
+
+	// the default always completes, on this thread, before the budget matters
+	search.next = 1;
+	run_candidate(&search, 0);
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int workers = cores < 1 ? 1 : cores;
+	pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+	assert(threads != NULL);
+	for (int t = 0; t < workers; t++) {
+		panic_if(pthread_create(&threads[t], NULL, worker, &search) != 0,
+				"Failed to start optimizer worker");
+	}
+	for (int t = 0; t < workers; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	free(threads);
+
+	Candidate *best = &search.candidates[search.best_index];
+	char window[8];
+	if (best->window_bits == 0) {
+		strcpy(window, "auto");
+	} else {
+		snprintf(window, sizeof(window), "%d", best->window_bits);
+	}
+	fprintf(stderr, "optimize: filter=%s level=%d strategy=%s mem_level=%d window=%s -> %d bytes "
+			"(default %d, %.1f%% smaller); %d of %d tried, %d pruned, %d cut off by the deadline, %.0f ms\n",
+			filter_names[best->filter], best->level, strategy_name(best->strategy), best->mem_level,
+			window,
+			search.best_len, search.default_len,
+			100.0 * (search.default_len - search.best_len) / search.default_len,
+			search.tried, search.count, search.pruned, search.timed_out, (now() - started) * 1e3);
+
+	for (int f = 0; f < NUM_FILTERS; f++) {
+		if (search.filtered[f] != NULL) free_lines(search.filtered[f], height);
+		pthread_mutex_destroy(&search.filter_locks[f]);
+	}
+	pthread_mutex_destroy(&search.lock);
+	free(search.candidates);
+
+	*length = search.best_len;
+	return search.best;
+}
@@ -0,0 +1,11 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+// try filter strategy and zlib parameter combinations on every core for up to
+// budget_ms, returning the smallest zlib stream found
+// the default configuration always runs to completion, so there is a result
+// even with a zero budget; the winner is reported on stderr
+extern void *optimize_pixels(void *pixels, int width, int height, Format format,
+		int budget_ms, int *length);
+
+#endif
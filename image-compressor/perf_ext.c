@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf_ext.h"
+
+#include "debug_util.h"
+
+// what a read returns with the TOTAL_TIME_ENABLED and TOTAL_TIME_RUNNING formats
+typedef struct {
+	uint64_t value;
+	uint64_t enabled;
+	uint64_t running;
+} Reading;
+
+// what a read of the group leader returns with GROUP added
+typedef struct {
+	uint64_t nr;
+	uint64_t enabled;
+	uint64_t running;
+	uint64_t values[NUM_COUNTERS];
+} GroupReading;
+
+struct Counters {
+	int fds[NUM_COUNTERS];	// -1 if the counter could not be opened
+	// the hardware events are one group led by cycles, so the kernel schedules
+	// them together and ratios like IPC hold up when the PMU is multiplexed
+	int leader;	// -1 if no hardware event could be opened
+	int members;
+	int slot[NUM_COUNTERS];	// position in the group read, -1 if read alone
+	Reading start[NUM_COUNTERS];
+	GroupReading group_start;
+};
+
+static const char *names[NUM_COUNTERS] = {
+	"cycles",
+	"instructions",
+	"L1d misses",
+	"LLC misses",
+	"branch misses",
+	"page faults",
+};
+
+static void describe(Counter counter, struct perf_event_attr *attr) {
+	memset(attr, 0, sizeof(*attr));
+	attr->size = sizeof(*attr);
+	attr->type = PERF_TYPE_HARDWARE;
+	switch (counter) {
+		case COUNTER_CYCLES:
+			attr->config = PERF_COUNT_HW_CPU_CYCLES;
+			break;
+		case COUNTER_INSTRUCTIONS:
+			attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+			break;
+		case COUNTER_L1D_MISSES:
+			attr->type = PERF_TYPE_HW_CACHE;
+			attr->config = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8
+				| PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+			break;
+		case COUNTER_LLC_MISSES:
+			attr->type = PERF_TYPE_HW_CACHE;
+			attr->config = PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8
+				| PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+			break;
+		case COUNTER_BRANCH_MISSES:
+			attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+			break;
+		case COUNTER_PAGE_FAULTS:
+			attr->type = PERF_TYPE_SOFTWARE;
+			attr->config = PERF_COUNT_SW_PAGE_FAULTS;
+			break;
+		default:
+			assert(false);
+	}
+	attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	if (attr->type != PERF_TYPE_SOFTWARE) attr->read_format |= PERF_FORMAT_GROUP;
+	// user space only, which unprivileged users may count at perf_event_paranoid 2
+	attr->exclude_kernel = 1;
+	attr->exclude_hv = 1;
+	// stages that start threads (the ASCII parser) are counted whole
+	attr->inherit = 1;
+}
+
+Counters *counters_open(char *reason, size_t reason_len) {
+	Counters *counters = malloc(sizeof(Counters));
+	assert(counters != NULL);
+	counters->leader = -1;
+	counters->members = 0;
+	int opened = 0;
+	int first_error = 0;
+	for (int c = 0; c < NUM_COUNTERS; c++) {
+		struct perf_event_attr attr;
+		describe(c, &attr);
+		// the first hardware event that opens (cycles, given a PMU) leads the group
+		bool grouped = attr.read_format & PERF_FORMAT_GROUP;
+		int group = grouped ? counters->leader : -1;
+		// this thread, on any cpu, always enabled; stages read the difference
+		counters->fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+		counters->slot[c] = -1;
+		if (counters->fds[c] >= 0) {
+			opened++;
+			if (grouped) {
+				if (counters->leader < 0) counters->leader = counters->fds[c];
+				counters->slot[c] = counters->members++;
+			}
+		} else if (first_error == 0) {
+			first_error = errno;
+		}
+	}
+	if (opened == 0) {
+		snprintf(reason, reason_len, "%s%s", strerror(first_error),
+				first_error == EACCES || first_error == EPERM ? ", see /proc/sys/kernel/perf_event_paranoid" : "");
+		free(counters);
+		return NULL;
+	}
+	return counters;
+}
+
+void counters_close(Counters *counters) {
+	if (counters == NULL) return;
+	for (int c = 0; c < NUM_COUNTERS; c++) {
+		if (counters->fds[c] >= 0) close(counters->fds[c]);
+	}
+	free(counters);
+}
+
+const char *counter_name(Counter counter) {
+	return names[counter];
+}
+
+bool counter_available(Counters *counters, Counter counter) {
+	return counters != NULL && counters->fds[counter] >= 0;
+}
+
+static bool read_counter(int fd, Reading *reading) {
+	return read(fd, reading, sizeof(*reading)) == sizeof(*reading);
+}
+
+// every member at once, counted over the same enabled and running time
+static bool read_group(Counters *counters, GroupReading *reading) {
+	ssize_t expected = sizeof(uint64_t) * (3 + counters->members);
+	return counters->leader >= 0 && read(counters->leader, reading, sizeof(*reading)) == expected;
+}
+
+// counted for only part of the stage while sharing the PMU, extrapolate
+static double scaled(uint64_t value, uint64_t enabled, uint64_t running) {
+	return running > 0 && running < enabled ? (double) value * enabled / running : value;
+}
+
+void counters_start(Counters *counters) {
+	if (counters->leader >= 0 && !read_group(counters, &counters->group_start)) {
+		memset(&counters->group_start, 0, sizeof(GroupReading));
+	}
+	for (int c = 0; c < NUM_COUNTERS; c++) {
+		if (counters->fds[c] >= 0 && counters->slot[c] < 0 && !read_counter(counters->fds[c], &counters->start[c])) {
+			memset(&counters->start[c], 0, sizeof(Reading));
+		}
+	}
+}
+
+void counters_stop(Counters *counters, double totals[NUM_COUNTERS]) {
+	GroupReading group;
+	bool have_group = read_group(counters, &group);
+	for (int c = 0; c < NUM_COUNTERS; c++) {
+		if (counters->fds[c] < 0) continue;
+		int slot = counters->slot[c];
+		if (slot >= 0) {
+			if (!have_group) continue;
+			const GroupReading *start = &counters->group_start;
+			totals[c] += scaled(group.values[slot] - start->values[slot], group.enabled - start->enabled,
+					group.running - start->running);
+		} else {
+			Reading now;
+			if (!read_counter(counters->fds[c], &now)) continue;
+			const Reading *start = &counters->start[c];
+			totals[c] += scaled(now.value - start->value, now.enabled - start->enabled, now.running - start->running);
+		}
+	}
+}
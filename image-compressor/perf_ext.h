@@ -0,0 +1,32 @@
+#ifndef PERF_H
+#define PERF_H
+
+// hardware and software event counters of the calling thread (and threads it
+// starts), read through Linux perf_event_open
+typedef enum {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_L1D_MISSES,	// L1 data cache read misses
+	COUNTER_LLC_MISSES,	// last level cache read misses
+	COUNTER_BRANCH_MISSES,
+	COUNTER_PAGE_FAULTS,
+	NUM_COUNTERS
+} Counter;
+
+typedef struct Counters Counters;
+
+// open every counter the kernel and the machine allow (VMs often have no PMU,
+// perf_event_paranoid may forbid them); NULL if none could be opened, with
+// the reason in reason
+extern Counters *counters_open(char *reason, size_t reason_len);
+extern void counters_close(Counters *counters);
+
+extern const char *counter_name(Counter counter);
+extern bool counter_available(Counters *counters, Counter counter);
+
+// add the events between start and stop to totals, scaled up when the kernel
+// had to multiplex the counters; the hardware events are scaled as one group
+extern void counters_start(Counters *counters);
+extern void counters_stop(Counters *counters, double totals[NUM_COUNTERS]);
+
+#endif
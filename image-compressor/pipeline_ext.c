@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/param.h>
+
+#include "extract_ext.h"
+#include "filter_ext.h"
+#include "compress_ext.h"
+#include "chunk_ext.h"
+#include "encode_ext.h"
+#include "ring_ext.h"
+#include "pipeline_ext.h"
+
+#include "debug_util.h"
+
+// batches in flight between two stages, this is what bounds memory
+#define RING_CAPACITY 4
+// aim for batches of roughly this many bytes
+#define BATCH_BYTES 65536
+
+// rows, filtered lines or compressed bytes handed from one stage to the next
+// a NULL batch ends the stream
+typedef struct {
+	int count;	// rows in the batch, or bytes for compressed data
+	uint8_t data[];
+} Batch;
+
+typedef struct {
+	const char *name;
+	void *(*run)(void *stage);
+	Ring *in;	// NULL for the first stage
+	Ring *out;	// NULL for the last stage
+	double elapsed;
+
+	// shared image description
+	PnmReader *reader;
+	RowFilter *filter;
+	FILE *dest;
+	Format format;
+	int height;
+	int width;
+	int batch_rows;
+
+	// deflate only: the byte batch being filled
+	Batch *pending;
+} Stage;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Batch *new_batch(size_t bytes) {
+	Batch *batch = malloc(sizeof(Batch) + bytes);
+	assert(batch != NULL);
+	batch->count = 0;
+	return batch;
+}
+
+static void *read_stage(void *arg) {
+	Stage *stage = arg;
+	size_t size = row_size(stage->format, stage->width);
+
+	for (int y = 0; y < stage->height; y += stage->batch_rows) {
+		Batch *batch = new_batch(size * stage->batch_rows);
+		batch->count = MIN(stage->batch_rows, stage->height - y);
+		reader_rows(stage->reader, batch->data, batch->count);
+		ring_push(stage->out, batch);
+	}
+	ring_push(stage->out, NULL);
+	return NULL;
+}
+
+static void *filter_stage(void *arg) {
+	Stage *stage = arg;
+	RowFilter *rf = stage->filter;
+	size_t line = row_filter_length(rf) + 1;
+
+	Batch *rows;
+	while ((rows = ring_pop(stage->in)) != NULL) {
+		Batch *lines = new_batch(line * rows->count);
+		lines->count = rows->count;
+		row_filter_rows(rf, rows->data, rows->count, lines->data);
+		free(rows);
+		ring_push(stage->out, lines);
+	}
+	ring_push(stage->out, NULL);
+	return NULL;
+}
+
+// gather deflate output into BATCH_BYTES blocks for the writer
+static void forward_bytes(void *ctx, const uint8_t *data, int length) {
+	Stage *stage = ctx;
+	while (length > 0) {
+		int sz = MIN(length, BATCH_BYTES - stage->pending->count);
+		memcpy(stage->pending->data + stage->pending->count, data, sz);
+		stage->pending->count += sz;
+		data += sz;
+		length -= sz;
+		if (stage->pending->count == BATCH_BYTES) {
+			ring_push(stage->out, stage->pending);
+			stage->pending = new_batch(BATCH_BYTES);
+		}
+	}
+}
+
+static void *deflate_stage(void *arg) {
+	Stage *stage = arg;
+	int line = row_filter_length(stage->filter) + 1;
+
+	stage->pending = new_batch(BATCH_BYTES);
+	DeflateStream *ds = deflate_stream_create(NULL, (long) line * stage->height,
+			forward_bytes, stage);
+
+	int y = 0;
+	Batch *lines;
+	while ((lines = ring_pop(stage->in)) != NULL) {
+		for (int i = 0; i < lines->count; i++, y++) {
+			deflate_stream_line(ds, lines->data + (size_t) i * line, line,
+					y == stage->height - 1);
+		}
+		free(lines);
+	}
+	deflate_stream_free(ds);
+
+	if (stage->pending->count > 0) {
+		ring_push(stage->out, stage->pending);
+	} else {
+		free(stage->pending);
+	}
+	ring_push(stage->out, NULL);
+	return NULL;
+}
+
+static void *write_stage(void *arg) {
+	Stage *stage = arg;
+
+	encode_signature(stage->dest);
+	Chunk *ihdr = chunk_ihdr(stage->width, stage->height, stage->format);
+	encode_chunk(ihdr, stage->dest);
+	free_chunk(ihdr);
+
+	IdatStream *idat = idat_stream_open(stage->dest);
+	Batch *bytes;
+	while ((bytes = ring_pop(stage->in)) != NULL) {
+		idat_stream_write(idat, bytes->data, bytes->count);
+		free(bytes);
+	}
+	idat_stream_close(idat);
+
+	Chunk *iend = chunk_iend();
+	encode_chunk(iend, stage->dest);
+	free_chunk(iend);
+	return NULL;
+}
+
+static void *timed(void *arg) {
+	Stage *stage = arg;
+	double start = now();
+	stage->run(stage);
+	stage->elapsed = now() - start;
+	return NULL;
+}
+
+void run_pipeline(char *source, char *dest) {
+	Format format;
+	int height;
+	int width;
+	PnmReader *reader = reader_open(source, &format, &height, &width);
+
+	FILE *out = fopen(dest, "wb");
+	panic_if(out == NULL, "Failed to open the output file");
+
+	Stage proto = {
+		.reader = reader,
+		.filter = row_filter_create(width, format, FILTER_ADAPTIVE),
+		.dest = out,
+		.format = format,
+		.height = height,
+		.width = width,
+		.batch_rows = MAX(1, BATCH_BYTES / (int) MAX(1, row_size(format, width))),
+	};
+
+	enum { NUM_STAGES = 4 };
+	Stage stages[NUM_STAGES];
+	void *(*runs[NUM_STAGES])(void *) = { read_stage, filter_stage, deflate_stage, write_stage };
+	const char *names[NUM_STAGES] = { "extract", "filter", "deflate", "write" };
+	Ring *rings[NUM_STAGES - 1];
+	for (int i = 0; i < NUM_STAGES - 1; i++) {
+		rings[i] = ring_create(RING_CAPACITY);
+	}
+
+	pthread_t threads[NUM_STAGES];
+	for (int i = 0; i < NUM_STAGES; i++) {
+		stages[i] = proto;
+		stages[i].name = names[i];
+		stages[i].run = runs[i];
+		stages[i].in = i > 0 ? rings[i - 1] : NULL;
+		stages[i].out = i < NUM_STAGES - 1 ? rings[i] : NULL;
+		int code = pthread_create(&threads[i], NULL, timed, &stages[i]);
+		panic_if(code != 0, "Failed to start pipeline stage");
+	}
+	for (int i = 0; i < NUM_STAGES; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// idle: starved waiting on the stage before, blocked: backpressure from the stage after
+	fprintf(stderr, "%-8s %10s %10s %10s\n", "stage", "busy ms", "idle ms", "blocked ms");
+	for (int i = 0; i < NUM_STAGES; i++) {
+		double idle = stages[i].in ? ring_pop_wait(stages[i].in) : 0;
+		double blocked = stages[i].out ? ring_push_wait(stages[i].out) : 0;
+		double busy = stages[i].elapsed - idle - blocked;
+		fprintf(stderr, "%-8s %10.2f %10.2f %10.2f\n", stages[i].name,
+				busy * 1e3, idle * 1e3, blocked * 1e3);
+	}
+
+	for (int i = 0; i < NUM_STAGES - 1; i++) {
+		ring_free(rings[i]);
+	}
+	row_filter_free(proto.filter);
+	reader_close(reader);
+	fclose(out);
+}
@@ -0,0 +1,10 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+// convert a pnm to a png with extract, filter, deflate and write each on
+// their own thread, passing row batches over bounded rings
+// the png is byte for byte the one write_png produces; never holds the whole image
+// per stage busy/idle/blocked times go to stderr
+extern void run_pipeline(char *source, char *dest);
+
+#endif
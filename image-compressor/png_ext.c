@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "extract_ext.h"
+#include "filter_ext.h"
+#include "compress_ext.h"
+#include "chunk_ext.h"
+#include "encode_ext.h"
+#include "png_ext.h"
+
+void free_lines(uint8_t **lines, int num_rows) {
+	for (int i = 0; i < num_rows; i++) {
+		free(lines[i]);
+	}
+	free(lines);
+}
+
+void *deflate_pixels(Deflater *deflater, void *pixels, int width, int height, Format format, int *length) {
+	return deflate_pixels_with(deflater, NULL, pixels, width, height, format, length);
+}
+
+void *deflate_pixels_with(Deflater *deflater, const CompressSettings *settings,
+		void *pixels, int width, int height, Format format, int *length) {
+	int scanline_width;
+	uint8_t **mlines = serialise_filter(pixels, width, height, format, &scanline_width);
+
+	void *compressed = compress_lines_with(deflater, settings, mlines, height, scanline_width + 1, length);
+	free_lines(mlines, height);
+
+	return compressed;
+}
+
+void write_png(Deflater *deflater, void *pixels, int width, int height, Format format, FILE *out) {
+	int len;
+	void *compressed = deflate_pixels(deflater, pixels, width, height, format, &len);
+	write_png_data(compressed, len, width, height, format, out);
+	free(compressed);
+}
+
+void write_png_data(void *compressed, int length, int width, int height, Format format, FILE *out) {
+	// make chunks
+	Chunk *ihdr = chunk_ihdr(width, height, format);
+	ChunkList *idats = chunk_idat(compressed, length);
+	Chunk *iend = chunk_iend();
+
+	// encode
+	encode(ihdr, idats, iend, out);
+
+	free_chunk(ihdr);
+	free_chunk_list(idats);
+	free_chunk(iend);
+}
+
+void write_indexed_png(uint8_t *indices, int width, int height,
+		const uint8_t *palette, int colours, FILE *out) {
+	// palette images compress best unfiltered, so every line is filter type 0
+	uint8_t **lines = malloc(sizeof(uint8_t *) * height);
+	assert(lines != NULL);
+	for (int y = 0; y < height; y++) {
+		lines[y] = malloc(width + 1);
+		assert(lines[y] != NULL);
+		lines[y][0] = 0;
+		memcpy(lines[y] + 1, indices + (size_t) y * width, width);
+	}
+	int len;
+	void *compressed = compress_lines(lines, height, width + 1, &len);
+	free_lines(lines, height);
+
+	Chunk *ihdr = chunk_ihdr_indexed(width, height);
+	Chunk *plte = chunk_plte(palette, colours);
+	ChunkList *idats = chunk_idat(compressed, len);
+	Chunk *iend = chunk_iend();
+
+	encode_signature(out);
+	encode_chunk(ihdr, out);
+	encode_chunk(plte, out);
+	encode_chunk_list(idats, out);
+	encode_chunk(iend, out);
+
+	free_chunk(ihdr);
+	free_chunk(plte);
+	free_chunk_list(idats);
+	free_chunk(iend);
+	free(compressed);
+}
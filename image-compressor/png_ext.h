@@ -0,0 +1,27 @@
+#ifndef PNG_H
+#define PNG_H
+
+// serialise, filter and deflate a pixel buffer into one zlib stream
+// the stream is what gets split into IDAT (or fdAT) chunks
+// deflater may be NULL, otherwise its pooled zlib state is reused
+extern void *deflate_pixels(Deflater *deflater, void *pixels, int width, int height, Format format, int *length);
+
+// deflate_pixels with explicit compression settings, NULL for the defaults
+extern void *deflate_pixels_with(Deflater *deflater, const CompressSettings *settings,
+		void *pixels, int width, int height, Format format, int *length);
+
+// write a complete png (signature, IHDR, IDATs, IEND) for a pixel buffer
+extern void write_png(Deflater *deflater, void *pixels, int width, int height, Format format, FILE *out);
+
+// write a complete png around an already deflated image
+extern void write_png_data(void *compressed, int length, int width, int height, Format format, FILE *out);
+
+// write an 8 bit palette png: one index byte per pixel, rows of width bytes
+// palette holds colours rgb triples
+extern void write_indexed_png(uint8_t *indices, int width, int height,
+		const uint8_t *palette, int colours, FILE *out);
+
+// free a list of rows produced by serialise/filter
+extern void free_lines(uint8_t **lines, int num_rows);
+
+#endif
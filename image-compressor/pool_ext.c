@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "pool_ext.h"
+
+#include "debug_util.h"
+
+typedef struct {
+	Task task;
+	void *arg;
+} Job;
+
+struct Pool {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+
+	// ring buffer of waiting jobs
+	Job *queue;
+	int capacity;
+	int head;
+	int count;
+	bool stopping;
+
+	pthread_t *threads;
+	int workers;
+	void *(*init)(void);
+	void (*fini)(void *);
+};
+
+static void *worker(void *arg) {
+	Pool *pool = arg;
+	void *state = pool->init ? pool->init() : NULL;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->count == 0 && !pool->stopping) {
+			pthread_cond_wait(&pool->not_empty, &pool->lock);
+		}
+		if (pool->count == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		Job job = pool->queue[pool->head];
+		pool->head = (pool->head + 1) % pool->capacity;
+		pool->count--;
+		pthread_cond_signal(&pool->not_full);
+		pthread_mutex_unlock(&pool->lock);
+
+		job.task(job.arg, state);
+	}
+
+	if (pool->fini) pool->fini(state);
+	return NULL;
+}
+
+Pool *pool_create(int workers, int capacity, void *(*init)(void), void (*fini)(void *)) {
+	panic_if(workers < 1 || capacity < 1, "Pool needs at least one worker and queue slot");
+
+	Pool *pool = malloc(sizeof(Pool));
+	assert(pool != NULL);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->not_empty, NULL);
+	pthread_cond_init(&pool->not_full, NULL);
+
+	pool->queue = malloc(sizeof(Job) * capacity);
+	assert(pool->queue != NULL);
+	pool->capacity = capacity;
+	pool->head = 0;
+	pool->count = 0;
+	pool->stopping = false;
+	pool->init = init;
+	pool->fini = fini;
+
+	pool->threads = malloc(sizeof(pthread_t) * workers);
+	assert(pool->threads != NULL);
+	pool->workers = workers;
+	for (int i = 0; i < workers; i++) {
+		panic_if(pthread_create(&pool->threads[i], NULL, worker, pool) != 0,
+				"Failed to start pool worker");
+	}
+	return pool;
+}
+
+void pool_submit(Pool *pool, Task task, void *arg) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->count == pool->capacity) {
+		pthread_cond_wait(&pool->not_full, &pool->lock);
+	}
+	pool->queue[(pool->head + pool->count) % pool->capacity] = (Job) {task, arg};
+	pool->count++;
+	pthread_cond_signal(&pool->not_empty);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+bool pool_try_submit(Pool *pool, Task task, void *arg) {
+	pthread_mutex_lock(&pool->lock);
+	bool room = pool->count < pool->capacity;
+	if (room) {
+		pool->queue[(pool->head + pool->count) % pool->capacity] = (Job) {task, arg};
+		pool->count++;
+		pthread_cond_signal(&pool->not_empty);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return room;
+}
+
+int pool_depth(Pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	int depth = pool->count;
+	pthread_mutex_unlock(&pool->lock);
+	return depth;
+}
+
+void pool_destroy(Pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->not_empty);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->workers; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->not_empty);
+	pthread_cond_destroy(&pool->not_full);
+	free(pool->threads);
+	free(pool->queue);
+	free(pool);
+}
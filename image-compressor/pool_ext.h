@@ -0,0 +1,25 @@
+#ifndef POOL_H
+#define POOL_H
+
+typedef struct Pool Pool;
+
+// a task runs on a worker with that worker's private state
+typedef void (*Task)(void *arg, void *state);
+
+// start workers; init/fini (may be NULL) build and tear down each worker's state
+// at most capacity tasks wait in the queue, further submits block
+extern Pool *pool_create(int workers, int capacity, void *(*init)(void), void (*fini)(void *));
+
+// queue a task, blocking while the queue is full
+extern void pool_submit(Pool *pool, Task task, void *arg);
+
+// queue a task if there is room; false, and nothing queued, if the queue is full
+extern bool pool_try_submit(Pool *pool, Task task, void *arg);
+
+// tasks waiting for a worker
+extern int pool_depth(Pool *pool);
+
+// finish every queued task, then stop and free the workers
+extern void pool_destroy(Pool *pool);
+
+#endif
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "extract_ext.h"
+#include "qoi_ext.h"
+
+#include "debug_util.h"
+
+#define QOI_HEADER_SIZE 14
+#define QOI_CHANNELS 3
+#define QOI_SRGB 0
+// a colour op is at most 4 bytes, alpha never changes so never 5
+#define QOI_MAX_OP 4
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_MASK_2 0xc0
+
+#define QOI_MAX_RUN 62
+
+static const uint8_t qoi_end[] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+// pixels are handled as r | g << 8 | b << 16 | a << 24
+#define OPAQUE 0xff000000u
+
+static inline uint32_t rgb(uint8_t r, uint8_t g, uint8_t b) {
+	return r | (uint32_t) g << 8 | (uint32_t) b << 16 | OPAQUE;
+}
+
+// (r * 3 + g * 5 + b * 7 + a * 11) % 64 with one multiply:
+// spread the channels into 16 bit lanes so one product sums them in the top lane
+static inline int qoi_hash(uint32_t px) {
+	uint64_t v = px;
+	v = (v & 0x00ff00ffu) | ((v & 0xff00ff00u) << 24);
+	return (int) ((v * ((3ull << 48) | (7ull << 32) | (5ull << 16) | 11ull)) >> 48) & 63;
+}
+
+static inline void put_u32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline uint32_t get_u32(const uint8_t *p) {
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static inline __attribute__((always_inline))
+uint32_t load_pixel(const uint8_t *row, int x, Format format) {
+	switch (format) {
+		case BW: {
+			uint8_t v = (row[x / 8] >> (7 - x % 8) & 1) ? 0xff : 0;
+			return rgb(v, v, v);
+		}
+		case GREYSCALE: {
+			uint8_t v = ((const Pixel *) row)[x].gp;
+			return rgb(v, v, v);
+		}
+		default: {
+			CPixel c = ((const Pixel *) row)[x].cp;
+			return rgb(c.red, c.green, c.blue);
+		}
+	}
+}
+
+// one pass over the image, specialised per format by the callers below
+static inline __attribute__((always_inline))
+uint8_t *encode_pixels(const uint8_t *pixels, int width, int height, Format format, uint8_t *out) {
+	uint32_t index[64] = {0};
+	uint32_t prev = OPAQUE;
+	int run = 0;
+	size_t stride = row_size(format, width);
+
+	for (int y = 0; y < height; y++) {
+		const uint8_t *row = pixels + (size_t) y * stride;
+		for (int x = 0; x < width; x++) {
+			uint32_t px = load_pixel(row, x, format);
+
+			if (px == prev) {
+				// runs are the common case for flat images, keep this path short
+				run++;
+				if (run == QOI_MAX_RUN) {
+					*out++ = QOI_OP_RUN | (run - 1);
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0) {
+				*out++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+
+			int h = qoi_hash(px);
+			if (index[h] == px) {
+				*out++ = QOI_OP_INDEX | h;
+				prev = px;
+				continue;
+			}
+			index[h] = px;
+
+			int8_t vr = (int8_t) ((px & 0xff) - (prev & 0xff));
+			int8_t vg = (int8_t) ((px >> 8 & 0xff) - (prev >> 8 & 0xff));
+			int8_t vb = (int8_t) ((px >> 16 & 0xff) - (prev >> 16 & 0xff));
+			int8_t vg_r = vr - vg;
+			int8_t vg_b = vb - vg;
+
+			// range checks as unsigned compares, one branch each
+			if ((uint8_t) (vr + 2) < 4 && (uint8_t) (vg + 2) < 4 && (uint8_t) (vb + 2) < 4) {
+				*out++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+			} else if ((uint8_t) (vg + 32) < 64 && (uint8_t) (vg_r + 8) < 16 && (uint8_t) (vg_b + 8) < 16) {
+				*out++ = QOI_OP_LUMA | (vg + 32);
+				*out++ = (vg_r + 8) << 4 | (vg_b + 8);
+			} else {
+				*out++ = QOI_OP_RGB;
+				*out++ = px;
+				*out++ = px >> 8;
+				*out++ = px >> 16;
+			}
+			prev = px;
+		}
+	}
+	if (run > 0) {
+		*out++ = QOI_OP_RUN | (run - 1);
+	}
+	return out;
+}
+
+void *qoi_encode(void *pixels, int width, int height, Format format, int *length) {
+	size_t max = QOI_HEADER_SIZE + (size_t) width * height * QOI_MAX_OP + sizeof(qoi_end);
+	uint8_t *bytes = malloc(max);
+	assert(bytes != NULL);
+
+	memcpy(bytes, "qoif", 4);
+	put_u32(bytes + 4, width);
+	put_u32(bytes + 8, height);
+	bytes[12] = QOI_CHANNELS;
+	bytes[13] = QOI_SRGB;
+
+	uint8_t *out = bytes + QOI_HEADER_SIZE;
+	switch (format) {
+		case BW:
+			out = encode_pixels(pixels, width, height, BW, out);
+			break;
+		case GREYSCALE:
+			out = encode_pixels(pixels, width, height, GREYSCALE, out);
+			break;
+		case FULL_COLOR:
+			out = encode_pixels(pixels, width, height, FULL_COLOR, out);
+			break;
+	}
+	memcpy(out, qoi_end, sizeof(qoi_end));
+	out += sizeof(qoi_end);
+
+	*length = out - bytes;
+	return bytes;
+}
+
+static uint8_t *read_all(FILE *src, size_t *length) {
+	size_t cap = 1 << 16;
+	size_t len = 0;
+	uint8_t *data = malloc(cap);
+	assert(data != NULL);
+	size_t got;
+	while ((got = fread(data + len, 1, cap - len, src)) > 0) {
+		len += got;
+		if (len == cap) {
+			data = realloc(data, cap *= 2);
+			assert(data != NULL);
+		}
+	}
+	panic_if(ferror(src), "Unknown error while reading file");
+	*length = len;
+	return data;
+}
+
+void *qoi_decode(FILE *src, Format *format, int *height, int *width) {
+	size_t length;
+	uint8_t *data = read_all(src, &length);
+
+	panic_if(length < QOI_HEADER_SIZE + sizeof(qoi_end) || memcmp(data, "qoif", 4) != 0,
+			"Not a qoi file");
+	uint32_t w = get_u32(data + 4);
+	uint32_t h = get_u32(data + 8);
+	panic_if(w < 1 || h < 1 || w > INT32_MAX || h > INT32_MAX, "Image dimensions must be positive");
+	panic_if(data[12] != 3 && data[12] != 4, "Invalid qoi channel count");
+
+	size_t count = (size_t) w * h;
+	Pixel *pixels = malloc(sizeof(Pixel) * count);
+	assert(pixels != NULL);
+
+	uint32_t index[64] = {0};
+	uint8_t r = 0, g = 0, b = 0, a = 255;
+	size_t p = QOI_HEADER_SIZE;
+	size_t end = length - sizeof(qoi_end);
+	int run = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (run > 0) {
+			run--;
+		} else {
+			panic_if(p >= end, "Unexpected end of qoi data");
+			uint8_t op = data[p++];
+			if (op == QOI_OP_RGB || op == 0xff) {
+				panic_if(p + 3 + (op == 0xff) > end, "Unexpected end of qoi data");
+				r = data[p++];
+				g = data[p++];
+				b = data[p++];
+				if (op == 0xff) a = data[p++];
+			} else if ((op & QOI_MASK_2) == QOI_OP_INDEX) {
+				uint32_t px = index[op];
+				r = px;
+				g = px >> 8;
+				b = px >> 16;
+				a = px >> 24;
+			} else if ((op & QOI_MASK_2) == QOI_OP_DIFF) {
+				r += ((op >> 4) & 3) - 2;
+				g += ((op >> 2) & 3) - 2;
+				b += (op & 3) - 2;
+			} else if ((op & QOI_MASK_2) == QOI_OP_LUMA) {
+				panic_if(p >= end, "Unexpected end of qoi data");
+				uint8_t next = data[p++];
+				int vg = (op & 0x3f) - 32;
+				r += vg - 8 + (next >> 4);
+				g += vg;
+				b += vg - 8 + (next & 0x0f);
+			} else {
+				run = op & 0x3f;
+			}
+			index[qoi_hash(r | (uint32_t) g << 8 | (uint32_t) b << 16 | (uint32_t) a << 24)] =
+					r | (uint32_t) g << 8 | (uint32_t) b << 16 | (uint32_t) a << 24;
+		}
+		// alpha is dropped, this encoder only writes opaque images
+		pixels[i].cp = (CPixel) {r, g, b};
+	}
+	free(data);
+
+	*format = FULL_COLOR;
+	*height = h;
+	*width = w;
+	return pixels;
+}
+
+bool qoi_same_pixels(void *pixels, Format format, void *decoded, int width, int height) {
+	size_t stride = row_size(format, width);
+	const Pixel *d = decoded;
+	for (int y = 0; y < height; y++) {
+		const uint8_t *row = (const uint8_t *) pixels + (size_t) y * stride;
+		for (int x = 0; x < width; x++) {
+			CPixel c = d[(size_t) y * width + x].cp;
+			if (load_pixel(row, x, format) != rgb(c.red, c.green, c.blue)) return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,16 @@
+#ifndef QOI_H
+#define QOI_H
+
+// QOI (https://qoiformat.org) as a fast alternative to png for caches
+// images are stored as 3 channel sRGB; grey and BW are expanded to rgb
+
+// encode pixels (extract layout) into a complete qoi file in memory
+extern void *qoi_encode(void *pixels, int width, int height, Format format, int *length);
+
+// decode a qoi file, always returns FULL_COLOR pixels
+extern void *qoi_decode(FILE *src, Format *format, int *height, int *width);
+
+// true when decoded (FULL_COLOR) holds the same image as pixels in format
+extern bool qoi_same_pixels(void *pixels, Format format, void *decoded, int width, int height);
+
+#endif
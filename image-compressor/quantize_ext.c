@@ -0,0 +1,591 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "extract_ext.h"
+#include "compress_ext.h"
+#include "png_ext.h"
+#include "quantize_ext.h"
+
+#include "debug_util.h"
+
+// k-means runs on at most this many pixels, spread evenly over the image
+#define MAX_SAMPLES (1 << 18)
+#define KMEANS_ITERATIONS 16
+// stop once no centroid moves further than this (squared OKLab distance)
+#define KMEANS_EPSILON 1e-7f
+// palette search width, centroids are padded to a multiple of it
+#define LANES 4
+// far enough away that padding lanes never win
+#define FAR_AWAY 1e9f
+// direct mapped rgb -> index cache per mapping thread
+#define CACHE_SIZE 4096
+
+typedef struct {
+	float l;
+	float a;
+	float b;
+} Lab;
+
+typedef struct {
+	Lab lab;
+	uint8_t rgb[3];
+} Sample;
+
+// palette in OKLab, one array per channel so LANES entries load at once
+typedef struct {
+	int count;
+	float l[MAX_PALETTE + LANES];
+	float a[MAX_PALETTE + LANES];
+	float b[MAX_PALETTE + LANES];
+} Centroids;
+
+static float linear[256];
+static pthread_once_t linear_once = PTHREAD_ONCE_INIT;
+
+static void build_linear(void) {
+	for (int v = 0; v < 256; v++) {
+		float c = v / 255.0f;
+		linear[v] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+	}
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ref: https://bottosson.github.io/posts/oklab/
+static Lab to_lab(const uint8_t rgb[3]) {
+	float r = linear[rgb[0]];
+	float g = linear[rgb[1]];
+	float b = linear[rgb[2]];
+
+	float l = cbrtf(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+	float m = cbrtf(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+	float s = cbrtf(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
+
+	return (Lab) {
+		0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s,
+		1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s,
+		0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s,
+	};
+}
+
+static inline void load_rgb(const uint8_t *row, int x, Format format, uint8_t rgb[3]) {
+	switch (format) {
+		case BW:
+			rgb[0] = rgb[1] = rgb[2] = (row[x / 8] >> (7 - x % 8) & 1) ? 0xff : 0;
+			break;
+		case GREYSCALE:
+			rgb[0] = rgb[1] = rgb[2] = ((const Pixel *) row)[x].gp;
+			break;
+		case FULL_COLOR:
+		default: {
+			CPixel c = ((const Pixel *) row)[x].cp;
+			rgb[0] = c.red;
+			rgb[1] = c.green;
+			rgb[2] = c.blue;
+			break;
+		}
+	}
+}
+
+static inline float channel(const Lab *lab, int axis) {
+	return axis == 0 ? lab->l : (axis == 1 ? lab->a : lab->b);
+}
+
+static int nearest(const Centroids *c, Lab p) {
+	int best = 0;
+	int i = 0;
+#ifdef __SSE2__
+	__m128 pl = _mm_set1_ps(p.l);
+	__m128 pa = _mm_set1_ps(p.a);
+	__m128 pb = _mm_set1_ps(p.b);
+	__m128 best_d = _mm_set1_ps(INFINITY);
+	__m128i best_i = _mm_setzero_si128();
+	__m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+	const __m128i step = _mm_set1_epi32(LANES);
+	for (; i < c->count; i += LANES) {
+		__m128 dl = _mm_sub_ps(_mm_loadu_ps(c->l + i), pl);
+		__m128 da = _mm_sub_ps(_mm_loadu_ps(c->a + i), pa);
+		__m128 db = _mm_sub_ps(_mm_loadu_ps(c->b + i), pb);
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dl, dl), _mm_mul_ps(da, da)), _mm_mul_ps(db, db));
+		// keep the closer of old and new per lane without a blend instruction
+		__m128i closer = _mm_castps_si128(_mm_cmplt_ps(d, best_d));
+		best_d = _mm_min_ps(d, best_d);
+		best_i = _mm_or_si128(_mm_and_si128(closer, idx), _mm_andnot_si128(closer, best_i));
+		idx = _mm_add_epi32(idx, step);
+	}
+	float d[LANES];
+	int32_t at[LANES];
+	_mm_storeu_ps(d, best_d);
+	_mm_storeu_si128((__m128i *) at, best_i);
+	// lowest index among equal distances, like the scalar loop
+	best = at[0];
+	float best_dist = d[0];
+	for (int lane = 1; lane < LANES; lane++) {
+		if (d[lane] < best_dist || (d[lane] == best_dist && at[lane] < best)) {
+			best_dist = d[lane];
+			best = at[lane];
+		}
+	}
+#else
+	float best_dist = INFINITY;
+	for (; i < c->count; i++) {
+		float dl = c->l[i] - p.l;
+		float da = c->a[i] - p.a;
+		float db = c->b[i] - p.b;
+		float d = dl * dl + da * da + db * db;
+		if (d < best_dist) {
+			best_dist = d;
+			best = i;
+		}
+	}
+#endif
+	return best;
+}
+
+static void set_centroid(Centroids *c, int i, Lab lab) {
+	c->l[i] = lab.l;
+	c->a[i] = lab.a;
+	c->b[i] = lab.b;
+}
+
+static void pad_centroids(Centroids *c) {
+	for (int i = c->count; i < c->count + LANES; i++) {
+		set_centroid(c, i, (Lab) {FAR_AWAY, FAR_AWAY, FAR_AWAY});
+	}
+}
+
+static Sample *take_samples(void *pixels, int width, int height, Format format, int *count) {
+	size_t total = (size_t) width * height;
+	size_t step = total > MAX_SAMPLES ? (total + MAX_SAMPLES - 1) / MAX_SAMPLES : 1;
+	size_t stride = row_size(format, width);
+
+	Sample *samples = malloc(sizeof(Sample) * (total / step + 1));
+	assert(samples != NULL);
+	int n = 0;
+	for (size_t i = 0; i < total; i += step) {
+		const uint8_t *row = (const uint8_t *) pixels + (i / width) * stride;
+		load_rgb(row, i % width, format, samples[n].rgb);
+		samples[n].lab = to_lab(samples[n].rgb);
+		n++;
+	}
+	*count = n;
+	return samples;
+}
+
+typedef struct {
+	int start;
+	int count;
+	int axis;
+	float range;
+} Box;
+
+static void measure_box(Sample *samples, Box *box) {
+	float lo[3] = {INFINITY, INFINITY, INFINITY};
+	float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+	for (int i = box->start; i < box->start + box->count; i++) {
+		for (int axis = 0; axis < 3; axis++) {
+			float v = channel(&samples[i].lab, axis);
+			if (v < lo[axis]) lo[axis] = v;
+			if (v > hi[axis]) hi[axis] = v;
+		}
+	}
+	box->axis = 0;
+	for (int axis = 1; axis < 3; axis++) {
+		if (hi[axis] - lo[axis] > hi[box->axis] - lo[box->axis]) box->axis = axis;
+	}
+	box->range = hi[box->axis] - lo[box->axis];
+}
+
+// partially order samples[lo..hi] so the k-th smallest along axis is at k
+static void select_kth(Sample *samples, int lo, int hi, int k, int axis) {
+	while (lo < hi) {
+		float pivot = channel(&samples[(lo + hi) / 2].lab, axis);
+		int i = lo;
+		int j = hi;
+		while (i <= j) {
+			while (channel(&samples[i].lab, axis) < pivot) i++;
+			while (channel(&samples[j].lab, axis) > pivot) j--;
+			if (i <= j) {
+				Sample tmp = samples[i];
+				samples[i++] = samples[j];
+				samples[j--] = tmp;
+			}
+		}
+		if (k <= j) hi = j;
+		else if (k >= i) lo = i;
+		else return;
+	}
+}
+
+// split the box with the widest range at its median until there are enough
+// each box's mean seeds a centroid and its palette colour; boxes whose mean
+// repeats an earlier one (a colour split across the median) are dropped
+static int median_cut(Sample *samples, int count, int colours, Centroids *c, Palette *palette) {
+	Box boxes[MAX_PALETTE];
+	int num_boxes = 1;
+	boxes[0] = (Box) {0, count, 0, 0};
+	measure_box(samples, &boxes[0]);
+
+	while (num_boxes < colours) {
+		int widest = -1;
+		for (int i = 0; i < num_boxes; i++) {
+			if (boxes[i].count > 1 && boxes[i].range > 0
+					&& (widest < 0 || boxes[i].range > boxes[widest].range)) {
+				widest = i;
+			}
+		}
+		// every box is a single colour
+		if (widest < 0) break;
+
+		Box *box = &boxes[widest];
+		int half = box->count / 2;
+		select_kth(samples, box->start, box->start + box->count - 1, box->start + half, box->axis);
+		boxes[num_boxes] = (Box) {box->start + half, box->count - half, 0, 0};
+		box->count = half;
+		measure_box(samples, box);
+		measure_box(samples, &boxes[num_boxes]);
+		num_boxes++;
+	}
+
+	c->count = 0;
+	for (int i = 0; i < num_boxes; i++) {
+		double sum[6] = {0};
+		for (int s = boxes[i].start; s < boxes[i].start + boxes[i].count; s++) {
+			sum[0] += samples[s].lab.l;
+			sum[1] += samples[s].lab.a;
+			sum[2] += samples[s].lab.b;
+			for (int j = 0; j < 3; j++) sum[3 + j] += samples[s].rgb[j];
+		}
+		int n = boxes[i].count;
+		Lab mean = {sum[0] / n, sum[1] / n, sum[2] / n};
+		bool duplicate = false;
+		for (int k = 0; k < c->count && !duplicate; k++) {
+			duplicate = c->l[k] == mean.l && c->a[k] == mean.a && c->b[k] == mean.b;
+		}
+		if (duplicate) continue;
+
+		set_centroid(c, c->count, mean);
+		for (int j = 0; j < 3; j++) {
+			palette->rgb[3 * c->count + j] = (uint8_t) lround(sum[3 + j] / n);
+		}
+		c->count++;
+	}
+	palette->count = c->count;
+	pad_centroids(c);
+	return c->count;
+}
+
+// per thread running sums for one k-means step
+typedef struct {
+	const Sample *samples;
+	int start;
+	int end;
+	const Centroids *centroids;
+	double sums[MAX_PALETTE][6];	// lab then rgb
+	long counts[MAX_PALETTE];
+	pthread_t thread;
+} Assign;
+
+static void *assign_samples(void *arg) {
+	Assign *job = arg;
+	memset(job->sums, 0, sizeof(job->sums));
+	memset(job->counts, 0, sizeof(job->counts));
+	for (int s = job->start; s < job->end; s++) {
+		const Sample *sample = &job->samples[s];
+		int k = nearest(job->centroids, sample->lab);
+		double *sum = job->sums[k];
+		sum[0] += sample->lab.l;
+		sum[1] += sample->lab.a;
+		sum[2] += sample->lab.b;
+		sum[3] += sample->rgb[0];
+		sum[4] += sample->rgb[1];
+		sum[5] += sample->rgb[2];
+		job->counts[k]++;
+	}
+	return NULL;
+}
+
+static int num_workers(void) {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return cores < 1 ? 1 : cores;
+}
+
+// lloyd iterations over the samples, each step split across every core
+// returns the iterations run; palette gets the mean rgb of each cluster and
+// must hold the seed colours of the centroids
+static int kmeans(const Sample *samples, int count, Centroids *c, Palette *palette) {
+	int workers = num_workers();
+	if (workers > count) workers = count;
+	Assign *jobs = malloc(sizeof(Assign) * workers);
+	assert(jobs != NULL);
+
+	int k = c->count;
+	int iterations = 0;
+	bool moved = true;
+	while (moved && iterations < KMEANS_ITERATIONS) {
+		for (int t = 0; t < workers; t++) {
+			jobs[t].samples = samples;
+			jobs[t].start = (long) count * t / workers;
+			jobs[t].end = (long) count * (t + 1) / workers;
+			jobs[t].centroids = c;
+			panic_if(pthread_create(&jobs[t].thread, NULL, assign_samples, &jobs[t]) != 0,
+					"Failed to start quantizer worker");
+		}
+		for (int t = 0; t < workers; t++) {
+			pthread_join(jobs[t].thread, NULL);
+		}
+
+		moved = false;
+		for (int i = 0; i < k; i++) {
+			double sum[6] = {0};
+			long n = 0;
+			for (int t = 0; t < workers; t++) {
+				for (int j = 0; j < 6; j++) sum[j] += jobs[t].sums[i][j];
+				n += jobs[t].counts[i];
+			}
+			// an empty cluster keeps its centroid and colour
+			if (n == 0) continue;
+
+			Lab next = {sum[0] / n, sum[1] / n, sum[2] / n};
+			float dl = next.l - c->l[i];
+			float da = next.a - c->a[i];
+			float db = next.b - c->b[i];
+			if (dl * dl + da * da + db * db > KMEANS_EPSILON) moved = true;
+			set_centroid(c, i, next);
+			for (int j = 0; j < 3; j++) {
+				palette->rgb[3 * i + j] = (uint8_t) lround(sum[3 + j] / n);
+			}
+		}
+		iterations++;
+	}
+	free(jobs);
+
+	// map against the colours that will actually be written
+	for (int i = 0; i < k; i++) {
+		set_centroid(c, i, to_lab(palette->rgb + 3 * i));
+	}
+	return iterations;
+}
+
+// drop the palette entries no pixel maps to and merge ones that rounded to
+// the same rgb, renumbering the indices to match
+static void compact_palette(Palette *palette, uint8_t *indices, size_t n) {
+	bool used[MAX_PALETTE] = {false};
+	for (size_t i = 0; i < n; i++) used[indices[i]] = true;
+
+	uint8_t remap[MAX_PALETTE];
+	int kept = 0;
+	for (int i = 0; i < palette->count; i++) {
+		if (!used[i]) continue;
+		int k = 0;
+		while (k < kept && memcmp(palette->rgb + 3 * k, palette->rgb + 3 * i, 3) != 0) k++;
+		if (k == kept) {
+			memmove(palette->rgb + 3 * kept, palette->rgb + 3 * i, 3);
+			kept++;
+		}
+		remap[i] = k;
+	}
+	if (kept == palette->count) return;
+
+	for (size_t i = 0; i < n; i++) indices[i] = remap[indices[i]];
+	palette->count = kept;
+}
+
+typedef struct {
+	void *pixels;
+	int width;
+	Format format;
+	int start;
+	int end;
+	const Centroids *centroids;
+	uint8_t *indices;
+	pthread_t thread;
+} Mapping;
+
+static void *map_rows(void *arg) {
+	Mapping *job = arg;
+	size_t stride = row_size(job->format, job->width);
+	// neighbouring pixels often repeat a colour, skip the cube roots for those
+	uint32_t *keys = calloc(CACHE_SIZE, sizeof(uint32_t));
+	uint8_t *values = malloc(CACHE_SIZE);
+	assert(keys != NULL && values != NULL);
+
+	for (int y = job->start; y < job->end; y++) {
+		const uint8_t *row = (const uint8_t *) job->pixels + (size_t) y * stride;
+		uint8_t *out = job->indices + (size_t) y * job->width;
+		for (int x = 0; x < job->width; x++) {
+			uint8_t rgb[3];
+			load_rgb(row, x, job->format, rgb);
+			// +1 so an empty slot (0) never matches
+			uint32_t key = ((uint32_t) rgb[0] << 16 | rgb[1] << 8 | rgb[2]) + 1;
+			uint32_t slot = (key * 2654435761u) >> 20 & (CACHE_SIZE - 1);
+			if (keys[slot] != key) {
+				keys[slot] = key;
+				values[slot] = nearest(job->centroids, to_lab(rgb));
+			}
+			out[x] = values[slot];
+		}
+	}
+	free(keys);
+	free(values);
+	return NULL;
+}
+
+static void map_pixels(void *pixels, int width, int height, Format format,
+		const Centroids *c, uint8_t *indices) {
+	int workers = num_workers();
+	if (workers > height) workers = height;
+	Mapping *jobs = malloc(sizeof(Mapping) * workers);
+	assert(jobs != NULL);
+	for (int t = 0; t < workers; t++) {
+		jobs[t] = (Mapping) {
+			.pixels = pixels,
+			.width = width,
+			.format = format,
+			.start = (long) height * t / workers,
+			.end = (long) height * (t + 1) / workers,
+			.centroids = c,
+			.indices = indices,
+		};
+		panic_if(pthread_create(&jobs[t].thread, NULL, map_rows, &jobs[t]) != 0,
+				"Failed to start quantizer worker");
+	}
+	for (int t = 0; t < workers; t++) {
+		pthread_join(jobs[t].thread, NULL);
+	}
+	free(jobs);
+}
+
+// floyd-steinberg in OKLab, each row depends on the one before so this is serial
+static void dither_pixels(void *pixels, int width, int height, Format format,
+		const Centroids *c, uint8_t *indices) {
+	size_t stride = row_size(format, width);
+	// one spare entry either side so the kernel needs no edge checks
+	Lab *cur = calloc(width + 2, sizeof(Lab));
+	Lab *next = calloc(width + 2, sizeof(Lab));
+	assert(cur != NULL && next != NULL);
+
+	for (int y = 0; y < height; y++) {
+		const uint8_t *row = (const uint8_t *) pixels + (size_t) y * stride;
+		uint8_t *out = indices + (size_t) y * width;
+		for (int x = 0; x < width; x++) {
+			uint8_t rgb[3];
+			load_rgb(row, x, format, rgb);
+			Lab p = to_lab(rgb);
+			Lab *err = &cur[x + 1];
+			p.l += err->l;
+			p.a += err->a;
+			p.b += err->b;
+
+			int k = nearest(c, p);
+			out[x] = k;
+			Lab e = {p.l - c->l[k], p.a - c->a[k], p.b - c->b[k]};
+
+			static const float weights[4] = {7 / 16.0f, 3 / 16.0f, 5 / 16.0f, 1 / 16.0f};
+			Lab *targets[4] = {&cur[x + 2], &next[x], &next[x + 1], &next[x + 2]};
+			for (int i = 0; i < 4; i++) {
+				targets[i]->l += e.l * weights[i];
+				targets[i]->a += e.a * weights[i];
+				targets[i]->b += e.b * weights[i];
+			}
+		}
+		Lab *tmp = cur;
+		cur = next;
+		next = tmp;
+		memset(next, 0, sizeof(Lab) * (width + 2));
+	}
+	free(cur);
+	free(next);
+}
+
+uint8_t *quantize(void *pixels, int width, int height, Format format,
+		int colours, bool dither, Palette *palette) {
+	panic_if(colours < 2 || colours > MAX_PALETTE, "Palette size must be between 2 and 256");
+	pthread_once(&linear_once, build_linear);
+
+	int count;
+	Sample *samples = take_samples(pixels, width, height, format, &count);
+
+	Centroids *c = malloc(sizeof(Centroids));
+	assert(c != NULL);
+	median_cut(samples, count, colours, c, palette);
+	kmeans(samples, count, c, palette);
+	pad_centroids(c);
+	free(samples);
+
+	uint8_t *indices = malloc((size_t) width * height);
+	assert(indices != NULL);
+	if (dither) {
+		dither_pixels(pixels, width, height, format, c, indices);
+	} else {
+		map_pixels(pixels, width, height, format, c, indices);
+	}
+	free(c);
+	compact_palette(palette, indices, (size_t) width * height);
+	return indices;
+}
+
+void write_quantized_png(void *pixels, int width, int height, Format format,
+		int colours, bool dither, FILE *out) {
+	double started = now();
+	Palette palette;
+	uint8_t *indices = quantize(pixels, width, height, format, colours, dither, &palette);
+	double quantized = now();
+
+	long start = ftell(out);
+	write_indexed_png(indices, width, height, palette.rgb, palette.count, out);
+	long size = ftell(out) - start;
+
+	// quality: rgb psnr and mean OKLab distance (x100, the lightness scale is 0-100)
+	size_t stride = row_size(format, width);
+	double squared = 0;
+	double delta = 0;
+	for (int y = 0; y < height; y++) {
+		const uint8_t *row = (const uint8_t *) pixels + (size_t) y * stride;
+		for (int x = 0; x < width; x++) {
+			uint8_t rgb[3];
+			load_rgb(row, x, format, rgb);
+			const uint8_t *q = palette.rgb + 3 * indices[(size_t) y * width + x];
+			Lab a = to_lab(rgb);
+			Lab b = to_lab(q);
+			for (int i = 0; i < 3; i++) squared += (rgb[i] - q[i]) * (rgb[i] - q[i]);
+			delta += sqrtf((a.l - b.l) * (a.l - b.l) + (a.a - b.a) * (a.a - b.a)
+					+ (a.b - b.b) * (a.b - b.b));
+		}
+	}
+	double pixel_count = (double) width * height;
+	double mse = squared / (pixel_count * 3);
+	double psnr = mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+
+	// what the lossless png of the same pixels would cost
+	char *lossless = NULL;
+	size_t lossless_len = 0;
+	FILE *mem = open_memstream(&lossless, &lossless_len);
+	panic_if(mem == NULL, "Failed to open memory stream");
+	write_png(NULL, pixels, width, height, format, mem);
+	fclose(mem);
+	free(lossless);
+
+	fprintf(stderr, "quantize: %d colours%s, psnr %.2f dB, mean dE %.2f -> %ld bytes "
+			"(lossless %zu, %.1f%%), %.0f ms\n",
+			palette.count, dither ? " dithered" : "", psnr, 100 * delta / pixel_count,
+			size, lossless_len, 100.0 * size / lossless_len, (quantized - started) * 1e3);
+	free(indices);
+}
@@ -0,0 +1,24 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#define MAX_PALETTE 256
+
+typedef struct {
+	int count;
+	uint8_t rgb[MAX_PALETTE * 3];
+} Palette;
+
+// reduce an image to at most colours (2 to 256) palette entries
+// median cut in OKLab seeds k-means, which runs on every core; with dither the
+// mapping diffuses the error Floyd-Steinberg style
+// returns one palette index per pixel, rows of width bytes; palette holds only
+// the colours some pixel uses
+extern uint8_t *quantize(void *pixels, int width, int height, Format format,
+		int colours, bool dither, Palette *palette);
+
+// quantize and write an indexed png, reporting quality and size against the
+// lossless png on stderr
+extern void write_quantized_png(void *pixels, int width, int height, Format format,
+		int colours, bool dither, FILE *out);
+
+#endif
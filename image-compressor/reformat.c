@@ -1,49 +1,436 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <limits.h>
 #include <arpa/inet.h>
 
 #include "extract_ext.h"
-#include "serialise_ext.h"
-#include "filter_ext.h"
 #include "compress_ext.h"
-#include "chunk_ext.h"
-#include "encode_ext.h"
+#include "png_ext.h"
+#include "apng_ext.h"
+#include "decode_ext.h"
+#include "export_ext.h"
+#include "bench_ext.h"
+#include "daemon_ext.h"
+#include "resize_ext.h"
+#include "thumbnail_ext.h"
+#include "optimize_ext.h"
+#include "pipeline_ext.h"
+#include "qoi_ext.h"
+#include "quantize_ext.h"
+#include "transform_ext.h"
+#include "shard_ext.h"
+#include "watch_ext.h"
+#include "zopfli_ext.h"
+#include "strip_ext.h"
 
+#include "debug_util.h"
 
-int main(int argc, char **argv) {
-	assert(argc == 3);
+#define DEFAULT_FRAME_DELAY_MS 100
+#define DEFAULT_BENCH_ITERATIONS 10
+#define DEFAULT_QUEUE_LENGTH 64
+#define DEFAULT_LEASE_SECONDS 60
+#define DEFAULT_MAX_LEASES 30
+#define DEFAULT_DEBOUNCE_MS 200
+
+static void usage(char *prog) {
+	fprintf(stderr,
+			"usage: %s [--verify] [--crop x,y,w,h] [--rotate 90|180|270] [--flip h|v] [--max-memory bytes[k|m|g]]\n"
+			"          [--thumbs WxH,... [--resize-filter box|bilinear|lanczos] | --optimize=ms\n"
+			"          | --pipeline | --quantize=n [--dither] | --max-ratio[=iterations]]\n"
+			"          input.pnm output.png\n"
+			"       %s [--verify] [--crop x,y,w,h] input.pnm output.qoi\n"
+			"       %s input.png|input.qoi output.pnm\n"
+			"       %s --apng [--delay ms] [--loops n] output.png frame.pnm...\n"
+			"       %s --bench [--iterations n] [--max-ratio[=iterations]] input.pnm...\n"
+			"       %s --daemon socket [--workers n] [--queue n]\n"
+			"       %s --client socket [--pass-fds] (input.pnm output.png [settings] | stats | shutdown)\n"
+			"       %s --enqueue manifest input.pnm output.png...\n"
+			"       %s --shard manifest [--shard-name name] [--lease seconds] [--max-leases n]\n"
+			"       %s --watch spool output_dir [--workers n] [--debounce ms]\n",
+			prog, prog, prog, prog, prog, prog, prog, prog, prog, prog);
+	exit(EXIT_FAILURE);
+}
+
+static bool has_extension(char *path, char *extension) {
+	char *dot = strrchr(path, '.');
+	return dot != NULL && strcmp(dot, extension) == 0;
+}
+
+static FILE *open_output(char *path) {
+	FILE *out = fopen(path, "wb");
+	if (out == NULL){
+		printf("Failed to open the output fiule.");
+		exit(EXIT_FAILURE);
+	}
+	return out;
+}
+
+// png or qoi back to binary pnm
+static void export(char *source, char *dest) {
+	FILE *src = fopen(source, "rb");
+	panic_if(src == NULL, "No such file found");
 
 	Format format;
 	int height;
 	int width;
-	int scanline_width;
-	void *pixels = extract(argv[1], &format, &height, &width);
+	void *pixels = has_extension(source, ".qoi") ? qoi_decode(src, &format, &height, &width)
+		: decode_png(src, &format, &height, &width);
+	fclose(src);
 
-	// open output file
-	FILE *out = fopen(argv[2], "wb");
-	if (out == NULL){
-		printf("Failed to open the output fiule.");
-		return 1;
+	FILE *out = open_output(dest);
+	export_pnm(pixels, width, height, format, out);
+	fclose(out);
+	free(pixels);
+}
+
+// decode a written png (or qoi) and compare it against the source pixels
+static bool verify(char *dest, void *pixels, int width, int height, Format format) {
+	FILE *src = fopen(dest, "rb");
+	panic_if(src == NULL, "Failed to reopen output for verification");
+
+	Format decoded_format;
+	int decoded_height;
+	int decoded_width;
+	bool ok;
+	void *decoded;
+	if (has_extension(dest, ".qoi")) {
+		// qoi is always rgb, compare the expanded source
+		decoded = qoi_decode(src, &decoded_format, &decoded_height, &decoded_width);
+		ok = decoded_height == height && decoded_width == width
+			&& qoi_same_pixels(pixels, format, decoded, width, height);
+	} else {
+		decoded = decode_png(src, &decoded_format, &decoded_height, &decoded_width);
+		ok = decoded_format == format && decoded_height == height && decoded_width == width
+			&& same_pixels(pixels, decoded, width, height, format);
 	}
+	fclose(src);
+	free(decoded);
+	return ok;
+}
 
-	uint8_t **scanlines = serialise(pixels, width, height, format, &scanline_width);
+int main(int argc, char **argv) {
+	bool apng = false;
+	bool bench = false;
+	bool check = false;
+	int delay_ms = DEFAULT_FRAME_DELAY_MS;
+	int loops = 0;
+	int iterations = DEFAULT_BENCH_ITERATIONS;
+	char *daemon_socket = NULL;
+	char *client_socket = NULL;
+	bool pass_fds = false;
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int queue_len = DEFAULT_QUEUE_LENGTH;
+	Size *sizes = NULL;
+	int num_sizes = 0;
+	ResizeFilter resize_filter = RESIZE_LANCZOS;
+	int optimize_ms = -1;
+	bool pipeline = false;
+	int crop[4];
+	bool cropped = false;
+	int quantize_colours = 0;
+	bool dither = false;
+	// rotation first, then the flip
+	Transform transforms[2];
+	bool rotate = false;
+	bool flip = false;
+	char *shard_manifest = NULL;
+	char *enqueue_manifest = NULL;
+	char *shard_name = NULL;
+	int lease = DEFAULT_LEASE_SECONDS;
+	int max_leases = DEFAULT_MAX_LEASES;
+	char *watch_spool = NULL;
+	int debounce_ms = DEFAULT_DEBOUNCE_MS;
+	int max_ratio = 0;
+	size_t max_memory = 0;
 
-	uint8_t **mlines = filter(scanlines, scanline_width, height, format);
+	static struct option long_options[] = {
+		{"apng", no_argument, NULL, 'a'},
+		{"delay", required_argument, NULL, 'd'},
+		{"loops", required_argument, NULL, 'l'},
+		{"verify", no_argument, NULL, 'v'},
+		{"bench", no_argument, NULL, 'b'},
+		{"iterations", required_argument, NULL, 'i'},
+		{"daemon", required_argument, NULL, 'D'},
+		{"workers", required_argument, NULL, 'w'},
+		{"queue", required_argument, NULL, 'q'},
+		{"client", required_argument, NULL, 'C'},
+		{"pass-fds", no_argument, NULL, 'F'},
+		{"thumbs", required_argument, NULL, 't'},
+		{"resize-filter", required_argument, NULL, 'r'},
+		{"optimize", required_argument, NULL, 'o'},
+		{"pipeline", no_argument, NULL, 'p'},
+		{"crop", required_argument, NULL, 'c'},
+		{"quantize", required_argument, NULL, 'Q'},
+		{"dither", no_argument, NULL, 'T'},
+		{"rotate", required_argument, NULL, 'R'},
+		{"flip", required_argument, NULL, 'f'},
+		{"shard", required_argument, NULL, 'S'},
+		{"enqueue", required_argument, NULL, 'E'},
+		{"shard-name", required_argument, NULL, 'N'},
+		{"lease", required_argument, NULL, 'L'},
+		{"max-leases", required_argument, NULL, 'X'},
+		{"watch", required_argument, NULL, 'W'},
+		{"debounce", required_argument, NULL, 'B'},
+		{"max-ratio", optional_argument, NULL, 'M'},
+		{"max-memory", required_argument, NULL, 'm'},
+		{NULL, 0, NULL, 0}
+	};
 
-	int len;
-	void *compressed = compress_lines(mlines, height, scanline_width + 1, &len);
-	// make chunks
-	Chunk *ihdr = chunk_ihdr(width, height, format);
-	ChunkList* idats = chunk_idat(compressed, len);
-	Chunk* iend = chunk_iend();
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'a':
+				apng = true;
+				break;
+			case 'd':
+				delay_ms = atoi(optarg);
+				break;
+			case 'l':
+				loops = atoi(optarg);
+				break;
+			case 'v':
+				check = true;
+				break;
+			case 'b':
+				bench = true;
+				break;
+			case 'i':
+				iterations = atoi(optarg);
+				break;
+			case 'D':
+				daemon_socket = optarg;
+				break;
+			case 'w':
+				workers = atoi(optarg);
+				break;
+			case 'q':
+				queue_len = atoi(optarg);
+				break;
+			case 'C':
+				client_socket = optarg;
+				break;
+			case 'F':
+				pass_fds = true;
+				break;
+			case 't':
+				if (!parse_sizes(optarg, &sizes, &num_sizes)) usage(argv[0]);
+				break;
+			case 'r':
+				if (!parse_resize_filter(optarg, &resize_filter)) usage(argv[0]);
+				break;
+			case 'o':
+				optimize_ms = atoi(optarg);
+				if (optimize_ms < 0) usage(argv[0]);
+				break;
+			case 'p':
+				pipeline = true;
+				break;
+			case 'c': {
+				int used = 0;
+				if (sscanf(optarg, "%d,%d,%d,%d%n", &crop[0], &crop[1], &crop[2], &crop[3], &used) != 4
+						|| optarg[used] != '\0') usage(argv[0]);
+				cropped = true;
+				break;
+			}
+			case 'Q':
+				quantize_colours = atoi(optarg);
+				if (quantize_colours < 2 || quantize_colours > MAX_PALETTE) usage(argv[0]);
+				break;
+			case 'T':
+				dither = true;
+				break;
+			case 'R':
+				if (!parse_rotation(optarg, &transforms[0])) usage(argv[0]);
+				rotate = true;
+				break;
+			case 'f':
+				if (!parse_flip(optarg, &transforms[1])) usage(argv[0]);
+				flip = true;
+				break;
+			case 'S':
+				shard_manifest = optarg;
+				break;
+			case 'E':
+				enqueue_manifest = optarg;
+				break;
+			case 'N':
+				shard_name = optarg;
+				break;
+			case 'L':
+				lease = atoi(optarg);
+				if (lease < 1) usage(argv[0]);
+				break;
+			case 'X':
+				max_leases = atoi(optarg);
+				if (max_leases < 1) usage(argv[0]);
+				break;
+			case 'W':
+				watch_spool = optarg;
+				break;
+			case 'B':
+				debounce_ms = atoi(optarg);
+				if (debounce_ms < 0) usage(argv[0]);
+				break;
+			case 'M':
+				max_ratio = optarg == NULL ? DEFAULT_ZOPFLI_ITERATIONS : atoi(optarg);
+				if (max_ratio < 1) usage(argv[0]);
+				break;
+			case 'm':
+				if (!parse_memory_size(optarg, &max_memory)) usage(argv[0]);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	int nargs = argc - optind;
+	char **args = argv + optind;
 
-	// encode
-	encode(ihdr, idats, iend, out);
+	if (daemon_socket != NULL) {
+		if (nargs != 0 || workers < 1 || queue_len < 1) usage(argv[0]);
+		return run_daemon(daemon_socket, workers, queue_len);
+	}
 
-	fclose(out);
+	if (client_socket != NULL) {
+		return run_client(client_socket, args, nargs, pass_fds);
+	}
+
+	if (watch_spool != NULL) {
+		if (nargs != 1 || workers < 1) usage(argv[0]);
+		return run_watch(watch_spool, args[0], workers, debounce_ms);
+	}
+
+	if (enqueue_manifest != NULL) {
+		if (nargs < 2 || nargs % 2 != 0) usage(argv[0]);
+		int added = enqueue_items(enqueue_manifest, args, nargs);
+		fprintf(stderr, "queued %d of %d items\n", added, nargs / 2);
+		return 0;
+	}
+
+	if (shard_manifest != NULL) {
+		if (nargs != 0) usage(argv[0]);
+		char default_name[HOST_NAME_MAX + 16];
+		if (shard_name == NULL) {
+			char host[HOST_NAME_MAX + 1] = "host";
+			gethostname(host, sizeof(host));
+			snprintf(default_name, sizeof(default_name), "%s.%d", host, getpid());
+			shard_name = default_name;
+		}
+		return run_shard(shard_manifest, shard_name, lease, max_leases);
+	}
+
+	if (bench) {
+		if (nargs < 1 || iterations < 1) usage(argv[0]);
+		run_bench(args, nargs, iterations, max_ratio);
+		return 0;
+	}
+
+	if (apng) {
+		if (nargs < 2 || delay_ms < 0 || delay_ms > UINT16_MAX || loops < 0) usage(argv[0]);
+
+		FILE *out = open_output(args[0]);
+		write_apng(args + 1, nargs - 1, delay_ms, 1000, loops, out);
+		fclose(out);
+		return 0;
+	}
+
+	int modes = (num_sizes > 0) + (optimize_ms >= 0) + pipeline + (quantize_colours > 0) + (max_ratio > 0);
+	if (nargs != 2 || modes > 1 || ((cropped || rotate || flip) && pipeline)) usage(argv[0]);
+	// quantized output is lossy, there is nothing exact to verify against
+	if ((dither && quantize_colours == 0) || (check && quantize_colours > 0)) usage(argv[0]);
+	bool qoi = has_extension(args[1], ".qoi");
+	if (qoi && modes > 0) usage(argv[0]);
+	// only the plain png conversion knows how to work in strips
+	if (max_memory > 0 && (modes > 0 || qoi || cropped || rotate || flip)) usage(argv[0]);
+
+	if (has_extension(args[0], ".png") || has_extension(args[0], ".qoi")) {
+		export(args[0], args[1]);
+		return 0;
+	}
+
+	if (max_memory > 0 && convert_in_strips(args[0], args[1], max_memory)) {
+		// comparing would need both whole images in memory
+		if (check) fprintf(stderr, "%s was written in strips, --verify skipped\n", args[1]);
+		return 0;
+	}
+
+	if (pipeline) {
+		run_pipeline(args[0], args[1]);
+		if (!check) return 0;
+	}
+
+	Format format;
+	int height;
+	int width;
+	void *pixels;
+	if (cropped) {
+		// only the rows and columns inside the crop are read
+		pixels = extract_crop(args[0], crop[0], crop[1], crop[2], crop[3], &format);
+		width = crop[2];
+		height = crop[3];
+	} else {
+		pixels = extract(args[0], &format, &height, &width);
+	}
+
+	for (int t = 0; t < 2; t++) {
+		if (!(t == 0 ? rotate : flip)) continue;
+		void *turned = transform(pixels, &width, &height, format, transforms[t]);
+		free(pixels);
+		pixels = turned;
+	}
+
+	if (pipeline) {
+		// already written, the extract above is only for --verify
+	} else if (num_sizes > 0) {
+		// full size and every thumbnail from this one extract
+		write_thumbnails(pixels, width, height, format, sizes, num_sizes, resize_filter, args[1]);
+		free(sizes);
+	} else if (optimize_ms >= 0) {
+		int len;
+		void *compressed = optimize_pixels(pixels, width, height, format, optimize_ms, &len);
+		FILE *out = open_output(args[1]);
+		write_png_data(compressed, len, width, height, format, out);
+		fclose(out);
+		free(compressed);
+	} else if (max_ratio > 0) {
+		CompressSettings settings;
+		default_compress_settings(&settings);
+		settings.iterations = max_ratio;
+		int len;
+		void *compressed = deflate_pixels_with(NULL, &settings, pixels, width, height, format, &len);
+		FILE *out = open_output(args[1]);
+		write_png_data(compressed, len, width, height, format, out);
+		fclose(out);
+		free(compressed);
+	} else if (quantize_colours > 0) {
+		FILE *out = open_output(args[1]);
+		write_quantized_png(pixels, width, height, format, quantize_colours, dither, out);
+		fclose(out);
+	} else if (qoi) {
+		int len;
+		void *encoded = qoi_encode(pixels, width, height, format, &len);
+		FILE *out = open_output(args[1]);
+		fwrite(encoded, 1, len, out);
+		fclose(out);
+		free(encoded);
+	} else {
+		// open output file
+		FILE *out = open_output(args[1]);
+		write_png(NULL, pixels, width, height, format, out);
+		fclose(out);
+	}
+
+	if (check && !verify(args[1], pixels, width, height, format)) {
+		fprintf(stderr, "Verification failed: %s does not match %s\n", args[1], args[0]);
+		free(pixels);
+		return 1;
+	}
+	free(pixels);
 
 	return 0;
 }
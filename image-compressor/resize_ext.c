@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "extract_ext.h"
+#include "resize_ext.h"
+
+#include "debug_util.h"
+
+#define LANCZOS_LOBES 3
+
+// weights of the input samples that make up one output sample
+typedef struct {
+	int start;
+	int count;
+	float *weights;
+} Contrib;
+
+bool parse_resize_filter(const char *name, ResizeFilter *filter) {
+	if (strcmp(name, "box") == 0) {
+		*filter = RESIZE_BOX;
+	} else if (strcmp(name, "bilinear") == 0) {
+		*filter = RESIZE_BILINEAR;
+	} else if (strcmp(name, "lanczos") == 0) {
+		*filter = RESIZE_LANCZOS;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static double filter_support(ResizeFilter filter) {
+	switch (filter) {
+		case RESIZE_BOX:
+			return 0.5;
+		case RESIZE_BILINEAR:
+			return 1.0;
+		default:
+			return LANCZOS_LOBES;
+	}
+}
+
+static double sinc(double x) {
+	if (x == 0) return 1;
+	x *= M_PI;
+	return sin(x) / x;
+}
+
+static double filter_weight(ResizeFilter filter, double x) {
+	x = fabs(x);
+	switch (filter) {
+		case RESIZE_BOX:
+			return x <= 0.5 ? 1 : 0;
+		case RESIZE_BILINEAR:
+			return x < 1 ? 1 - x : 0;
+		default:
+			return x < LANCZOS_LOBES ? sinc(x) * sinc(x / LANCZOS_LOBES) : 0;
+	}
+}
+
+// weights for every output coordinate along one axis
+// when shrinking the filter is stretched so every input sample contributes
+static Contrib *contributions(int in_len, int out_len, ResizeFilter filter) {
+	double scale = (double) in_len / out_len;
+	double stretch = scale > 1 ? scale : 1;
+	double support = filter_support(filter) * stretch;
+
+	Contrib *contribs = malloc(sizeof(Contrib) * out_len);
+	assert(contribs != NULL);
+
+	int max_count = (int) ceil(2 * support) + 2;
+	for (int i = 0; i < out_len; i++) {
+		double center = (i + 0.5) * scale;
+		int left = (int) floor(center - support);
+		int right = (int) ceil(center + support);
+		if (right - left + 1 > max_count) right = left + max_count - 1;
+
+		// clamp at the edges by folding weights onto the border samples
+		int start = left < 0 ? 0 : left;
+		int end = right > in_len - 1 ? in_len - 1 : right;
+		Contrib *c = &contribs[i];
+		c->start = start;
+		c->count = end - start + 1;
+		c->weights = calloc(c->count, sizeof(float));
+		assert(c->weights != NULL);
+
+		double total = 0;
+		for (int j = left; j <= right; j++) {
+			double w = filter_weight(filter, (j + 0.5 - center) / stretch);
+			int k = j < 0 ? 0 : (j > in_len - 1 ? in_len - 1 : j);
+			c->weights[k - start] += w;
+			total += w;
+		}
+		// box filters can miss every sample for exact half offsets
+		if (total == 0) {
+			int k = (int) center;
+			if (k > end) k = end;
+			c->weights[k - start] = 1;
+			total = 1;
+		}
+		for (int k = 0; k < c->count; k++) {
+			c->weights[k] /= total;
+		}
+	}
+	return contribs;
+}
+
+static void free_contributions(Contrib *contribs, int len) {
+	for (int i = 0; i < len; i++) {
+		free(contribs[i].weights);
+	}
+	free(contribs);
+}
+
+// the horizontal weights as one table, every output's taps padded with zero
+// weights to a multiple of 4, so the inner loop is whole vectors with no tail
+typedef struct {
+	int taps;	// padded tap count, the same for every output
+	int *start;
+	float *weights;	// taps per output
+} TapTable;
+
+static TapTable tap_table(Contrib *contribs, int out_len) {
+	int most = 1;
+	for (int i = 0; i < out_len; i++) {
+		if (contribs[i].count > most) most = contribs[i].count;
+	}
+	TapTable table = { (most + 3) & ~3, malloc(sizeof(int) * out_len), NULL };
+	table.weights = calloc((size_t) out_len * table.taps, sizeof(float));
+	assert(table.start != NULL && table.weights != NULL);
+	for (int i = 0; i < out_len; i++) {
+		table.start[i] = contribs[i].start;
+		memcpy(table.weights + (size_t) i * table.taps, contribs[i].weights, sizeof(float) * contribs[i].count);
+	}
+	return table;
+}
+
+// one grey row: every output is a dot product of its taps with the samples
+// from its start; row holds taps zeros past the last sample for the padding
+static void horizontal_grey(const TapTable *table, const float *row, float *out, int out_len) {
+	for (int x = 0; x < out_len; x++) {
+		const float *w = table->weights + (size_t) x * table->taps;
+		const float *in = row + table->start[x];
+#ifdef __SSE2__
+		__m128 acc = _mm_setzero_ps();
+		for (int k = 0; k < table->taps; k += 4) {
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(w + k), _mm_loadu_ps(in + k)));
+		}
+		// fold the four partial sums
+		acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+		acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+		out[x] = _mm_cvtss_f32(acc);
+#else
+		float sum = 0;
+		for (int k = 0; k < table->taps; k++) {
+			sum += w[k] * in[k];
+		}
+		out[x] = sum;
+#endif
+	}
+}
+
+// one colour row, held as r g b 0 per pixel so a pixel is one vector: each tap
+// is a single multiply-add for all three channels
+// out is written 4 floats per pixel 3 apart, so it needs one spare float at the end
+static void horizontal_colour(const TapTable *table, const float *row, float *out, int out_len) {
+	for (int x = 0; x < out_len; x++) {
+		const float *w = table->weights + (size_t) x * table->taps;
+		const float *in = row + (size_t) table->start[x] * 4;
+#ifdef __SSE2__
+		__m128 acc = _mm_setzero_ps();
+		for (int k = 0; k < table->taps; k++) {
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_load_ps(in + 4 * k)));
+		}
+		// the fourth lane is overwritten by the next pixel's red
+		_mm_storeu_ps(out + 3 * x, acc);
+#else
+		float sum[3] = {0};
+		for (int k = 0; k < table->taps; k++) {
+			for (int ch = 0; ch < 3; ch++) sum[ch] += w[k] * in[4 * k + ch];
+		}
+		memcpy(out + 3 * x, sum, sizeof(sum));
+#endif
+	}
+}
+
+static uint8_t to_sample(float v) {
+	if (v <= 0) return 0;
+	if (v >= 255) return 255;
+	return (uint8_t) (v + 0.5f);
+}
+
+// samples as interleaved bytes: 1 channel for grey (and unpacked BW), 3 for colour
+static uint8_t *to_samples(void *pixels, int width, int height, Format format) {
+	int channels = format == FULL_COLOR ? 3 : 1;
+	uint8_t *samples = malloc((size_t) width * height * channels);
+	assert(samples != NULL);
+
+	size_t n = (size_t) width * height;
+	if (format == BW) {
+		uint8_t *packed = pixels;
+		int row_bytes = PACKED_ROW_BYTES(width);
+		for (int row = 0; row < height; row++) {
+			for (int col = 0; col < width; col++) {
+				uint8_t bit = packed[(size_t) row * row_bytes + col / 8] & (0x80 >> (col % 8));
+				samples[(size_t) row * width + col] = bit ? 255 : 0;
+			}
+		}
+	} else if (format == GREYSCALE) {
+		Pixel *px = pixels;
+		for (size_t i = 0; i < n; i++) samples[i] = px[i].gp;
+	} else {
+		// Pixel is exactly three samples wide
+		memcpy(samples, pixels, n * 3);
+	}
+	return samples;
+}
+
+void *resize(void *pixels, int width, int height, Format *format,
+		int new_width, int new_height, ResizeFilter filter) {
+	panic_if(new_width < 1 || new_height < 1, "Resize target must be at least 1x1");
+
+	int channels = *format == FULL_COLOR ? 3 : 1;
+	uint8_t *samples = to_samples(pixels, width, height, *format);
+
+	Contrib *horizontal = contributions(width, new_width, filter);
+	Contrib *vertical = contributions(height, new_height, filter);
+
+	// horizontal pass into float rows, kept at full height
+	// each input row is widened to floats once (colour to 4 lanes per pixel),
+	// with zeros past the end for the padded taps
+	TapTable taps = tap_table(horizontal, new_width);
+	int lanes = channels == 3 ? 4 : 1;
+	// aligned_alloc wants the size in whole multiples of the alignment
+	size_t row_floats = ((size_t) lanes * (width + taps.taps) + 3) & ~(size_t) 3;
+	float *row = aligned_alloc(16, sizeof(float) * row_floats);
+	assert(row != NULL);
+	memset(row, 0, sizeof(float) * row_floats);
+	size_t mid_stride = (size_t) new_width * channels;
+	// one spare float for horizontal_colour's last store
+	float *mid = malloc(sizeof(float) * (mid_stride * height + 1));
+	assert(mid != NULL);
+	for (int y = 0; y < height; y++) {
+		const uint8_t *in = samples + (size_t) y * width * channels;
+		float *out = mid + y * mid_stride;
+		if (channels == 3) {
+			for (int x = 0; x < width; x++) {
+				row[4 * x] = in[3 * x];
+				row[4 * x + 1] = in[3 * x + 1];
+				row[4 * x + 2] = in[3 * x + 2];
+			}
+			horizontal_colour(&taps, row, out, new_width);
+		} else {
+			for (int x = 0; x < width; x++) row[x] = in[x];
+			horizontal_grey(&taps, row, out, new_width);
+		}
+	}
+	free(row);
+	free(taps.start);
+	free(taps.weights);
+	free(samples);
+
+	// vertical pass: each output row is a weighted sum of whole input rows,
+	// a straight contiguous loop the compiler can vectorise
+	float *acc = malloc(sizeof(float) * mid_stride);
+	assert(acc != NULL);
+	Format out_format = *format == BW ? GREYSCALE : *format;
+	Pixel *result = malloc(sizeof(Pixel) * new_width * new_height);
+	assert(result != NULL);
+	for (int y = 0; y < new_height; y++) {
+		Contrib *c = &vertical[y];
+		memset(acc, 0, sizeof(float) * mid_stride);
+		for (int k = 0; k < c->count; k++) {
+			const float *restrict in = mid + (size_t) (c->start + k) * mid_stride;
+			float w = c->weights[k];
+			float *restrict a = acc;
+			for (size_t i = 0; i < mid_stride; i++) {
+				a[i] += w * in[i];
+			}
+		}
+
+		Pixel *out = result + (size_t) y * new_width;
+		if (out_format == GREYSCALE) {
+			for (int x = 0; x < new_width; x++) out[x].gp = to_sample(acc[x]);
+		} else {
+			for (int x = 0; x < new_width; x++) {
+				out[x].cp.red = to_sample(acc[3 * x]);
+				out[x].cp.green = to_sample(acc[3 * x + 1]);
+				out[x].cp.blue = to_sample(acc[3 * x + 2]);
+			}
+		}
+	}
+
+	free(acc);
+	free(mid);
+	free_contributions(horizontal, new_width);
+	free_contributions(vertical, new_height);
+
+	*format = out_format;
+	return result;
+}
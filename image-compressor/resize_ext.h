@@ -0,0 +1,19 @@
+#ifndef RESIZE_H
+#define RESIZE_H
+
+typedef enum {
+	RESIZE_BOX,
+	RESIZE_BILINEAR,
+	RESIZE_LANCZOS	// lanczos3
+} ResizeFilter;
+
+// parse "box", "bilinear" or "lanczos"; returns false for anything else
+extern bool parse_resize_filter(const char *name, ResizeFilter *filter);
+
+// resample with a separable filter, horizontal pass then vertical pass
+// BW images come back as GREYSCALE (format is updated), since the filters
+// produce intermediate greys; other formats are kept
+extern void *resize(void *pixels, int width, int height, Format *format,
+		int new_width, int new_height, ResizeFilter filter);
+
+#endif
@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ring_ext.h"
+
+// spin this many times before sleeping
+#define SPIN_LIMIT 64
+
+#define CACHE_LINE 64
+
+// where one side sleeps until the other has made progress
+// seq changes on every wake, so a wake between reading it and sleeping isn't lost
+typedef struct {
+	uint32_t seq;
+	uint32_t sleeping;
+} Waiter;
+
+struct Ring {
+	void **slots;
+	size_t mask;
+
+	// each index on its own line so producer and consumer don't share one
+	_Alignas(CACHE_LINE) size_t head;	// next slot to pop, written by the consumer
+	_Alignas(CACHE_LINE) size_t tail;	// next slot to push, written by the producer
+
+	// the consumer sleeps on items, woken by pushes; the producer on space, woken by pops
+	_Alignas(CACHE_LINE) Waiter items;
+	_Alignas(CACHE_LINE) Waiter space;
+
+	// only touched by their own side
+	_Alignas(CACHE_LINE) double push_wait;
+	_Alignas(CACHE_LINE) double pop_wait;
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+Ring *ring_create(int capacity) {
+	assert(capacity > 0);
+	size_t size = 1;
+	while (size < (size_t) capacity) size <<= 1;
+
+	Ring *ring = aligned_alloc(CACHE_LINE, sizeof(Ring));
+	assert(ring != NULL);
+	ring->slots = malloc(size * sizeof(void *));
+	assert(ring->slots != NULL);
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->items = (Waiter) {0, 0};
+	ring->space = (Waiter) {0, 0};
+	ring->push_wait = 0;
+	ring->pop_wait = 0;
+	return ring;
+}
+
+void ring_free(Ring *ring) {
+	free(ring->slots);
+	free(ring);
+}
+
+static void futex_wait(uint32_t *addr, uint32_t expected) {
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+// wait until ready() holds, spinning briefly then sleeping on waiter
+// returns the seconds spent waiting
+static double wait_for(Ring *ring, bool (*ready)(Ring *), Waiter *waiter) {
+	if (ready(ring)) return 0;
+
+	double start = now();
+	for (int spins = 0; spins < SPIN_LIMIT; spins++) {
+		if (ready(ring)) return now() - start;
+	}
+	for (;;) {
+		uint32_t seq = __atomic_load_n(&waiter->seq, __ATOMIC_ACQUIRE);
+		// announce the sleep before the last look; the other side publishes its
+		// index before checking for sleepers, so one of us sees the other
+		__atomic_store_n(&waiter->sleeping, 1, __ATOMIC_SEQ_CST);
+		if (ready(ring)) break;
+		futex_wait(&waiter->seq, seq);
+	}
+	__atomic_store_n(&waiter->sleeping, 0, __ATOMIC_RELAXED);
+	return now() - start;
+}
+
+// called after publishing an index, only costs a syscall if the other side sleeps
+static void wake(Waiter *waiter) {
+	if (__atomic_load_n(&waiter->sleeping, __ATOMIC_SEQ_CST)) {
+		__atomic_fetch_add(&waiter->seq, 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &waiter->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+static bool has_space(Ring *ring) {
+	size_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+	return ring->tail - head <= ring->mask;
+}
+
+static bool has_item(Ring *ring) {
+	size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+	return tail != ring->head;
+}
+
+void ring_push(Ring *ring, void *item) {
+	ring->push_wait += wait_for(ring, has_space, &ring->space);
+	ring->slots[ring->tail & ring->mask] = item;
+	// publish the slot before the new tail
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+	wake(&ring->items);
+}
+
+void *ring_pop(Ring *ring) {
+	ring->pop_wait += wait_for(ring, has_item, &ring->items);
+	void *item = ring->slots[ring->head & ring->mask];
+	// the slot is free for the producer once head moves past it
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+	wake(&ring->space);
+	return item;
+}
+
+double ring_push_wait(Ring *ring) {
+	return ring->push_wait;
+}
+
+double ring_pop_wait(Ring *ring) {
+	return ring->pop_wait;
+}
@@ -0,0 +1,23 @@
+#ifndef RING_H
+#define RING_H
+
+// bounded single producer / single consumer queue of pointers
+// no locks: the producer only moves tail, the consumer only moves head
+// a side that has to wait spins briefly, then sleeps on a futex until the
+// other side pushes or pops
+typedef struct Ring Ring;
+
+// capacity is rounded up to a power of two
+extern Ring *ring_create(int capacity);
+extern void ring_free(Ring *ring);
+
+// block while the ring is full; NULL is a valid item
+extern void ring_push(Ring *ring, void *item);
+// block while the ring is empty
+extern void *ring_pop(Ring *ring);
+
+// seconds the producer spent waiting for space / the consumer for items
+extern double ring_push_wait(Ring *ring);
+extern double ring_pop_wait(Ring *ring);
+
+#endif
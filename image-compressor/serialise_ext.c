@@ -1,6 +1,8 @@
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h> 
+#include <string.h>
 #include <assert.h>
 
 #include "extract_ext.h"
@@ -13,7 +15,7 @@ uint8_t** serialise(void *buffer, int width, int height, Format format, int *len
 		case BW:
 			// 1 bit per pixel, 8 pixels per byte
 			// ensures extra bits are packed into a byte
-			row_len = (width + 7) / 8;
+			row_len = PACKED_ROW_BYTES(width);
 			break;
 
 		case GREYSCALE:
@@ -35,31 +37,26 @@ uint8_t** serialise(void *buffer, int width, int height, Format format, int *len
 	uint8_t **out = malloc(height * sizeof(uint8_t*));
 	assert(out != NULL);
 	for (int i = 0; i < height; i++){
-		if (format == BW){
-			out[i] = calloc(row_len, sizeof(uint8_t));
-		} else{
-			out[i] = malloc(row_len * sizeof(uint8_t));
-		}
+		out[i] = malloc(row_len * sizeof(uint8_t));
 		assert(out[i] != NULL);
 	}
 
+	if (format == BW){
+		// already packed as png scanlines by extract, copy rows straight through
+		uint8_t *packed = buffer;
+		for (int row = 0; row < height; row++){
+			memcpy(out[row], packed + (size_t) row * row_len, row_len);
+		}
+		*length = row_len;
+		return out;
+	}
+
 	for (int row = 0; row < height; row++){
 		for (int col = 0; col < width; col++){
 			// pixels is an 1D array, calculate index for corresponding row and col
 			int index = row * width + col;
 
 			switch(format){
-				case BW:
-					// set 0 if pixel is black
-					if(!pixels[index].bw){
-						int byte_no = col / 8;
-						// MSB
-						int bits_offset = 7 - (col % 8);
-						// set 1 at correct position
-						out[row][byte_no] |= (1 << bits_offset);
-					}
-					break;
-
 				case GREYSCALE:
 					// Store 8 bits(one byte) grayscale value directly
 					out[row][col] = pixels[index].gp;
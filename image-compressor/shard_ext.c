@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "extract_ext.h"
+#include "compress_ext.h"
+#include "png_ext.h"
+#include "shard_ext.h"
+
+#include "debug_util.h"
+
+// how often an idle shard looks for expired leases of others
+#define POLL_MS 500
+
+static const char *subdirs[] = { "todo", "claimed", "done", "failed", "shards", "tmp" };
+
+typedef struct {
+	char *manifest;
+	char *name;
+	int lease;
+	int max_leases;	// a converter still running after this many leases is killed
+	unsigned long done;
+	unsigned long failed;
+	unsigned long skipped;
+	unsigned long reclaimed;
+	long long bytes_in;
+	double busy;
+} Shard;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *path_in(char *buf, char *manifest, const char *subdir, const char *name) {
+	snprintf(buf, PATH_MAX, "%s/%s/%s", manifest, subdir, name);
+	return buf;
+}
+
+static void make_dirs(char *manifest) {
+	char path[PATH_MAX];
+	panic_if(mkdir(manifest, 0755) != 0 && errno != EEXIST, "Failed to create manifest directory");
+	for (size_t i = 0; i < sizeof(subdirs) / sizeof(*subdirs); i++) {
+		snprintf(path, sizeof(path), "%s/%s", manifest, subdirs[i]);
+		panic_if(mkdir(path, 0755) != 0 && errno != EEXIST, "Failed to create manifest directory");
+	}
+}
+
+static bool exists(char *path) {
+	struct stat st;
+	return stat(path, &st) == 0;
+}
+
+// write a small file so it appears complete or not at all
+static bool write_atomic(Shard *shard, char *dest, const char *contents) {
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s/tmp/%s.%d", shard->manifest, shard->name, getpid());
+	FILE *out = fopen(tmp, "w");
+	if (out == NULL) return false;
+	fputs(contents, out);
+	if (fclose(out) != 0 || rename(tmp, dest) != 0) {
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+// item names are stable for a source path, so enqueueing twice is harmless
+static void item_name(char *buf, size_t len, char *src) {
+	uint32_t hash = 2166136261u;
+	for (char *p = src; *p; p++) {
+		hash = (hash ^ (uint8_t) *p) * 16777619u;
+	}
+	char *base = strrchr(src, '/');
+	snprintf(buf, len, "%08x-%s", hash, base == NULL ? src : base + 1);
+}
+
+static char *absolute(char *path, char *buf) {
+	if (*path == '/') return path;
+	panic_if(getcwd(buf, PATH_MAX) == NULL, "Failed to read working directory");
+	strncat(buf, "/", PATH_MAX - strlen(buf) - 1);
+	strncat(buf, path, PATH_MAX - strlen(buf) - 1);
+	return buf;
+}
+
+int enqueue_items(char *manifest, char **pairs, int count) {
+	make_dirs(manifest);
+	Shard shard = { .manifest = manifest, .name = "enqueue" };
+
+	int added = 0;
+	for (int i = 0; i + 1 < count; i += 2) {
+		char src_buf[PATH_MAX];
+		char dst_buf[PATH_MAX];
+		char *src = absolute(pairs[i], src_buf);
+		char *dst = absolute(pairs[i + 1], dst_buf);
+
+		char name[NAME_MAX];
+		item_name(name, sizeof(name), src);
+		// queued, being converted or converted already; a second todo/ entry
+		// would let a later claim replace the live one
+		// checked in the order items move, so one caught mid rename is still seen
+		char path[PATH_MAX];
+		if (exists(path_in(path, manifest, "todo", name)) || exists(path_in(path, manifest, "claimed", name))
+				|| exists(path_in(path, manifest, "done", name))) {
+			continue;
+		}
+
+		char line[2 * PATH_MAX + 2];
+		snprintf(line, sizeof(line), "%s\t%s\n", src, dst);
+		panic_if(!write_atomic(&shard, path_in(path, manifest, "todo", name), line),
+				"Failed to add manifest item");
+		added++;
+	}
+	return added;
+}
+
+static bool read_item(char *path, char *src, char *dst) {
+	FILE *in = fopen(path, "r");
+	if (in == NULL) return false;
+	char line[2 * PATH_MAX + 2];
+	bool ok = fgets(line, sizeof(line), in) != NULL;
+	fclose(in);
+	if (!ok) return false;
+
+	line[strcspn(line, "\n")] = '\0';
+	char *tab = strchr(line, '\t');
+	if (tab == NULL) return false;
+	*tab = '\0';
+	size_t src_len = strlen(line);
+	size_t dst_len = strlen(tab + 1);
+	if (src_len >= PATH_MAX || dst_len >= PATH_MAX) return false;
+	memcpy(src, line, src_len + 1);
+	memcpy(dst, tab + 1, dst_len + 1);
+	return true;
+}
+
+// runs in the child: a panic on a bad input only takes this item down
+static void convert_item(char *src, char *dst) {
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp.%d", dst, getpid());
+
+	Format format;
+	int height;
+	int width;
+	void *pixels = extract(src, &format, &height, &width);
+	FILE *out = fopen(tmp, "wb");
+	if (out == NULL) _exit(1);
+	write_png(NULL, pixels, width, height, format, out);
+	if (fclose(out) != 0 || rename(tmp, dst) != 0) {
+		unlink(tmp);
+		_exit(1);
+	}
+	_exit(0);
+}
+
+// wait for the child, renewing the lease so nobody else takes the item
+// a child still running after max_leases leases is stuck: it is killed and
+// stuck set, rather than holding the item forever
+// returns false if the child failed or the claim was lost
+static bool supervise(Shard *shard, pid_t child, char *claim, bool *stuck) {
+	int pidfd = syscall(SYS_pidfd_open, child, 0);
+	int heartbeat_ms = shard->lease * 1000 / 3;
+	double deadline = now() + (double) shard->lease * shard->max_leases;
+	bool claimed = true;
+	int status;
+	*stuck = false;
+	for (;;) {
+		if (pidfd >= 0) {
+			struct pollfd pfd = { pidfd, POLLIN, 0 };
+			(void) poll(&pfd, 1, heartbeat_ms > 0 ? heartbeat_ms : 1);
+		} else {
+			usleep(10000);
+		}
+		pid_t got = waitpid(child, &status, WNOHANG);
+		if (got == child) break;
+		if (!*stuck && now() > deadline) {
+			kill(child, SIGKILL);
+			*stuck = true;
+		}
+		// touching a reclaimed item fails, it is someone else's now
+		if (claimed && utimensat(AT_FDCWD, claim, NULL, 0) != 0) claimed = false;
+	}
+	if (pidfd >= 0) close(pidfd);
+	return claimed && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void process(Shard *shard, char *name) {
+	char claim[PATH_MAX];
+	char marker[PATH_MAX];
+	path_in(claim, shard->manifest, "claimed", name);
+	path_in(marker, shard->manifest, "done", name);
+
+	// converted before a crash, only the claim was left behind
+	if (exists(marker)) {
+		unlink(claim);
+		shard->skipped++;
+		return;
+	}
+
+	char src[PATH_MAX];
+	char dst[PATH_MAX];
+	char failed[PATH_MAX];
+	path_in(failed, shard->manifest, "failed", name);
+	if (!read_item(claim, src, dst)) {
+		fprintf(stderr, "%s: malformed item %s\n", shard->name, name);
+		rename(claim, failed);
+		shard->failed++;
+		return;
+	}
+
+	struct stat st;
+	long long size = stat(src, &st) == 0 ? st.st_size : 0;
+
+	double started = now();
+	fflush(NULL);
+	pid_t child = fork();
+	panic_if(child < 0, "Failed to fork converter");
+	if (child == 0) {
+		convert_item(src, dst);
+	}
+	bool stuck;
+	bool ok = supervise(shard, child, claim, &stuck);
+	double elapsed = now() - started;
+	shard->busy += elapsed;
+	if (stuck) {
+		char tmp[PATH_MAX];
+		snprintf(tmp, sizeof(tmp), "%s.tmp.%d", dst, child);
+		unlink(tmp);
+		fprintf(stderr, "%s: killed the converter of %s after %.0f s\n", shard->name, src, elapsed);
+	}
+
+	if (ok) {
+		char line[2 * PATH_MAX + 64];
+		snprintf(line, sizeof(line), "%s\t%s\t%s\t%.3fms\n", src, dst, shard->name, elapsed * 1e3);
+		if (write_atomic(shard, marker, line)) {
+			unlink(claim);
+			shard->done++;
+			shard->bytes_in += size;
+			return;
+		}
+	}
+	fprintf(stderr, "%s: failed to convert %s\n", shard->name, src);
+	// a lost claim already went back to todo/, leave it to its new owner
+	if (rename(claim, failed) == 0) shard->failed++;
+}
+
+// list the entries of a manifest subdirectory
+static int list_items(char *manifest, const char *subdir, char ***names) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", manifest, subdir);
+	DIR *dir = opendir(path);
+	panic_if(dir == NULL, "Failed to read manifest directory");
+
+	int count = 0;
+	int cap = 16;
+	*names = malloc(sizeof(char *) * cap);
+	assert(*names != NULL);
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') continue;
+		if (count == cap) {
+			*names = realloc(*names, sizeof(char *) * (cap *= 2));
+			assert(*names != NULL);
+		}
+		(*names)[count++] = strdup(entry->d_name);
+	}
+	closedir(dir);
+	return count;
+}
+
+static void free_items(char **names, int count) {
+	for (int i = 0; i < count; i++) free(names[i]);
+	free(names);
+}
+
+// put claims nobody renewed in time back in todo/
+// returns how many claims are still live
+static int reclaim_expired(Shard *shard) {
+	char **names;
+	int count = list_items(shard->manifest, "claimed", &names);
+	int live = 0;
+	time_t wall = time(NULL);
+	for (int i = 0; i < count; i++) {
+		char claim[PATH_MAX];
+		char todo[PATH_MAX];
+		struct stat st;
+		path_in(claim, shard->manifest, "claimed", names[i]);
+		if (stat(claim, &st) != 0) continue;
+		if (wall - st.st_mtime <= shard->lease) {
+			live++;
+			continue;
+		}
+		// losing this race to another shard is fine, either way it is back
+		if (rename(claim, path_in(todo, shard->manifest, "todo", names[i])) == 0) {
+			fprintf(stderr, "%s: lease expired on %s, requeued\n", shard->name, names[i]);
+			shard->reclaimed++;
+		}
+	}
+	free_items(names, count);
+	return live;
+}
+
+static void report(Shard *shard, double elapsed) {
+	double mb = shard->bytes_in / 1e6;
+	char line[512];
+	snprintf(line, sizeof(line),
+			"shard %s: %lu converted, %lu failed, %lu already done, %lu requeued; "
+			"%.1f s, %.2f items/s, %.2f MB/s in, %.0f%% busy\n",
+			shard->name, shard->done, shard->failed, shard->skipped, shard->reclaimed,
+			elapsed, elapsed > 0 ? shard->done / elapsed : 0.0, elapsed > 0 ? mb / elapsed : 0.0,
+			elapsed > 0 ? 100 * shard->busy / elapsed : 0.0);
+	fputs(line, stderr);
+
+	char path[PATH_MAX];
+	if (!write_atomic(shard, path_in(path, shard->manifest, "shards", shard->name), line)) {
+		fprintf(stderr, "%s: failed to write shard report\n", shard->name);
+	}
+}
+
+int run_shard(char *manifest, char *shard_name, int lease_seconds, int max_leases) {
+	make_dirs(manifest);
+	Shard shard = { .manifest = manifest, .name = shard_name, .lease = lease_seconds, .max_leases = max_leases };
+	double started = now();
+
+	for (;;) {
+		int live = reclaim_expired(&shard);
+
+		char **names;
+		int count = list_items(manifest, "todo", &names);
+		bool claimed = false;
+		// start somewhere different from other shards to avoid racing on every item
+		int offset = count > 0 ? (getpid() * 2654435761u) % count : 0;
+		for (int i = 0; i < count && !claimed; i++) {
+			char *name = names[(offset + i) % count];
+			char todo[PATH_MAX];
+			char claim[PATH_MAX];
+			// start the lease before the claim is visible, the rename keeps the
+			// mtime and a stale one would let another shard's reclaim requeue it
+			if (utimensat(AT_FDCWD, path_in(todo, manifest, "todo", name), NULL, 0) != 0) continue;
+			// exactly one shard's rename can succeed, the rest see ENOENT
+			if (rename(todo, path_in(claim, manifest, "claimed", name)) == 0) {
+				process(&shard, name);
+				claimed = true;
+			}
+		}
+		free_items(names, count);
+
+		if (!claimed) {
+			// others may still crash on what they hold, stay until it is finished
+			if (live == 0) break;
+			usleep(POLL_MS * 1000);
+		}
+	}
+
+	report(&shard, now() - started);
+	return shard.failed > 0;
+}
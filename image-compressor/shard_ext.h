@@ -0,0 +1,24 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+// batch conversion shared by any number of processes, on one or many hosts,
+// through a manifest directory on a shared filesystem:
+//   todo/     one file per item, "src<TAB>dst", waiting for a shard
+//   claimed/  items being converted; claims are renames out of todo/ and the
+//             file's mtime is the lease, refreshed while the item is worked on
+//   done/     completion markers, an item with one is never converted again
+//   failed/   items whose conversion crashed or failed
+//   shards/   per shard throughput reports
+
+// add src/dst pairs (relative paths are made absolute) to the manifest
+// items already queued, being converted or done are skipped; returns the number added
+extern int enqueue_items(char *manifest, char **pairs, int count);
+
+// claim and convert items until none are left; claims whose lease ran out
+// (a crashed or stuck shard) go back to todo/ for anyone to pick up
+// a converter still running after max_leases leases is killed and its item
+// moved to failed/
+// returns non zero if any item failed
+extern int run_shard(char *manifest, char *shard_name, int lease_seconds, int max_leases);
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <sys/param.h>
+#include <zlib.h>
+
+#include "extract_ext.h"
+#include "filter_ext.h"
+#include "compress_ext.h"
+#include "chunk_ext.h"
+#include "encode_ext.h"
+#include "strip_ext.h"
+
+#include "debug_util.h"
+
+// deflateInit2 with the widest window and the default memLevel, see zconf.h
+#define DEFLATE_STATE_BYTES ((1 << (15 + 2)) + (1 << (8 + 9)))
+// rough malloc bookkeeping per allocation
+#define ALLOC_OVERHEAD 16
+
+static size_t line_bytes(Format format, int width) {
+	// filter type byte plus the serialised scanline
+	return 1 + (format == BW ? (size_t) PACKED_ROW_BYTES(width) : format == GREYSCALE ? (size_t) width : (size_t) width * 3);
+}
+
+size_t estimate_png_memory(Format format, int width, int height) {
+	size_t pixels = row_size(format, width) * height;
+	size_t lines = (line_bytes(format, width) + sizeof(uint8_t *) + ALLOC_OVERHEAD) * height;
+	// incompressible input is where the output buffer grows largest
+	size_t compressed = compressBound(line_bytes(format, width) * height);
+	// deflating: pixels, lines, output and zlib; chunking: pixels, output and its chunk copies
+	return pixels + MAX(lines + compressed + DEFLATE_STATE_BYTES, 2 * compressed);
+}
+
+size_t estimate_strip_memory(Format format, int width, int strip_rows) {
+	size_t row = row_size(format, width);
+	size_t line = line_bytes(format, width);
+	// the reader's raw row, the filter's previous and current scanlines
+	size_t fixed = row + 2 * line + DEFLATE_STATE_BYTES
+		// the pending IDAT, its chunk and the encoded copy
+		+ 3 * (MAX_IDAT_DATA + ALLOC_OVERHEAD)
+		// stdio buffers of the input and output
+		+ 2 * BUFSIZ;
+	return fixed + (row + line) * strip_rows;
+}
+
+static void write_idat(void *ctx, const uint8_t *data, int length) {
+	idat_stream_write(ctx, data, length);
+}
+
+bool convert_in_strips(char *source, char *dest, size_t budget) {
+	Format format;
+	int height;
+	int width;
+	PnmReader *reader = reader_open(source, &format, &height, &width);
+
+	size_t whole = estimate_png_memory(format, width, height);
+	if (whole <= budget) {
+		reader_close(reader);
+		return false;
+	}
+
+	// as many rows as fit, fewer strips only means fewer reads
+	size_t per_row = row_size(format, width) + line_bytes(format, width);
+	size_t fixed = estimate_strip_memory(format, width, 0);
+	panic_if(budget < fixed + per_row, "Memory budget is too small for even one row of the image");
+	int strip_rows = MIN((size_t) height, (budget - fixed) / per_row);
+	fprintf(stderr, "%s: estimated peak %.1f MB is over the %.1f MB budget, converting in strips of %d rows (%.1f MB)\n",
+			source, whole / 1e6, budget / 1e6, strip_rows, estimate_strip_memory(format, width, strip_rows) / 1e6);
+
+	FILE *out = fopen(dest, "wb");
+	panic_if(out == NULL, "Failed to open the output file");
+
+	// the same adaptive filter and deflate stream write_png runs, one row at a time
+	RowFilter *filter = row_filter_create(width, format, FILTER_ADAPTIVE);
+	int line = row_filter_length(filter) + 1;
+	uint8_t *rows = malloc(row_size(format, width) * strip_rows);
+	uint8_t *lines = malloc((size_t) line * strip_rows);
+	assert(rows != NULL && lines != NULL);
+
+	encode_signature(out);
+	Chunk *ihdr = chunk_ihdr(width, height, format);
+	encode_chunk(ihdr, out);
+	free_chunk(ihdr);
+
+	IdatStream *idat = idat_stream_open(out);
+	DeflateStream *ds = deflate_stream_create(NULL, (long) line * height, write_idat, idat);
+	for (int y = 0; y < height; y += strip_rows) {
+		int count = MIN(strip_rows, height - y);
+		reader_rows(reader, rows, count);
+		row_filter_rows(filter, rows, count, lines);
+		for (int i = 0; i < count; i++) {
+			deflate_stream_line(ds, lines + (size_t) i * line, line, y + i == height - 1);
+		}
+	}
+	deflate_stream_free(ds);
+	idat_stream_close(idat);
+
+	Chunk *iend = chunk_iend();
+	encode_chunk(iend, out);
+	free_chunk(iend);
+
+	free(lines);
+	free(rows);
+	row_filter_free(filter);
+	reader_close(reader);
+	panic_if(fclose(out) != 0, "Failed to write the output file");
+	return true;
+}
+
+bool parse_memory_size(char *arg, size_t *bytes) {
+	char *end;
+	unsigned long long value = strtoull(arg, &end, 10);
+	if (end == arg || arg[0] == '-') return false;
+	int shift = 0;
+	switch (*end) {
+		case 'k': case 'K': shift = 10; end++; break;
+		case 'm': case 'M': shift = 20; end++; break;
+		case 'g': case 'G': shift = 30; end++; break;
+	}
+	if (*end != '\0' || value == 0 || value > (SIZE_MAX >> shift)) return false;
+	*bytes = (size_t) value << shift;
+	return true;
+}
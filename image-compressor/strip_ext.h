@@ -0,0 +1,21 @@
+#ifndef STRIP_H
+#define STRIP_H
+
+// heap write_png needs at its peak for an image, from the header alone:
+// the pixels, the filtered lines and the deflated stream, then that stream
+// copied into IDAT chunks
+extern size_t estimate_png_memory(Format format, int width, int height);
+
+// heap a strip conversion holding strip_rows rows at a time needs
+extern size_t estimate_strip_memory(Format format, int width, int strip_rows);
+
+// if converting source the usual way would go over budget bytes, read, filter
+// and deflate it a strip of rows at a time instead, writing the same png
+// byte for byte to dest, and return true
+// false means the whole image fits and nothing was written
+extern bool convert_in_strips(char *source, char *dest, size_t budget);
+
+// a byte count with an optional k, m or g suffix (powers of 1024)
+extern bool parse_memory_size(char *arg, size_t *bytes);
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "extract_ext.h"
+#include "compress_ext.h"
+#include "png_ext.h"
+#include "resize_ext.h"
+#include "thumbnail_ext.h"
+
+#include "debug_util.h"
+
+typedef struct {
+	void *pixels;
+	int width;
+	int height;
+	Format format;
+	char *path;
+	pthread_t thread;
+} Output;
+
+bool parse_sizes(const char *spec, Size **sizes, int *count) {
+	*count = 0;
+	*sizes = NULL;
+	const char *p = spec;
+	while (*p != '\0') {
+		int width;
+		int height;
+		int used;
+		if (sscanf(p, "%dx%d%n", &width, &height, &used) != 2 || width < 0 || height < 0
+				|| (width == 0 && height == 0)) {
+			free(*sizes);
+			return false;
+		}
+		*sizes = realloc(*sizes, sizeof(Size) * (*count + 1));
+		assert(*sizes != NULL);
+		(*sizes)[(*count)++] = (Size) {width, height};
+		p += used;
+		if (*p == ',') p++;
+		else if (*p != '\0') {
+			free(*sizes);
+			return false;
+		}
+	}
+	return *count > 0;
+}
+
+// dest with _WxH inserted before its extension
+static char *sized_path(char *dest, int width, int height) {
+	char *dot = strrchr(dest, '.');
+	size_t stem = dot == NULL ? strlen(dest) : (size_t) (dot - dest);
+	size_t len = strlen(dest) + 32;
+	char *path = malloc(len);
+	assert(path != NULL);
+	snprintf(path, len, "%.*s_%dx%d%s", (int) stem, dest, width, height, dot == NULL ? "" : dot);
+	return path;
+}
+
+static void *encode_output(void *arg) {
+	Output *output = arg;
+	FILE *out = fopen(output->path, "wb");
+	if (out == NULL) {
+		fprintf(stderr, "Failed to open %s\n", output->path);
+		return NULL;
+	}
+	write_png(NULL, output->pixels, output->width, output->height, output->format, out);
+	fclose(out);
+	return NULL;
+}
+
+static void start_output(Output *output) {
+	panic_if(pthread_create(&output->thread, NULL, encode_output, output) != 0,
+			"Failed to start encoder thread");
+}
+
+static int by_area_desc(const void *a, const void *b) {
+	const Output *x = a;
+	const Output *y = b;
+	long area_x = (long) x->width * x->height;
+	long area_y = (long) y->width * y->height;
+	if (area_x != area_y) return (area_y > area_x) - (area_y < area_x);
+	// equal sizes end up next to each other
+	return (y->width > x->width) - (y->width < x->width);
+}
+
+void write_thumbnails(void *pixels, int width, int height, Format format,
+		Size *sizes, int count, ResizeFilter filter, char *dest) {
+	// outputs[0] is the full size image, the rest are built largest first
+	Output *outputs = calloc(count + 1, sizeof(Output));
+	assert(outputs != NULL);
+	outputs[0] = (Output) { .pixels = pixels, .width = width, .height = height, .format = format, .path = dest };
+	start_output(&outputs[0]);
+
+	for (int i = 0; i < count; i++) {
+		Output *o = &outputs[i + 1];
+		o->width = sizes[i].width;
+		o->height = sizes[i].height;
+		if (o->width == 0) o->width = (int) ((long) o->height * width / height);
+		if (o->height == 0) o->height = (int) ((long) o->width * height / width);
+		if (o->width < 1) o->width = 1;
+		if (o->height < 1) o->height = 1;
+	}
+	qsort(outputs + 1, count, sizeof(Output), by_area_desc);
+
+	// sizes that come out the same (50x0 and 50x50 on a square) would race on one path
+	int unique = 0;
+	for (int i = 1; i <= count; i++) {
+		if (unique > 0 && outputs[i].width == outputs[unique].width && outputs[i].height == outputs[unique].height) {
+			continue;
+		}
+		outputs[++unique] = outputs[i];
+	}
+	count = unique;
+
+	for (int i = 1; i <= count; i++) {
+		Output *o = &outputs[i];
+
+		// cascade from the smallest finished image that still covers this size
+		Output *src = &outputs[0];
+		for (int j = i - 1; j >= 1; j--) {
+			if (outputs[j].width >= o->width && outputs[j].height >= o->height) {
+				src = &outputs[j];
+				break;
+			}
+		}
+
+		o->format = src->format;
+		o->pixels = resize(src->pixels, src->width, src->height, &o->format,
+				o->width, o->height, filter);
+		o->path = sized_path(dest, o->width, o->height);
+		start_output(o);
+	}
+
+	// encoders only read their pixels, so nothing is freed until all are done
+	for (int i = 0; i <= count; i++) {
+		pthread_join(outputs[i].thread, NULL);
+	}
+	for (int i = 1; i <= count; i++) {
+		free(outputs[i].pixels);
+		free(outputs[i].path);
+	}
+	free(outputs);
+}
@@ -0,0 +1,18 @@
+#ifndef THUMBNAIL_H
+#define THUMBNAIL_H
+
+typedef struct {
+	int width;
+	int height;
+} Size;
+
+// parse "320x240,160x0,..."; a 0 side keeps the source aspect ratio
+extern bool parse_sizes(const char *spec, Size **sizes, int *count);
+
+// write dest at full size plus one png per target size, named dest_WxH.png
+// smaller sizes are resized from the closest larger result rather than the source,
+// and every output is encoded on its own thread
+extern void write_thumbnails(void *pixels, int width, int height, Format format,
+		Size *sizes, int count, ResizeFilter filter, char *dest);
+
+#endif
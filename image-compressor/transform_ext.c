@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <sys/param.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "extract_ext.h"
+#include "transform_ext.h"
+
+#include "debug_util.h"
+
+// pixels per side of a rotation tile; a source and a destination tile of
+// 3 byte pixels stay in L1 while the tile is copied
+#define TILE 32
+// packed BW tiles: output bytes (8 rows each) by source bytes
+#define BW_TILE_ROWS 64
+#define BW_TILE_BYTES 8
+
+bool parse_rotation(const char *name, Transform *transform) {
+	if (strcmp(name, "90") == 0) {
+		*transform = TRANSFORM_ROTATE_90;
+	} else if (strcmp(name, "180") == 0) {
+		*transform = TRANSFORM_ROTATE_180;
+	} else if (strcmp(name, "270") == 0) {
+		*transform = TRANSFORM_ROTATE_270;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+bool parse_flip(const char *name, Transform *transform) {
+	if (strcmp(name, "h") == 0) {
+		*transform = TRANSFORM_FLIP_H;
+	} else if (strcmp(name, "v") == 0) {
+		*transform = TRANSFORM_FLIP_V;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// 90 degree turns of Pixel images, copied tile by tile so neither the reads
+// nor the strided writes leave the cache between neighbouring pixels
+static void rotate_pixels(const Pixel *src, int width, int height, Pixel *dst, bool clockwise) {
+	for (int by = 0; by < height; by += TILE) {
+		int ey = MIN(by + TILE, height);
+		for (int bx = 0; bx < width; bx += TILE) {
+			int ex = MIN(bx + TILE, width);
+			for (int y = by; y < ey; y++) {
+				const Pixel *row = src + (size_t) y * width;
+				if (clockwise) {
+					for (int x = bx; x < ex; x++) {
+						dst[(size_t) x * height + (height - 1 - y)] = row[x];
+					}
+				} else {
+					for (int x = bx; x < ex; x++) {
+						dst[(size_t) (width - 1 - x) * height + y] = row[x];
+					}
+				}
+			}
+		}
+	}
+}
+
+static void mirror_pixels(const Pixel *src, Pixel *dst, int width) {
+	for (int x = 0; x < width; x++) {
+		dst[x] = src[width - 1 - x];
+	}
+}
+
+// transpose an 8x8 bit matrix held one row per byte, first row in the top byte
+// ref: Hacker's Delight 7-3, transpose8rS64
+static inline uint64_t transpose8(uint64_t x) {
+	uint64_t t;
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+// one 8x8 bit block: 8 source rows, one byte column
+static inline void rotate_bw_block(const uint8_t *src, long src_bytes, int height, int first,
+		long src_step, bool whole, bool clockwise, uint8_t *out, long dst_step, int count) {
+	uint64_t block = 0;
+	if (whole) {
+		const uint8_t *in = src + first * src_bytes;
+		for (int k = 0; k < 8; k++, in += src_step) {
+			block = block << 8 | *in;
+		}
+	} else {
+		for (int k = 0; k < 8; k++) {
+			int y = first + (clockwise ? -k : k);
+			block = block << 8 | (y >= 0 && y < height ? src[y * src_bytes] : 0);
+		}
+	}
+	block = transpose8(block);
+	for (int i = 0; i < count; i++, out += dst_step) {
+		*out = block >> (56 - 8 * i);
+	}
+}
+
+#ifdef __SSE2__
+// 16 source rows by one byte column: the top bit of every lane is one output
+// bit, so movemask peels off a 16 bit output fragment per source column
+static inline void rotate_bw_block16(const uint8_t *in, long src_step, uint8_t *out,
+		long dst_step, int count) {
+	uint8_t lanes[16];
+	// first register row in the top bit of the mask
+	for (int k = 0; k < 16; k++, in += src_step) {
+		lanes[15 - k] = *in;
+	}
+	__m128i v = _mm_loadu_si128((const __m128i *) lanes);
+	for (int i = 0; i < count; i++, out += dst_step) {
+		int bits = _mm_movemask_epi8(v);
+		out[0] = bits >> 8;
+		out[1] = bits;
+		v = _mm_add_epi8(v, v);
+	}
+}
+#endif
+
+// 90 degree turns of packed BW rows, a bit block at a time
+// the output height is padded to whole bytes with virtual blank rows, placed
+// so every block lands on a byte boundary and the blanks become padding bits
+static void rotate_bw(const uint8_t *src, int width, int height, uint8_t *dst, bool clockwise) {
+	long src_bytes = PACKED_ROW_BYTES(width);
+	long dst_bytes = PACKED_ROW_BYTES(height);
+	int padded = dst_bytes * 8;
+	// clockwise the first source row ends up in the last output column
+	int blank = clockwise ? padded - height : 0;
+	// the block's first register row is its last source row when clockwise
+	long src_step = clockwise ? -src_bytes : src_bytes;
+	long dst_step = clockwise ? dst_bytes : -dst_bytes;
+
+	for (int tv = 0; tv < padded; tv += BW_TILE_ROWS) {
+		int ev = MIN(tv + BW_TILE_ROWS, padded);
+		for (int tx = 0; tx < src_bytes; tx += BW_TILE_BYTES) {
+			int ex = MIN(tx + BW_TILE_BYTES, src_bytes);
+			int v = tv;
+			while (v < ev) {
+#ifdef __SSE2__
+				if (v + 16 <= ev && v - blank >= 0 && v + 15 - blank < height) {
+					int col = clockwise ? (padded - 16 - v) / 8 : v / 8;
+					int first = (clockwise ? v + 15 : v) - blank;
+					for (int bx = tx; bx < ex; bx++) {
+						int x = bx * 8;
+						rotate_bw_block16(src + first * src_bytes + bx, src_step,
+								dst + (clockwise ? x : width - 1 - x) * dst_bytes + col, dst_step,
+								MIN(8, width - x));
+					}
+					v += 16;
+					continue;
+				}
+#endif
+				int col = clockwise ? (padded - 8 - v) / 8 : v / 8;
+				int first = (clockwise ? v + 7 : v) - blank;
+				bool whole = v - blank >= 0 && v + 7 - blank < height;
+				for (int bx = tx; bx < ex; bx++) {
+					int x = bx * 8;
+					rotate_bw_block(src + bx, src_bytes, height, first, src_step, whole, clockwise,
+							dst + (clockwise ? x : width - 1 - x) * dst_bytes + col, dst_step,
+							MIN(8, width - x));
+				}
+				v += 8;
+			}
+		}
+	}
+}
+
+static inline uint8_t reverse_bits(uint8_t b) {
+	b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+	b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+	b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+	return b;
+}
+
+// reverse a packed row; the padding bits come out in front, so shift them back out
+static void mirror_bw(const uint8_t *src, uint8_t *dst, int width) {
+	int bytes = PACKED_ROW_BYTES(width);
+	int shift = bytes * 8 - width;
+	for (int i = 0; i < bytes; i++) {
+		dst[i] = reverse_bits(src[bytes - 1 - i]);
+	}
+	if (shift == 0) return;
+	for (int i = 0; i < bytes; i++) {
+		dst[i] = dst[i] << shift | (i + 1 < bytes ? dst[i + 1] >> (8 - shift) : 0);
+	}
+}
+
+void *transform(void *pixels, int *width, int *height, Format format, Transform transform) {
+	int w = *width;
+	int h = *height;
+	size_t stride = row_size(format, w);
+	uint8_t *src = pixels;
+	bool turned = transform == TRANSFORM_ROTATE_90 || transform == TRANSFORM_ROTATE_270;
+	// packed rows of a turned BW image are padded by the old height
+	uint8_t *dst = malloc(turned ? row_size(format, h) * w : stride * h);
+	assert(dst != NULL);
+
+	switch (transform) {
+		case TRANSFORM_ROTATE_90:
+		case TRANSFORM_ROTATE_270: {
+			bool clockwise = transform == TRANSFORM_ROTATE_90;
+			if (format == BW) {
+				rotate_bw(src, w, h, dst, clockwise);
+			} else {
+				rotate_pixels(pixels, w, h, (Pixel *) dst, clockwise);
+			}
+			*width = h;
+			*height = w;
+			break;
+		}
+		case TRANSFORM_ROTATE_180:
+		case TRANSFORM_FLIP_H:
+			for (int y = 0; y < h; y++) {
+				int out = transform == TRANSFORM_ROTATE_180 ? h - 1 - y : y;
+				if (format == BW) {
+					mirror_bw(src + (size_t) y * stride, dst + (size_t) out * stride, w);
+				} else {
+					mirror_pixels((Pixel *) (src + (size_t) y * stride),
+							(Pixel *) (dst + (size_t) out * stride), w);
+				}
+			}
+			break;
+		case TRANSFORM_FLIP_V:
+			for (int y = 0; y < h; y++) {
+				memcpy(dst + (size_t) (h - 1 - y) * stride, src + (size_t) y * stride, stride);
+			}
+			break;
+	}
+	return dst;
+}
@@ -0,0 +1,20 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+typedef enum {
+	TRANSFORM_ROTATE_90,	// clockwise
+	TRANSFORM_ROTATE_180,
+	TRANSFORM_ROTATE_270,
+	TRANSFORM_FLIP_H,	// mirror left to right
+	TRANSFORM_FLIP_V	// mirror top to bottom
+} Transform;
+
+// parse "90", "180" or "270" for --rotate, "h" or "v" for --flip
+extern bool parse_rotation(const char *name, Transform *transform);
+extern bool parse_flip(const char *name, Transform *transform);
+
+// rotate or flip an image in the extract layout (packed rows for BW) into a new buffer
+// width and height are swapped for 90 and 270
+extern void *transform(void *pixels, int *width, int *height, Format format, Transform transform);
+
+#endif
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "extract_ext.h"
+#include "compress_ext.h"
+#include "chunk_ext.h"
+#include "png_ext.h"
+#include "pool_ext.h"
+#include "watch_ext.h"
+
+#include "debug_util.h"
+
+#define LATENCY_SAMPLES 1024
+// files waiting for their writer to finish, per batch that fills the pool
+#define QUEUE_PER_WORKER 4
+#define EVENT_BUFFER 65536
+// spool subdirectory unreadable inputs are moved into, so no restart retries them
+#define FAILED_DIR "failed"
+
+// a file seen in the spool but not yet handed to a worker
+typedef struct {
+	char name[NAME_MAX + 1];
+	double seen;	// first event, when the file appeared
+	double ready_at;	// earliest conversion, valid once closed
+	bool closed;	// a writer closed it or it was renamed in
+} Pending;
+
+typedef struct {
+	char src[PATH_MAX];
+	char dst[PATH_MAX];
+	char tmp[PATH_MAX];
+	char failed[PATH_MAX];
+	double seen;
+	double queued;
+} WatchJob;
+
+typedef struct {
+	pthread_mutex_t lock;
+	unsigned long completed;
+	unsigned long failed;
+	double settle_total;
+	double queue_total;
+	double convert_total;
+	// most recent end to end latencies, in seconds
+	double latencies[LATENCY_SAMPLES];
+	int samples;
+	int next;
+} Stats;
+
+static Stats stats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_signal(int sig) {
+	(void) sig;
+	stopping = 1;
+}
+
+// only names extract understands; temp files and our own outputs never match
+static bool is_input(const char *name) {
+	if (name[0] == '.') return false;
+	char *dot = strrchr(name, '.');
+	return dot != NULL && (strcmp(dot, ".pbm") == 0 || strcmp(dot, ".pgm") == 0 || strcmp(dot, ".ppm") == 0);
+}
+
+static void output_path(char *buf, char *output_dir, const char *name) {
+	int stem = strrchr(name, '.') - name;
+	snprintf(buf, PATH_MAX, "%s/%.*s.png", output_dir, stem, name);
+}
+
+static void *worker_init(void) {
+	return deflater_create();
+}
+
+static void worker_fini(void *state) {
+	deflater_free(state);
+}
+
+static void record(WatchJob *job, double started, double finished, bool ok) {
+	pthread_mutex_lock(&stats.lock);
+	if (ok) {
+		stats.completed++;
+		stats.settle_total += job->queued - job->seen;
+		stats.queue_total += started - job->queued;
+		stats.convert_total += finished - started;
+		stats.latencies[stats.next] = finished - job->seen;
+		stats.next = (stats.next + 1) % LATENCY_SAMPLES;
+		if (stats.samples < LATENCY_SAMPLES) stats.samples++;
+	} else {
+		stats.failed++;
+	}
+	pthread_mutex_unlock(&stats.lock);
+}
+
+// move a malformed input out of the spool, creating the directory on first use
+static void move_aside(WatchJob *job) {
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%.*s", (int) (strrchr(job->failed, '/') - job->failed), job->failed);
+	if ((mkdir(dir, 0777) != 0 && errno != EEXIST) || rename(job->src, job->failed) != 0) {
+		fprintf(stderr, "%s: failed to move aside: %s\n", job->src, strerror(errno));
+	}
+}
+
+static void convert(void *arg, void *state) {
+	WatchJob *job = arg;
+	Deflater *deflater = state;
+	double started = now();
+
+	FILE *src = fopen(job->src, "rb");
+	if (src == NULL) {
+		// deleted or renamed away before we got to it
+		fprintf(stderr, "%s: %s\n", job->src, strerror(errno));
+		record(job, started, now(), false);
+		free(job);
+		return;
+	}
+	FILE *out = fopen(job->tmp, "wb");
+	if (out == NULL) {
+		fprintf(stderr, "%s: %s\n", job->tmp, strerror(errno));
+		fclose(src);
+		record(job, started, now(), false);
+		free(job);
+		return;
+	}
+
+	Format format;
+	int height;
+	int width;
+	const char *error;
+	// closes src, also when the input turns out to be malformed
+	void *pixels = try_extract_file(src, job->src, &format, &height, &width, &error);
+	if (pixels == NULL) {
+		fclose(out);
+		unlink(job->tmp);
+		fprintf(stderr, "%s: %s, moved to %s\n", job->src, error, job->failed);
+		move_aside(job);
+		record(job, started, now(), false);
+		free(job);
+		return;
+	}
+	write_png(deflater, pixels, width, height, format, out);
+	free(pixels);
+	bool ok = fclose(out) == 0 && rename(job->tmp, job->dst) == 0;
+	double finished = now();
+	record(job, started, finished, ok);
+
+	if (ok) {
+		fprintf(stderr, "%s: %dx%d ready %.1fms after it appeared "
+				"(settling %.1fms, queued %.1fms, converting %.1fms)\n",
+				job->dst, width, height, (finished - job->seen) * 1e3, (job->queued - job->seen) * 1e3,
+				(started - job->queued) * 1e3, (finished - started) * 1e3);
+	} else {
+		fprintf(stderr, "%s: failed to write output: %s\n", job->dst, strerror(errno));
+		unlink(job->tmp);
+	}
+	free(job);
+}
+
+static Pending *find(Pending *pending, int count, const char *name) {
+	for (int i = 0; i < count; i++) {
+		if (strcmp(pending[i].name, name) == 0) return &pending[i];
+	}
+	return NULL;
+}
+
+static Pending *add(Pending **pending, int *count, int *cap, const char *name, double t) {
+	Pending *entry = find(*pending, *count, name);
+	if (entry != NULL) return entry;
+	if (*count == *cap) {
+		*pending = realloc(*pending, sizeof(Pending) * (*cap *= 2));
+		assert(*pending != NULL);
+	}
+	entry = &(*pending)[(*count)++];
+	snprintf(entry->name, sizeof(entry->name), "%s", name);
+	entry->seen = t;
+	entry->closed = false;
+	entry->ready_at = 0;
+	return entry;
+}
+
+static void drop(Pending *pending, int *count, Pending *entry) {
+	*entry = pending[--*count];
+}
+
+// pick up files that were already there, or that arrived while events were lost
+static void scan(char *spool, char *output_dir, Pending **pending, int *count, int *cap, int debounce_ms) {
+	DIR *dir = opendir(spool);
+	panic_if(dir == NULL, "Failed to read spool directory");
+	double t = now();
+	time_t wall = time(NULL);
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (!is_input(entry->d_name)) continue;
+		char path[PATH_MAX];
+		char dst[PATH_MAX];
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", spool, entry->d_name);
+		output_path(dst, output_dir, entry->d_name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+		struct stat out_st;
+		if (stat(dst, &out_st) == 0 && out_st.st_mtime >= st.st_mtime) continue;
+
+		Pending *p = add(pending, count, cap, entry->d_name, t);
+		p->closed = true;
+		// we can't know if a writer still has it open, so recent files settle first
+		p->ready_at = wall - st.st_mtime > 1 ? t : t + debounce_ms / 1e3;
+	}
+	closedir(dir);
+}
+
+static void on_event(struct inotify_event *event, Pending **pending, int *count, int *cap, int debounce_ms) {
+	if (event->len == 0 || !is_input(event->name)) return;
+	double t = now();
+
+	if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		Pending *p = find(*pending, *count, event->name);
+		if (p != NULL) drop(*pending, count, p);
+		return;
+	}
+
+	Pending *p = add(pending, count, cap, event->name, t);
+	if (event->mask & IN_MOVED_TO) {
+		// renamed in whole, nothing more will be written
+		p->closed = true;
+		p->ready_at = t;
+	} else if (event->mask & IN_CLOSE_WRITE) {
+		// writers that close and reopen to append push this back
+		p->closed = true;
+		p->ready_at = t + debounce_ms / 1e3;
+	} else {
+		p->closed = false;
+	}
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static void summarise(double elapsed) {
+	double sorted[LATENCY_SAMPLES];
+	int samples = stats.samples;
+	memcpy(sorted, stats.latencies, sizeof(double) * samples);
+	qsort(sorted, samples, sizeof(double), compare_doubles);
+	double n = stats.completed > 0 ? stats.completed : 1;
+
+	fprintf(stderr, "watched %.1f s: %lu converted, %lu failed\n", elapsed, stats.completed, stats.failed);
+	if (samples == 0) return;
+	fprintf(stderr, "latency p50=%.1fms p90=%.1fms p99=%.1fms max=%.1fms; "
+			"mean settling %.1fms, queued %.1fms, converting %.1fms\n",
+			sorted[samples * 50 / 100] * 1e3, sorted[samples * 90 / 100] * 1e3,
+			sorted[samples * 99 / 100] * 1e3, sorted[samples - 1] * 1e3,
+			stats.settle_total / n * 1e3, stats.queue_total / n * 1e3, stats.convert_total / n * 1e3);
+}
+
+int run_watch(char *spool, char *output_dir, int workers, int debounce_ms) {
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		perror("inotify_init1");
+		return 1;
+	}
+	// watch before scanning so nothing falls between the two
+	if (inotify_add_watch(fd, spool, IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO
+			| IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR) < 0) {
+		perror(spool);
+		close(fd);
+		return 1;
+	}
+
+	// no SA_RESTART, so poll returns when we are asked to stop
+	struct sigaction sa = {0};
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// warm everything a first file would otherwise pay for
+	make_crc_table();
+	Pool *pool = pool_create(workers, workers * QUEUE_PER_WORKER, worker_init, worker_fini);
+	double started = now();
+
+	int count = 0;
+	int cap = 16;
+	Pending *pending = malloc(sizeof(Pending) * cap);
+	assert(pending != NULL);
+	scan(spool, output_dir, &pending, &count, &cap, debounce_ms);
+
+	fprintf(stderr, "watching %s with %d workers\n", spool, workers);
+	unsigned long sequence = 0;
+	char *buf = malloc(EVENT_BUFFER);
+	assert(buf != NULL);
+	while (!stopping) {
+		// hand over whatever has settled, and sleep until the next one will have
+		double t = now();
+		double next = -1;
+		for (int i = 0; i < count;) {
+			Pending *p = &pending[i];
+			if (!p->closed) {
+				i++;
+				continue;
+			}
+			if (p->ready_at > t) {
+				if (next < 0 || p->ready_at < next) next = p->ready_at;
+				i++;
+				continue;
+			}
+			WatchJob *job = malloc(sizeof(WatchJob));
+			assert(job != NULL);
+			snprintf(job->src, sizeof(job->src), "%s/%s", spool, p->name);
+			output_path(job->dst, output_dir, p->name);
+			snprintf(job->tmp, sizeof(job->tmp), "%s/.%s.%lu.tmp", output_dir, p->name, sequence++);
+			snprintf(job->failed, sizeof(job->failed), "%s/%s/%s", spool, FAILED_DIR, p->name);
+			job->seen = p->seen;
+			job->queued = t;
+			drop(pending, &count, p);
+			pool_submit(pool, convert, job);
+		}
+
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int timeout = next < 0 ? -1 : (int) ((next - now()) * 1e3) + 1;
+		if (poll(&pfd, 1, timeout > 0 || next < 0 ? timeout : 0) <= 0) continue;
+
+		ssize_t len;
+		while ((len = read(fd, buf, EVENT_BUFFER)) > 0) {
+			for (char *p = buf; p < buf + len;) {
+				struct inotify_event *event = (struct inotify_event *) p;
+				if (event->mask & IN_Q_OVERFLOW) {
+					fprintf(stderr, "inotify queue overflowed, rescanning %s\n", spool);
+					scan(spool, output_dir, &pending, &count, &cap, debounce_ms);
+				} else if (event->mask & IN_IGNORED) {
+					fprintf(stderr, "%s is no longer watched\n", spool);
+					stopping = 1;
+				} else {
+					on_event(event, &pending, &count, &cap, debounce_ms);
+				}
+				p += sizeof(struct inotify_event) + event->len;
+			}
+		}
+	}
+
+	// convert what was already handed over, files still settling are left for next time
+	pool_destroy(pool);
+	summarise(now() - started);
+	free(buf);
+	free(pending);
+	close(fd);
+	return stats.failed > 0;
+}
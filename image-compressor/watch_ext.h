@@ -0,0 +1,15 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+// convert every PNM that lands in spool into output_dir/<name>.png until SIGINT/SIGTERM
+// files are picked up by inotify: a rename into spool is complete and converted at
+// once, a file written in place waits until it has been closed and left alone for
+// debounce_ms; outputs appear atomically through a temp file and rename
+// files already waiting in spool when the watch starts are converted too
+// inputs that turn out to be malformed or truncated are counted as failed and
+// moved into spool/failed/ while the watch carries on
+// latency from a file appearing to its PNG being in place is printed per file
+// and summarised on exit
+extern int run_watch(char *spool, char *output_dir, int workers, int debounce_ms);
+
+#endif
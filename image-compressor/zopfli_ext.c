@@ -0,0 +1,1215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <zlib.h>
+
+#include "zopfli_ext.h"
+
+#include "debug_util.h"
+
+#define WINDOW_SIZE 32768
+#define WINDOW_MASK (WINDOW_SIZE - 1)
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define HASH_BITS 16
+#define HASH_SIZE (1 << HASH_BITS)
+// candidates looked at per position by the optimal parse, and by the quick
+// lazy parse block splitting is judged on
+#define MAX_CHAIN 8192
+#define SPLIT_CHAIN 256
+// match lengths at which the shortest distance changes, kept per position
+#define CACHE_LENGTH 8
+// block splitting looks at this much input at a time, making at most this many blocks of it
+#define SEGMENT_SIZE 1000000
+#define MAX_SEGMENT_BLOCKS 15
+// ranges shorter than this are searched exhaustively for the best split
+#define LINEAR_SPLIT_SEARCH 1024
+#define SPLIT_SAMPLES 9
+#define MAX_STORED_BLOCK 65535
+
+#define NUM_LL 288
+#define NUM_D 32
+#define NUM_CL 19
+#define END_OF_BLOCK 256
+#define MAX_BITS 15
+#define MAX_CL_BITS 7
+#define LARGE_COST 1e30
+
+static const int length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115,
+	131, 163, 195, 227, 258
+};
+static const int length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const int dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537,
+	2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const int dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+// order the code length code lengths are sent in
+static const int cl_order[NUM_CL] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// length symbol (less 257) of every match length
+static uint8_t length_symbols[MAX_MATCH + 1];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void build_tables(void) {
+	int s = 0;
+	for (int l = MIN_MATCH; l <= MAX_MATCH; l++) {
+		while (s < 28 && length_base[s + 1] <= l) s++;
+		length_symbols[l] = s;
+	}
+}
+
+static inline int dist_symbol(int dist) {
+	if (dist <= 4) return dist - 1;
+	int l = 31 - __builtin_clz(dist - 1);
+	return l * 2 + ((dist - 1) >> (l - 1) & 1);
+}
+
+// ---- LZ77 parses
+
+// a parse of part of the input: literals (dist 0) and matches
+typedef struct {
+	uint16_t *litlen;	// literal byte or match length
+	uint16_t *dist;
+	size_t *pos;	// input offset of each item
+	size_t size;
+	size_t cap;
+} Store;
+
+static void store_add(Store *s, int litlen, int dist, size_t pos) {
+	if (s->size == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 1024;
+		s->litlen = realloc(s->litlen, sizeof(uint16_t) * s->cap);
+		s->dist = realloc(s->dist, sizeof(uint16_t) * s->cap);
+		s->pos = realloc(s->pos, sizeof(size_t) * s->cap);
+		assert(s->litlen != NULL && s->dist != NULL && s->pos != NULL);
+	}
+	s->litlen[s->size] = litlen;
+	s->dist[s->size] = dist;
+	s->pos[s->size] = pos;
+	s->size++;
+}
+
+static void store_copy(Store *dst, const Store *src) {
+	dst->size = 0;
+	for (size_t i = 0; i < src->size; i++) {
+		store_add(dst, src->litlen[i], src->dist[i], src->pos[i]);
+	}
+}
+
+static void store_free(Store *s) {
+	free(s->litlen);
+	free(s->dist);
+	free(s->pos);
+	memset(s, 0, sizeof(Store));
+}
+
+// input bytes covered by items [from, to)
+static size_t store_bytes(const Store *s, size_t from, size_t to) {
+	if (to <= from) return 0;
+	size_t last = to - 1;
+	return s->pos[last] + (s->dist[last] ? s->litlen[last] : 1) - s->pos[from];
+}
+
+typedef struct {
+	size_t ll[NUM_LL];
+	size_t d[NUM_D];
+} Counts;
+
+static void count_symbols(const Store *s, size_t from, size_t to, Counts *c) {
+	memset(c, 0, sizeof(Counts));
+	for (size_t i = from; i < to; i++) {
+		if (s->dist[i] == 0) {
+			c->ll[s->litlen[i]]++;
+		} else {
+			c->ll[257 + length_symbols[s->litlen[i]]]++;
+			c->d[dist_symbol(s->dist[i])]++;
+		}
+	}
+	c->ll[END_OF_BLOCK] = 1;
+}
+
+// ---- Huffman codes
+
+typedef struct {
+	size_t weight;
+	int symbol;	// leaves only, -1 for packages
+	int left;
+	int right;
+} PmNode;
+
+static int compare_leaves(const void *a, const void *b) {
+	const PmNode *x = a;
+	const PmNode *y = b;
+	if (x->weight != y->weight) return x->weight < y->weight ? -1 : 1;
+	return x->symbol - y->symbol;
+}
+
+static void count_depths(const PmNode *nodes, int node, unsigned *lengths) {
+	if (nodes[node].symbol >= 0) {
+		lengths[nodes[node].symbol]++;
+		return;
+	}
+	count_depths(nodes, nodes[node].left, lengths);
+	count_depths(nodes, nodes[node].right, lengths);
+}
+
+// optimal code lengths of at most max_bits for every symbol with a non zero count
+// (package-merge: the 2n - 2 cheapest items after max_bits - 1 rounds of pairing)
+static void bit_lengths(const size_t *counts, int n, int max_bits, unsigned *lengths) {
+	PmNode nodes[NUM_LL * (MAX_BITS + 1)];
+	int lists[2][2 * NUM_LL];
+	memset(lengths, 0, sizeof(unsigned) * n);
+
+	int leaves = 0;
+	for (int i = 0; i < n; i++) {
+		if (counts[i] > 0) nodes[leaves++] = (PmNode) { counts[i], i, -1, -1 };
+	}
+	if (leaves == 0) return;
+	if (leaves == 1) {
+		lengths[nodes[0].symbol] = 1;
+		return;
+	}
+	assert(leaves <= (1 << max_bits));
+	qsort(nodes, leaves, sizeof(PmNode), compare_leaves);
+
+	int used = leaves;
+	int *cur = lists[0];
+	int *next = lists[1];
+	int len = leaves;
+	for (int i = 0; i < leaves; i++) cur[i] = i;
+
+	for (int level = 1; level < max_bits; level++) {
+		// pair up the current list and merge the pairs with the leaves
+		int packages = len / 2;
+		int first = used;
+		for (int i = 0; i < packages; i++) {
+			nodes[used++] = (PmNode) { nodes[cur[2 * i]].weight + nodes[cur[2 * i + 1]].weight,
+				-1, cur[2 * i], cur[2 * i + 1] };
+		}
+		int li = 0;
+		int pi = 0;
+		int out = 0;
+		while (li < leaves || pi < packages) {
+			if (pi == packages || (li < leaves && nodes[li].weight <= nodes[first + pi].weight)) {
+				next[out++] = li++;
+			} else {
+				next[out++] = first + pi++;
+			}
+		}
+		int *swap = cur;
+		cur = next;
+		next = swap;
+		len = out;
+	}
+	for (int i = 0; i < 2 * leaves - 2; i++) {
+		count_depths(nodes, cur[i], lengths);
+	}
+}
+
+// canonical codes for a set of code lengths
+static void lengths_to_codes(const unsigned *lengths, int n, unsigned *codes) {
+	unsigned bl_count[MAX_BITS + 1] = {0};
+	unsigned next_code[MAX_BITS + 1];
+	for (int i = 0; i < n; i++) bl_count[lengths[i]]++;
+	bl_count[0] = 0;
+	unsigned code = 0;
+	for (int bits = 1; bits <= MAX_BITS; bits++) {
+		code = (code + bl_count[bits - 1]) << 1;
+		next_code[bits] = code;
+	}
+	for (int i = 0; i < n; i++) {
+		codes[i] = lengths[i] ? next_code[lengths[i]]++ : 0;
+	}
+}
+
+// some decoders reject distance codes with fewer than two symbols
+static void patch_distance_codes(unsigned *d_lengths) {
+	int used = 0;
+	for (int i = 0; i < 30; i++) {
+		if (d_lengths[i] && ++used >= 2) return;
+	}
+	if (used == 0) {
+		d_lengths[0] = d_lengths[1] = 1;
+	} else {
+		d_lengths[d_lengths[0] ? 1 : 0] = 1;
+	}
+}
+
+// even out counts so the code lengths come in runs the tree header can repeat
+// (OptimizeHuffmanForRle, as in Zopfli and Brotli)
+static void smooth_for_rle(int length, size_t *counts) {
+	// trailing zeros stay, the header trims them for free
+	while (length > 0 && counts[length - 1] == 0) length--;
+	if (length == 0) return;
+
+	// runs that already encode well: 5+ zeros, 7+ of one non zero count
+	bool good[NUM_LL] = {false};
+	size_t symbol = counts[0];
+	int stride = 0;
+	for (int i = 0; i <= length; i++) {
+		if (i == length || counts[i] != symbol) {
+			if ((symbol == 0 && stride >= 5) || (symbol != 0 && stride >= 7)) {
+				for (int k = 0; k < stride; k++) good[i - k - 1] = true;
+			}
+			stride = 1;
+			if (i != length) symbol = counts[i];
+		} else {
+			stride++;
+		}
+	}
+
+	// collapse strides of similar counts to their average
+	stride = 0;
+	size_t limit = counts[0];
+	size_t sum = 0;
+	for (int i = 0; i <= length; i++) {
+		if (i == length || good[i] || (counts[i] > limit ? counts[i] - limit : limit - counts[i]) >= 4) {
+			if (stride >= 4 || (stride >= 3 && sum == 0)) {
+				size_t count = (sum + stride / 2) / stride;
+				if (count < 1) count = 1;
+				// an all zero stride stays zero
+				if (sum == 0) count = 0;
+				for (int k = 0; k < stride; k++) counts[i - k - 1] = count;
+			}
+			stride = 0;
+			sum = 0;
+			if (i < length - 3) {
+				limit = (counts[i] + counts[i + 1] + counts[i + 2] + counts[i + 3] + 2) / 4;
+			} else if (i < length) {
+				limit = counts[i];
+			} else {
+				limit = 0;
+			}
+		}
+		stride++;
+		if (i != length) sum += counts[i];
+	}
+}
+
+// ---- bit output
+
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	size_t cap;
+	int bit;	// next bit in the last byte, 0 starts a new byte
+} Bits;
+
+static void add_bit(Bits *out, int bit) {
+	if (out->bit == 0) {
+		if (out->size == out->cap) {
+			out->cap = out->cap ? out->cap * 2 : 4096;
+			out->data = realloc(out->data, out->cap);
+			assert(out->data != NULL);
+		}
+		out->data[out->size++] = 0;
+	}
+	out->data[out->size - 1] |= bit << out->bit;
+	out->bit = (out->bit + 1) & 7;
+}
+
+static void add_bits(Bits *out, unsigned value, int count) {
+	for (int i = 0; i < count; i++) add_bit(out, (value >> i) & 1);
+}
+
+// Huffman codes go out most significant bit first
+static void add_code(Bits *out, unsigned code, int length) {
+	for (int i = length - 1; i >= 0; i--) add_bit(out, (code >> i) & 1);
+}
+
+static void add_byte(Bits *out, uint8_t byte) {
+	out->bit = 0;
+	add_bits(out, byte, 8);
+}
+
+// run length encode the code lengths of both trees; out may be NULL to only size it
+// returns the header size in bits
+static size_t encode_tree(const unsigned *ll_lengths, const unsigned *d_lengths,
+		bool use_16, bool use_17, bool use_18, Bits *out) {
+	int hlit = 29;
+	int hdist = 29;
+	while (hlit > 0 && ll_lengths[257 + hlit - 1] == 0) hlit--;
+	while (hdist > 0 && d_lengths[1 + hdist - 1] == 0) hdist--;
+	int hlit2 = hlit + 257;
+	int total = hlit2 + hdist + 1;
+
+	unsigned all[NUM_LL + NUM_D];
+	for (int i = 0; i < total; i++) {
+		all[i] = i < hlit2 ? ll_lengths[i] : d_lengths[i - hlit2];
+	}
+
+	// symbols of the code length alphabet, and their extra bits
+	uint8_t rle[NUM_LL + NUM_D];
+	uint8_t rle_bits[NUM_LL + NUM_D];
+	int rle_size = 0;
+	size_t cl_counts[NUM_CL] = {0};
+
+	for (int i = 0; i < total; i++) {
+		unsigned symbol = all[i];
+		int count = 1;
+		if (use_16 || (symbol == 0 && (use_17 || use_18))) {
+			while (i + count < total && all[i + count] == symbol) count++;
+		}
+		i += count - 1;
+
+		if (symbol == 0 && count >= 3) {
+			while (use_18 && count >= 11) {
+				int run = MIN(count, 138);
+				rle[rle_size] = 18;
+				rle_bits[rle_size++] = run - 11;
+				cl_counts[18]++;
+				count -= run;
+			}
+			while (use_17 && count >= 3) {
+				int run = MIN(count, 10);
+				rle[rle_size] = 17;
+				rle_bits[rle_size++] = run - 3;
+				cl_counts[17]++;
+				count -= run;
+			}
+		}
+		if (use_16 && count >= 4) {
+			// the first one is sent as is
+			count--;
+			rle[rle_size] = symbol;
+			rle_bits[rle_size++] = 0;
+			cl_counts[symbol]++;
+			while (count >= 3) {
+				int run = MIN(count, 6);
+				rle[rle_size] = 16;
+				rle_bits[rle_size++] = run - 3;
+				cl_counts[16]++;
+				count -= run;
+			}
+		}
+		cl_counts[symbol] += count;
+		while (count-- > 0) {
+			rle[rle_size] = symbol;
+			rle_bits[rle_size++] = 0;
+		}
+	}
+
+	unsigned cl_lengths[NUM_CL];
+	bit_lengths(cl_counts, NUM_CL, MAX_CL_BITS, cl_lengths);
+	// a lone code length symbol would make an incomplete code, which inflate refuses
+	int cl_used = 0;
+	for (int i = 0; i < NUM_CL; i++) cl_used += cl_lengths[i] != 0;
+	if (cl_used == 1) cl_lengths[cl_lengths[0] ? 1 : 0] = 1;
+
+	int hclen = 15;
+	while (hclen > 0 && cl_lengths[cl_order[hclen + 4 - 1]] == 0) hclen--;
+
+	if (out != NULL) {
+		unsigned cl_codes[NUM_CL];
+		lengths_to_codes(cl_lengths, NUM_CL, cl_codes);
+		add_bits(out, hlit, 5);
+		add_bits(out, hdist, 5);
+		add_bits(out, hclen, 4);
+		for (int i = 0; i < hclen + 4; i++) add_bits(out, cl_lengths[cl_order[i]], 3);
+		for (int i = 0; i < rle_size; i++) {
+			add_code(out, cl_codes[rle[i]], cl_lengths[rle[i]]);
+			if (rle[i] == 16) add_bits(out, rle_bits[i], 2);
+			else if (rle[i] == 17) add_bits(out, rle_bits[i], 3);
+			else if (rle[i] == 18) add_bits(out, rle_bits[i], 7);
+		}
+	}
+
+	size_t size = 14 + (hclen + 4) * 3;
+	for (int i = 0; i < NUM_CL; i++) size += cl_lengths[i] * cl_counts[i];
+	size += cl_counts[16] * 2 + cl_counts[17] * 3 + cl_counts[18] * 7;
+	return size;
+}
+
+// cheapest of the eight ways to use repeat codes in the header
+static size_t tree_size(const unsigned *ll_lengths, const unsigned *d_lengths, int *variant) {
+	size_t best = SIZE_MAX;
+	for (int i = 0; i < 8; i++) {
+		size_t size = encode_tree(ll_lengths, d_lengths, i & 1, i & 2, i & 4, NULL);
+		if (size < best) {
+			best = size;
+			if (variant != NULL) *variant = i;
+		}
+	}
+	return best;
+}
+
+static size_t data_size(const Counts *c, const unsigned *ll_lengths, const unsigned *d_lengths) {
+	size_t size = 0;
+	for (int i = 0; i < 286; i++) {
+		size += c->ll[i] * (ll_lengths[i] + (i > END_OF_BLOCK ? length_extra[i - 257] : 0));
+	}
+	for (int i = 0; i < 30; i++) {
+		size += c->d[i] * (d_lengths[i] + dist_extra[i]);
+	}
+	return size;
+}
+
+// dynamic block size in bits, with the code lengths it would use
+static size_t dynamic_block_bits(const Counts *c, unsigned *ll_lengths, unsigned *d_lengths) {
+	bit_lengths(c->ll, NUM_LL, MAX_BITS, ll_lengths);
+	bit_lengths(c->d, NUM_D, MAX_BITS, d_lengths);
+	patch_distance_codes(d_lengths);
+	size_t plain = tree_size(ll_lengths, d_lengths, NULL) + data_size(c, ll_lengths, d_lengths);
+
+	Counts smooth = *c;
+	smooth_for_rle(NUM_LL, smooth.ll);
+	smooth_for_rle(NUM_D, smooth.d);
+	unsigned ll2[NUM_LL];
+	unsigned d2[NUM_D];
+	bit_lengths(smooth.ll, NUM_LL, MAX_BITS, ll2);
+	bit_lengths(smooth.d, NUM_D, MAX_BITS, d2);
+	patch_distance_codes(d2);
+	size_t smoothed = tree_size(ll2, d2, NULL) + data_size(c, ll2, d2);
+
+	if (smoothed < plain) {
+		memcpy(ll_lengths, ll2, sizeof(ll2));
+		memcpy(d_lengths, d2, sizeof(d2));
+		return 3 + smoothed;
+	}
+	return 3 + plain;
+}
+
+static void fixed_lengths(unsigned *ll_lengths, unsigned *d_lengths) {
+	for (int i = 0; i < NUM_LL; i++) {
+		ll_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+	}
+	for (int i = 0; i < NUM_D; i++) d_lengths[i] = 5;
+}
+
+static size_t fixed_block_bits(const Counts *c) {
+	unsigned ll_lengths[NUM_LL];
+	unsigned d_lengths[NUM_D];
+	fixed_lengths(ll_lengths, d_lengths);
+	return 3 + data_size(c, ll_lengths, d_lengths);
+}
+
+static size_t stored_block_bits(size_t bytes) {
+	size_t blocks = (bytes + MAX_STORED_BLOCK - 1) / MAX_STORED_BLOCK;
+	return MAX(blocks, 1) * 5 * 8 + bytes * 8;
+}
+
+// smallest block that could hold items [from, to)
+static size_t block_cost(const Store *s, size_t from, size_t to) {
+	Counts c;
+	count_symbols(s, from, to, &c);
+	unsigned ll_lengths[NUM_LL];
+	unsigned d_lengths[NUM_D];
+	size_t dynamic = dynamic_block_bits(&c, ll_lengths, d_lengths);
+	return MIN(MIN(dynamic, fixed_block_bits(&c)), stored_block_bits(store_bytes(s, from, to)));
+}
+
+// ---- match finding
+
+typedef struct {
+	const uint8_t *data;
+	size_t base;	// first byte the hash covers, a window before the block
+	size_t end;	// matches never reach past this
+	size_t next;	// next position to insert
+	int32_t head[HASH_SIZE];
+	int32_t prev[WINDOW_SIZE];
+	// run of identical bytes from each position, by offset from base
+	uint16_t *same;
+} Hash;
+
+static inline uint32_t hash3(const uint8_t *p) {
+	return ((uint32_t) p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u >> (32 - HASH_BITS);
+}
+
+static Hash *hash_create(const uint8_t *data, size_t base, size_t end) {
+	Hash *h = malloc(sizeof(Hash));
+	assert(h != NULL);
+	h->data = data;
+	h->base = base;
+	h->end = end;
+	h->next = base;
+	memset(h->head, 0xFF, sizeof(h->head));
+	size_t n = end - base;
+	h->same = malloc(sizeof(uint16_t) * (n + 1));
+	assert(h->same != NULL);
+	h->same[n] = 0;
+	for (size_t i = n; i-- > 0;) {
+		bool run = i + 1 < n && data[base + i] == data[base + i + 1];
+		h->same[i] = run && h->same[i + 1] < UINT16_MAX ? h->same[i + 1] + 1 : 1;
+	}
+	return h;
+}
+
+static void hash_free(Hash *h) {
+	free(h->same);
+	free(h);
+}
+
+// insert every position before pos
+static void hash_advance(Hash *h, size_t pos) {
+	for (; h->next < pos; h->next++) {
+		if (h->next + MIN_MATCH > h->end) continue;
+		int32_t r = h->next - h->base;
+		uint32_t v = hash3(h->data + h->next);
+		h->prev[r & WINDOW_MASK] = h->head[v];
+		h->head[v] = r;
+	}
+}
+
+// longest match at pos, up to max_len; every time a longer match turns up its
+// length and distance are appended to lens/dists (if given), so lengths up to
+// lens[i] are reachable at dists[i], the shortest distance for them
+static int find_match(Hash *h, size_t pos, int max_len, int chain, int *dist,
+		uint16_t *lens, uint16_t *dists, int *found) {
+	hash_advance(h, pos);
+	*dist = 0;
+	if (found != NULL) *found = 0;
+	if (max_len < MIN_MATCH) return 0;
+
+	const uint8_t *p = h->data + pos;
+	int32_t r = pos - h->base;
+	int32_t cand = h->head[hash3(p)];
+	int best = MIN_MATCH - 1;
+	int same_here = h->same[r];
+	while (cand >= 0 && chain-- > 0) {
+		int d = r - cand;
+		if (d > WINDOW_SIZE) break;
+		const uint8_t *q = h->data + h->base + cand;
+		if (q[best] == p[best]) {
+			int len = 0;
+			// two runs of the same byte match for as long as the shorter one
+			if (*q == *p) len = MIN(MIN(same_here, h->same[cand]), max_len);
+			while (len < max_len && q[len] == p[len]) len++;
+			if (len > best) {
+				best = len;
+				*dist = d;
+				if (found != NULL) {
+					lens[*found] = len;
+					dists[*found] = d;
+					(*found)++;
+				}
+				if (len == max_len) break;
+			}
+		}
+		cand = h->prev[cand & WINDOW_MASK];
+	}
+	return best >= MIN_MATCH ? best : 0;
+}
+
+// the matches at every position of a block, found once and reused by every pass
+typedef struct {
+	size_t start;
+	uint8_t *count;
+	uint16_t *lens;	// CACHE_LENGTH per position, ascending
+	uint16_t *dists;
+} MatchCache;
+
+static void cache_build(MatchCache *cache, Hash *h, size_t start, size_t end) {
+	size_t n = end - start;
+	cache->start = start;
+	cache->count = malloc(n);
+	cache->lens = malloc(sizeof(uint16_t) * CACHE_LENGTH * n);
+	cache->dists = malloc(sizeof(uint16_t) * CACHE_LENGTH * n);
+	assert(cache->count != NULL && cache->lens != NULL && cache->dists != NULL);
+
+	uint16_t lens[MAX_MATCH];
+	uint16_t dists[MAX_MATCH];
+	for (size_t i = 0; i < n; i++) {
+		size_t pos = start + i;
+		int dist;
+		int found;
+		find_match(h, pos, MIN(MAX_MATCH, end - pos), MAX_CHAIN, &dist, lens, dists, &found);
+		// past CACHE_LENGTH the longest lengths stay; a shorter length then uses
+		// the distance of a longer match, which is valid if not always shortest
+		int skip = MAX(found - CACHE_LENGTH, 0);
+		cache->count[i] = found - skip;
+		memcpy(cache->lens + i * CACHE_LENGTH, lens + skip, sizeof(uint16_t) * (found - skip));
+		memcpy(cache->dists + i * CACHE_LENGTH, dists + skip, sizeof(uint16_t) * (found - skip));
+	}
+}
+
+static void cache_free(MatchCache *cache) {
+	free(cache->count);
+	free(cache->lens);
+	free(cache->dists);
+}
+
+// the distance the cache has for a match of len at pos, 0 if it has none
+static int cache_dist(const MatchCache *cache, size_t pos, int len) {
+	size_t i = pos - cache->start;
+	for (int b = 0; b < cache->count[i]; b++) {
+		if (cache->lens[i * CACHE_LENGTH + b] >= len) return cache->dists[i * CACHE_LENGTH + b];
+	}
+	return 0;
+}
+
+static int cache_longest(const MatchCache *cache, size_t pos, int *dist) {
+	size_t i = pos - cache->start;
+	int count = cache->count[i];
+	*dist = count ? cache->dists[i * CACHE_LENGTH + count - 1] : 0;
+	return count ? cache->lens[i * CACHE_LENGTH + count - 1] : 0;
+}
+
+// short far matches cost about what they save
+static inline int length_score(int len, int dist) {
+	return dist > 1024 ? len - 1 : len;
+}
+
+// zlib style lazy matching, from the hash or from a cache
+static void lazy_parse(Hash *h, const MatchCache *cache, size_t start, size_t end, Store *out) {
+	const uint8_t *data = h->data;
+	bool pending = false;
+	int prev_len = 0;
+	int prev_dist = 0;
+	for (size_t pos = start; pos < end; pos++) {
+		int dist;
+		int len = cache != NULL ? cache_longest(cache, pos, &dist)
+			: find_match(h, pos, MIN(MAX_MATCH, end - pos), SPLIT_CHAIN, &dist, NULL, NULL, NULL);
+		int score = length_score(len, dist);
+		int prev_score = length_score(prev_len, prev_dist);
+
+		if (pending) {
+			pending = false;
+			if (score > prev_score + 1) {
+				store_add(out, data[pos - 1], 0, pos - 1);
+				if (score >= MIN_MATCH && len < MAX_MATCH) {
+					pending = true;
+					prev_len = len;
+					prev_dist = dist;
+					continue;
+				}
+			} else {
+				store_add(out, prev_len, prev_dist, pos - 1);
+				pos += prev_len - 2;
+				continue;
+			}
+		} else if (score >= MIN_MATCH && len < MAX_MATCH) {
+			pending = true;
+			prev_len = len;
+			prev_dist = dist;
+			continue;
+		}
+
+		if (score >= MIN_MATCH) {
+			store_add(out, len, dist, pos);
+			pos += len - 1;
+		} else {
+			store_add(out, data[pos], 0, pos);
+		}
+	}
+}
+
+// ---- block splitting
+
+static size_t split_cost(const Store *s, size_t from, size_t at, size_t to) {
+	return block_cost(s, from, at) + block_cost(s, at, to);
+}
+
+// item in [start, end) that splits [from, to) most cheaply
+static size_t find_split(const Store *s, size_t from, size_t to, size_t start, size_t end, size_t *cost) {
+	if (end - start < LINEAR_SPLIT_SEARCH) {
+		size_t best = SIZE_MAX;
+		size_t at = start;
+		for (size_t i = start; i < end; i++) {
+			size_t c = split_cost(s, from, i, to);
+			if (c < best) {
+				best = c;
+				at = i;
+			}
+		}
+		*cost = best;
+		return at;
+	}
+
+	// narrow in around the best of a few evenly spaced samples
+	size_t at = start;
+	size_t last = SIZE_MAX;
+	while (end - start > SPLIT_SAMPLES) {
+		size_t p[SPLIT_SAMPLES];
+		size_t costs[SPLIT_SAMPLES];
+		int best = 0;
+		for (int i = 0; i < SPLIT_SAMPLES; i++) {
+			p[i] = start + (i + 1) * ((end - start) / (SPLIT_SAMPLES + 1));
+			costs[i] = split_cost(s, from, p[i], to);
+			if (costs[i] < costs[best]) best = i;
+		}
+		if (costs[best] > last) break;
+		start = best == 0 ? start : p[best - 1];
+		end = best == SPLIT_SAMPLES - 1 ? end : p[best + 1];
+		at = p[best];
+		last = costs[best];
+	}
+	*cost = last;
+	return at;
+}
+
+// split a parse where its statistics change, largest unsplit range first
+// returns the item indices the blocks start at (after the first)
+static int split_store(const Store *s, size_t *points, int max_blocks) {
+	if (s->size < 10) return 0;
+	bool *done = calloc(s->size, sizeof(bool));
+	assert(done != NULL);
+	int count = 0;
+	size_t from = 0;
+	size_t to = s->size;
+
+	while (count + 1 < max_blocks) {
+		size_t cost;
+		size_t at = find_split(s, from, to, from + 1, to, &cost);
+		if (cost > block_cost(s, from, to) || at == from + 1 || at == to) {
+			done[from] = true;
+		} else {
+			int i = count++;
+			while (i > 0 && points[i - 1] > at) {
+				points[i] = points[i - 1];
+				i--;
+			}
+			points[i] = at;
+		}
+
+		// the longest range that may still split
+		size_t longest = 0;
+		for (int i = 0; i <= count; i++) {
+			size_t a = i == 0 ? 0 : points[i - 1];
+			size_t b = i == count ? s->size : points[i];
+			if (!done[a] && b - a > longest) {
+				from = a;
+				to = b;
+				longest = b - a;
+			}
+		}
+		if (longest < 10) break;
+	}
+	free(done);
+	return count;
+}
+
+// ---- optimal parsing
+
+typedef struct {
+	size_t ll[NUM_LL];
+	size_t d[NUM_D];
+	double ll_bits[NUM_LL];
+	double d_bits[NUM_D];
+} Stats;
+
+static void entropy(const size_t *counts, int n, double *bits) {
+	size_t sum = 0;
+	for (int i = 0; i < n; i++) sum += counts[i];
+	double log2sum = log2(sum == 0 ? (size_t) n : sum);
+	for (int i = 0; i < n; i++) {
+		bits[i] = counts[i] == 0 ? log2sum : log2sum - log2(counts[i]);
+		if (bits[i] < 0) bits[i] = 0;
+	}
+}
+
+static void stats_from(Stats *stats, const Store *s) {
+	Counts c;
+	count_symbols(s, 0, s->size, &c);
+	memcpy(stats->ll, c.ll, sizeof(c.ll));
+	memcpy(stats->d, c.d, sizeof(c.d));
+}
+
+static void stats_entropy(Stats *stats) {
+	entropy(stats->ll, NUM_LL, stats->ll_bits);
+	entropy(stats->d, NUM_D, stats->d_bits);
+}
+
+// blend in the previous pass; converges slower but to better parses
+static void stats_blend(Stats *stats, const Stats *last) {
+	for (int i = 0; i < NUM_LL; i++) stats->ll[i] += last->ll[i] / 2;
+	for (int i = 0; i < NUM_D; i++) stats->d[i] += last->d[i] / 2;
+	stats->ll[END_OF_BLOCK] = 1;
+}
+
+// multiply with carry, so the output never depends on anything but the input
+typedef struct {
+	uint32_t w;
+	uint32_t z;
+} Random;
+
+static uint32_t random_next(Random *r) {
+	r->z = 36969 * (r->z & 65535) + (r->z >> 16);
+	r->w = 18000 * (r->w & 65535) + (r->w >> 16);
+	return (r->z << 16) + r->w;
+}
+
+static void randomize(Random *r, size_t *counts, int n) {
+	for (int i = 0; i < n; i++) {
+		if ((random_next(r) >> 4) % 3 == 0) counts[i] = counts[random_next(r) % n];
+	}
+}
+
+// bits per symbol under the statistics of the previous pass
+typedef struct {
+	double ll[NUM_LL];
+	double length[MAX_MATCH + 1];	// symbol and extra bits
+	double dist[NUM_D];	// symbol and extra bits
+	double min_match;	// no match costs less
+} CostModel;
+
+static void cost_model(CostModel *m, const Stats *stats) {
+	memcpy(m->ll, stats->ll_bits, sizeof(m->ll));
+	double min_length = LARGE_COST;
+	for (int l = MIN_MATCH; l <= MAX_MATCH; l++) {
+		int s = length_symbols[l];
+		m->length[l] = stats->ll_bits[257 + s] + length_extra[s];
+		min_length = MIN(min_length, m->length[l]);
+	}
+	double min_dist = LARGE_COST;
+	for (int s = 0; s < 30; s++) {
+		m->dist[s] = stats->d_bits[s] + dist_extra[s];
+		min_dist = MIN(min_dist, m->dist[s]);
+	}
+	m->min_match = min_length + min_dist;
+}
+
+typedef struct {
+	double *costs;
+	uint16_t *steps;
+	uint16_t *path;
+} Scratch;
+
+// cheapest parse of [start, end) under the cost model: a shortest path where
+// every position links to the next by a literal or any match the cache holds
+static void optimal_parse(Hash *h, const MatchCache *cache, size_t start, size_t end,
+		const CostModel *m, Scratch *scratch, Store *out) {
+	const uint8_t *data = h->data;
+	size_t n = end - start;
+	double *costs = scratch->costs;
+	uint16_t *steps = scratch->steps;
+	costs[0] = 0;
+	for (size_t i = 1; i <= n; i++) costs[i] = LARGE_COST;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t pos = start + i;
+		// deep inside a long run every step is a whole length 258 match at distance 1
+		if (h->same[pos - h->base] > MAX_MATCH * 2 && i > MAX_MATCH + 1
+				&& h->same[pos - MAX_MATCH - h->base] > MAX_MATCH) {
+			double step = m->length[MAX_MATCH] + m->dist[0];
+			for (int k = 0; k < MAX_MATCH; k++, i++) {
+				costs[i + MAX_MATCH] = costs[i] + step;
+				steps[i + MAX_MATCH] = MAX_MATCH;
+			}
+			pos = start + i;
+		}
+
+		double here = costs[i];
+		double literal = here + m->ll[data[pos]];
+		if (literal < costs[i + 1]) {
+			costs[i + 1] = literal;
+			steps[i + 1] = 1;
+		}
+
+		double floor = here + m->min_match;
+		const uint16_t *lens = cache->lens + i * CACHE_LENGTH;
+		const uint16_t *dists = cache->dists + i * CACHE_LENGTH;
+		int from = MIN_MATCH;
+		for (int b = 0; b < cache->count[i]; b++) {
+			double base = here + m->dist[dist_symbol(dists[b])];
+			for (int l = from; l <= lens[b]; l++) {
+				// already as cheap as any match could make it
+				if (costs[i + l] <= floor) continue;
+				double c = base + m->length[l];
+				if (c < costs[i + l]) {
+					costs[i + l] = c;
+					steps[i + l] = l;
+				}
+			}
+			from = lens[b] + 1;
+		}
+	}
+
+	// walk the path back from the end, then replay it forwards
+	uint16_t *path = scratch->path;
+	size_t count = 0;
+	for (size_t i = n; i > 0; i -= steps[i]) path[count++] = steps[i];
+	out->size = 0;
+	size_t pos = start;
+	while (count-- > 0) {
+		int len = path[count];
+		if (len == 1) {
+			store_add(out, data[pos], 0, pos);
+		} else {
+			int dist = cache_dist(cache, pos, len);
+			// only the long run shortcut takes matches the cache lacks
+			store_add(out, len, dist ? dist : 1, pos);
+		}
+		pos += len;
+	}
+}
+
+// iterate optimal parses of one block, each under the statistics of the last
+static void optimize_block(const uint8_t *data, size_t start, size_t end, int iterations, Store *best) {
+	size_t base = start > WINDOW_SIZE ? start - WINDOW_SIZE : 0;
+	Hash *h = hash_create(data, base, end);
+	MatchCache cache;
+	cache_build(&cache, h, start, end);
+
+	size_t n = end - start;
+	Scratch scratch;
+	scratch.costs = malloc(sizeof(double) * (n + 1));
+	scratch.steps = malloc(sizeof(uint16_t) * (n + 1));
+	scratch.path = malloc(sizeof(uint16_t) * (n + 1));
+	assert(scratch.costs != NULL && scratch.steps != NULL && scratch.path != NULL);
+
+	Store current = {0};
+	lazy_parse(h, &cache, start, end, &current);
+	store_copy(best, &current);
+
+	Stats stats;
+	Stats last;
+	Stats best_stats;
+	stats_from(&stats, &current);
+	stats_entropy(&stats);
+	Random random = { 1, 2 };
+	size_t best_cost = SIZE_MAX;
+	size_t last_cost = 0;
+	bool randomized = false;
+
+	for (int it = 0; it < iterations; it++) {
+		CostModel model;
+		cost_model(&model, &stats);
+		optimal_parse(h, &cache, start, end, &model, &scratch, &current);
+
+		Counts c;
+		count_symbols(&current, 0, current.size, &c);
+		unsigned ll_lengths[NUM_LL];
+		unsigned d_lengths[NUM_D];
+		size_t cost = dynamic_block_bits(&c, ll_lengths, d_lengths);
+		if (cost < best_cost) {
+			store_copy(best, &current);
+			best_stats = stats;
+			best_cost = cost;
+		}
+
+		last = stats;
+		stats_from(&stats, &current);
+		if (randomized) stats_blend(&stats, &last);
+		// stuck: start again from the best statistics, shaken up
+		if (it > 5 && cost == last_cost) {
+			stats = best_stats;
+			randomize(&random, stats.ll, NUM_LL);
+			randomize(&random, stats.d, NUM_D);
+			stats.ll[END_OF_BLOCK] = 1;
+			randomized = true;
+		}
+		stats_entropy(&stats);
+		last_cost = cost;
+	}
+
+	store_free(&current);
+	free(scratch.costs);
+	free(scratch.steps);
+	free(scratch.path);
+	cache_free(&cache);
+	hash_free(h);
+}
+
+// ---- output
+
+static void write_symbols(Bits *out, const Store *s, const unsigned *ll_lengths, const unsigned *d_lengths) {
+	unsigned ll_codes[NUM_LL];
+	unsigned d_codes[NUM_D];
+	lengths_to_codes(ll_lengths, NUM_LL, ll_codes);
+	lengths_to_codes(d_lengths, NUM_D, d_codes);
+	for (size_t i = 0; i < s->size; i++) {
+		int litlen = s->litlen[i];
+		if (s->dist[i] == 0) {
+			add_code(out, ll_codes[litlen], ll_lengths[litlen]);
+			continue;
+		}
+		int ls = length_symbols[litlen];
+		add_code(out, ll_codes[257 + ls], ll_lengths[257 + ls]);
+		add_bits(out, litlen - length_base[ls], length_extra[ls]);
+		int ds = dist_symbol(s->dist[i]);
+		add_code(out, d_codes[ds], d_lengths[ds]);
+		add_bits(out, s->dist[i] - dist_base[ds], dist_extra[ds]);
+	}
+	add_code(out, ll_codes[END_OF_BLOCK], ll_lengths[END_OF_BLOCK]);
+}
+
+static void write_stored(Bits *out, const uint8_t *data, size_t start, size_t end, bool final) {
+	size_t pos = start;
+	do {
+		size_t len = MIN(end - pos, MAX_STORED_BLOCK);
+		add_bit(out, final && pos + len == end);
+		add_bits(out, 0, 2);
+		add_byte(out, len & 0xFF);
+		add_byte(out, len >> 8);
+		add_byte(out, ~len & 0xFF);
+		add_byte(out, (~len >> 8) & 0xFF);
+		for (size_t i = 0; i < len; i++) add_byte(out, data[pos + i]);
+		pos += len;
+	} while (pos < end);
+}
+
+// whichever of stored, fixed or dynamic is smallest for this parse
+static void write_block(Bits *out, const uint8_t *data, size_t start, size_t end, const Store *s, bool final) {
+	Counts c;
+	count_symbols(s, 0, s->size, &c);
+	unsigned ll_lengths[NUM_LL];
+	unsigned d_lengths[NUM_D];
+	size_t dynamic = dynamic_block_bits(&c, ll_lengths, d_lengths);
+	size_t fixed = fixed_block_bits(&c);
+	size_t stored = stored_block_bits(end - start);
+
+	if (stored < dynamic && stored < fixed) {
+		write_stored(out, data, start, end, final);
+		return;
+	}
+	add_bit(out, final);
+	if (fixed <= dynamic) {
+		add_bits(out, 1, 2);
+		fixed_lengths(ll_lengths, d_lengths);
+	} else {
+		add_bits(out, 2, 2);
+		int variant = 0;
+		tree_size(ll_lengths, d_lengths, &variant);
+		encode_tree(ll_lengths, d_lengths, variant & 1, variant & 2, variant & 4, out);
+	}
+	write_symbols(out, s, ll_lengths, d_lengths);
+}
+
+// ---- driver
+
+typedef struct {
+	const uint8_t *data;
+	size_t length;
+	int iterations;
+	int next;	// next work item, taken atomically
+	// segments and the split points found in each
+	int segments;
+	size_t (*splits)[MAX_SEGMENT_BLOCKS];
+	int *num_splits;
+	// blocks, largest first in order so the last one to finish is short
+	size_t *starts;
+	int blocks;
+	int *order;
+	Store *stores;
+} Work;
+
+static void *split_worker(void *arg) {
+	Work *w = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->segments) {
+		size_t start = (size_t) i * SEGMENT_SIZE;
+		size_t end = MIN(start + SEGMENT_SIZE, w->length);
+		Hash *h = hash_create(w->data, start > WINDOW_SIZE ? start - WINDOW_SIZE : 0, end);
+		hash_advance(h, start);
+		Store s = {0};
+		lazy_parse(h, NULL, start, end, &s);
+		size_t points[MAX_SEGMENT_BLOCKS];
+		int count = split_store(&s, points, MAX_SEGMENT_BLOCKS);
+		for (int p = 0; p < count; p++) {
+			w->splits[i][p] = s.pos[points[p]];
+		}
+		w->num_splits[i] = count;
+		store_free(&s);
+		hash_free(h);
+	}
+	return NULL;
+}
+
+static void *block_worker(void *arg) {
+	Work *w = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->blocks) {
+		int b = w->order[i];
+		optimize_block(w->data, w->starts[b], w->starts[b + 1], w->iterations, &w->stores[b]);
+	}
+	return NULL;
+}
+
+static void run_workers(Work *w, int items, void *(*fn)(void *)) {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int workers = MAX(1, MIN(cores, items));
+	pthread_t threads[workers];
+	w->next = 0;
+	for (int t = 1; t < workers; t++) {
+		panic_if(pthread_create(&threads[t], NULL, fn, w) != 0, "Failed to start deflate worker");
+	}
+	fn(w);
+	for (int t = 1; t < workers; t++) {
+		pthread_join(threads[t], NULL);
+	}
+}
+
+typedef struct {
+	size_t size;
+	int block;
+} BlockSize;
+
+static int compare_sizes(const void *a, const void *b) {
+	const BlockSize *x = a;
+	const BlockSize *y = b;
+	if (x->size != y->size) return x->size > y->size ? -1 : 1;
+	return x->block - y->block;
+}
+
+void *zopfli_compress(const uint8_t *data, size_t length, int iterations, int *out_length) {
+	pthread_once(&tables_once, build_tables);
+
+	Work w = { .data = data, .length = length, .iterations = iterations };
+	w.segments = (length + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+	w.splits = malloc(sizeof(*w.splits) * MAX(w.segments, 1));
+	w.num_splits = calloc(MAX(w.segments, 1), sizeof(int));
+	assert(w.splits != NULL && w.num_splits != NULL);
+	run_workers(&w, w.segments, split_worker);
+
+	int max_blocks = w.segments * MAX_SEGMENT_BLOCKS;
+	w.starts = malloc(sizeof(size_t) * (max_blocks + 1));
+	assert(w.starts != NULL);
+	for (int s = 0; s < w.segments; s++) {
+		w.starts[w.blocks++] = (size_t) s * SEGMENT_SIZE;
+		for (int p = 0; p < w.num_splits[s]; p++) {
+			w.starts[w.blocks++] = w.splits[s][p];
+		}
+	}
+	w.starts[w.blocks] = length;
+
+	w.order = malloc(sizeof(int) * MAX(w.blocks, 1));
+	w.stores = calloc(MAX(w.blocks, 1), sizeof(Store));
+	assert(w.order != NULL && w.stores != NULL);
+	BlockSize *sizes = malloc(sizeof(BlockSize) * MAX(w.blocks, 1));
+	assert(sizes != NULL);
+	for (int b = 0; b < w.blocks; b++) {
+		sizes[b] = (BlockSize) { w.starts[b + 1] - w.starts[b], b };
+	}
+	qsort(sizes, w.blocks, sizeof(BlockSize), compare_sizes);
+	for (int b = 0; b < w.blocks; b++) w.order[b] = sizes[b].block;
+	free(sizes);
+	run_workers(&w, w.blocks, block_worker);
+
+	// zlib header: deflate, 32K window, maximum compression
+	Bits out = {0};
+	add_byte(&out, 0x78);
+	add_byte(&out, 0xDA);
+	if (w.blocks == 0) {
+		// a fixed block holding only the end code
+		add_bits(&out, 1, 1);
+		add_bits(&out, 1, 2);
+		add_bits(&out, 0, 7);
+	}
+	for (int b = 0; b < w.blocks; b++) {
+		write_block(&out, data, w.starts[b], w.starts[b + 1], &w.stores[b], b == w.blocks - 1);
+		store_free(&w.stores[b]);
+	}
+	uint32_t adler = adler32(adler32(0, Z_NULL, 0), data, length);
+	for (int i = 3; i >= 0; i--) add_byte(&out, adler >> (8 * i));
+
+	free(w.splits);
+	free(w.num_splits);
+	free(w.starts);
+	free(w.order);
+	free(w.stores);
+	*out_length = out.size;
+	return out.data;
+}
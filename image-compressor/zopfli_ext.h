@@ -0,0 +1,20 @@
+#ifndef ZOPFLI_H
+#define ZOPFLI_H
+
+// default number of optimal parsing passes per block
+#define DEFAULT_ZOPFLI_ITERATIONS 15
+
+// deflate length bytes of data into a standard zlib stream, spending far more
+// time than zlib for a smaller result, in the style of Zopfli:
+//   - the input is cut into blocks where the symbol statistics change, judged
+//     on a quick lazy parse
+//   - every block is parsed as a shortest path over all matches, under a cost
+//     model taken from the previous pass, iterations times, keeping the best
+//   - Huffman codes are optimal under the 15 bit limit, smoothed when that
+//     makes the code length header cheaper, and the header picks its cheapest
+//     run length encoding
+// blocks are parsed in parallel on every core; the output does not depend on
+// the number of cores
+extern void *zopfli_compress(const uint8_t *data, size_t length, int iterations, int *out_length);
+
+#endif